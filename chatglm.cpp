@@ -8,6 +8,7 @@
 #include <iomanip>
 #include <iostream>
 #include <locale>
+#include <mutex>
 #include <numeric>
 #include <random>
 #include <regex>
@@ -178,6 +179,29 @@ void ggml_graph_compute_helper(std::vector<uninitialized_char> &buf, ggml_cgraph
     return out;
 }
 
+void DecodeGraphInputs::update(const std::vector<int> &next_input_ids,
+                               const std::vector<BatchedSequence> &next_seqs) {
+    memcpy(input_ids->data, next_input_ids.data(), ggml_nbytes(input_ids));
+    for (size_t i = 0; i < next_seqs.size(); i++) {
+        const BatchedSequence &seq = next_seqs[i];
+        int *kv_indices = (int *)seqs[i].kv_indices->data;
+        std::copy(seq.kv_rows.begin(), seq.kv_rows.end(), kv_indices);
+        std::fill(kv_indices + seq.kv_rows.size(), kv_indices + seqs[i].kv_indices->ne[0], seq.kv_rows.front());
+        // store the new token to its own row
+        const int row = seq.kv_rows[seq.n_past];
+        for (ggml_tensor *write : seqs[i].kv_writes) {
+            // the copy writes through its own view of the destination view, both rooted at the kv cache itself
+            for (ggml_tensor *view : {write->src[1], write}) {
+                view->view_offs = row * view->view_src->nb[1];
+                view->data = (char *)view->view_src->data + view->view_offs;
+            }
+        }
+        for (ggml_tensor *op : seqs[i].past_ops) {
+            op->op_params[0] = seq.n_past;
+        }
+    }
+}
+
 void ModelContext::init_device_context() {
 #ifdef GGML_USE_METAL
     ctx_metal = make_unique_ggml_metal_context(1);
@@ -199,6 +223,131 @@ void ModelContext::init_device_context() {
 #endif
 }
 
+// ===== tracing =====
+
+std::atomic<bool> Tracer::enabled_{false};
+
+// Spans of one thread, which is their only writer. A reader takes a slot only if its sequence number is complete and
+// unchanged across the copy, so a slot being overwritten meanwhile is skipped rather than torn.
+struct TraceRing {
+    struct Slot {
+        std::atomic<uint64_t> seq{0}; // 2 * n + 2 once span n is written, odd while writing
+        std::atomic<const char *> name{nullptr};
+        std::atomic<int64_t> start_us{0};
+        std::atomic<int64_t> dur_us{0};
+        std::atomic<int64_t> id{0};
+    };
+
+    int tid = 0;
+    std::string thread_name;        // guarded by the registry mutex
+    std::atomic<uint64_t> head{0}; // number of spans recorded so far
+    std::unique_ptr<Slot[]> slots{new Slot[Tracer::RING_SIZE]};
+};
+
+struct TraceRegistry {
+    std::mutex mutex;
+    std::vector<std::shared_ptr<TraceRing>> rings; // kept after their threads exit
+};
+
+static TraceRegistry &trace_registry() {
+    static TraceRegistry registry;
+    return registry;
+}
+
+// the ring of the calling thread is only allocated by its first span
+static thread_local std::shared_ptr<TraceRing> local_ring;
+static thread_local std::string local_thread_name;
+
+static TraceRing &local_trace_ring() {
+    if (!local_ring) {
+        local_ring = std::make_shared<TraceRing>();
+        TraceRegistry &registry = trace_registry();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        local_ring->tid = registry.rings.size() + 1;
+        local_ring->thread_name = local_thread_name;
+        registry.rings.emplace_back(local_ring);
+    }
+    return *local_ring;
+}
+
+void Tracer::set_enabled(bool enabled) { enabled_.store(enabled, std::memory_order_relaxed); }
+
+void Tracer::record(const char *name, int64_t start_us, int64_t end_us, int64_t id) {
+    TraceRing &ring = local_trace_ring();
+    const uint64_t n = ring.head.load(std::memory_order_relaxed);
+    TraceRing::Slot &slot = ring.slots[n % RING_SIZE];
+    slot.seq.store(2 * n + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot.name.store(name, std::memory_order_relaxed);
+    slot.start_us.store(start_us, std::memory_order_relaxed);
+    slot.dur_us.store(end_us - start_us, std::memory_order_relaxed);
+    slot.id.store(id, std::memory_order_relaxed);
+    slot.seq.store(2 * n + 2, std::memory_order_release);
+    ring.head.store(n + 1, std::memory_order_release);
+}
+
+void Tracer::set_thread_name(const std::string &name) {
+    std::lock_guard<std::mutex> lock(trace_registry().mutex);
+    local_thread_name = name;
+    if (local_ring) {
+        local_ring->thread_name = name;
+    }
+}
+
+static std::string json_escape(const std::string &s) {
+    std::string escaped;
+    for (char c : s) {
+        if (c == '"' || c == '\\') {
+            escaped += '\\';
+        }
+        escaped += ((unsigned char)c < 0x20) ? ' ' : c;
+    }
+    return escaped;
+}
+
+void Tracer::dump(std::ostream &os) {
+    std::vector<std::pair<std::shared_ptr<TraceRing>, std::string>> rings;
+    {
+        TraceRegistry &registry = trace_registry();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        for (const auto &ring : registry.rings) {
+            rings.emplace_back(ring, ring->thread_name);
+        }
+    }
+
+    os << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    const char *sep = "";
+    for (const auto &item : rings) {
+        const TraceRing &ring = *item.first;
+        if (!item.second.empty()) {
+            os << sep << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << ring.tid
+               << ",\"args\":{\"name\":\"" << json_escape(item.second) << "\"}}";
+            sep = ",";
+        }
+        const uint64_t head = ring.head.load(std::memory_order_acquire);
+        for (uint64_t n = (head > RING_SIZE) ? head - RING_SIZE : 0; n < head; n++) {
+            const TraceRing::Slot &slot = ring.slots[n % RING_SIZE];
+            const uint64_t seq = slot.seq.load(std::memory_order_acquire);
+            const char *name = slot.name.load(std::memory_order_relaxed);
+            const int64_t start_us = slot.start_us.load(std::memory_order_relaxed);
+            const int64_t dur_us = slot.dur_us.load(std::memory_order_relaxed);
+            const int64_t id = slot.id.load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (seq != 2 * n + 2 || slot.seq.load(std::memory_order_relaxed) != seq) {
+                continue; // overwritten by a newer span
+            }
+            os << sep << "{\"name\":\"" << json_escape(name) << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << ring.tid
+               << ",\"ts\":" << start_us << ",\"dur\":" << dur_us;
+            if (id != 0) {
+                os << ",\"args\":{\"id\":" << id << "}";
+            }
+            os << "}";
+            sep = ",";
+        }
+    }
+    os << "]}";
+}
+
 // ===== streamer =====
 
 void StreamerGroup::put(const std::vector<int> &output_ids) {
@@ -482,12 +631,152 @@ std::string to_string(ModelType model_type) {
     }
 }
 
+KVBlockAllocator::KVBlockAllocator(int num_blocks, int block_size)
+    : num_blocks_(num_blocks), block_size_(block_size), free_blocks_(num_blocks), ref_counts_(num_blocks) {
+    // lowest blocks first, so that a fresh sequence gets consecutive rows
+    std::iota(free_blocks_.rbegin(), free_blocks_.rend(), 0);
+}
+
+bool KVBlockAllocator::reserve(std::vector<int> &block_table, int num_tokens) {
+    const int num_needed = num_blocks_needed(block_table, num_tokens);
+    if (num_needed > (int)free_blocks_.size()) {
+        return false;
+    }
+    for (int i = 0; i < num_needed; i++) {
+        const int block = free_blocks_.back();
+        free_blocks_.pop_back();
+        ref_counts_[block] = 1;
+        block_table.emplace_back(block);
+    }
+    return true;
+}
+
+void KVBlockAllocator::truncate(std::vector<int> &block_table, int num_tokens) {
+    const size_t num_kept = (num_tokens + block_size_ - 1) / block_size_;
+    if (num_kept < block_table.size()) {
+        std::vector<int> dropped(block_table.begin() + num_kept, block_table.end());
+        release(dropped);
+        block_table.resize(num_kept);
+    }
+}
+
+int KVBlockAllocator::copy_on_write(std::vector<int> &block_table, int pos) {
+    int &block = block_table.at(pos / block_size_);
+    if (ref_counts_[block] == 1) {
+        return -1;
+    }
+    CHATGLM_CHECK(!free_blocks_.empty()) << "kv cache is full: no free block to copy block " << block << " into";
+    const int src = block;
+    ref_counts_[src]--;
+    block = free_blocks_.back();
+    free_blocks_.pop_back();
+    ref_counts_[block] = 1;
+    return src;
+}
+
+void KVBlockAllocator::release(std::vector<int> &block_table) {
+    for (auto it = block_table.rbegin(); it != block_table.rend(); it++) {
+        CHATGLM_CHECK(ref_counts_[*it] > 0) << "releasing free kv cache block " << *it;
+        if (--ref_counts_[*it] == 0) {
+            free_blocks_.emplace_back(*it);
+        }
+    }
+    block_table.clear();
+}
+
+std::vector<int> KVBlockAllocator::rows(const std::vector<int> &block_table, int num_tokens) const {
+    CHATGLM_CHECK(num_tokens <= (int)block_table.size() * block_size_)
+        << "block table of " << block_table.size() << " blocks cannot hold " << num_tokens << " tokens";
+    std::vector<int> kv_rows(num_tokens);
+    for (int i = 0; i < num_tokens; i++) {
+        kv_rows[i] = block_table[i / block_size_] * block_size_ + i % block_size_;
+    }
+    return kv_rows;
+}
+
+int PrefixCache::match(const std::vector<int> &input_ids, std::vector<int> &block_table) {
+    CHATGLM_CHECK(block_table.empty()) << "prefix can only be matched into an empty block table";
+    if (!enabled_) {
+        return 0;
+    }
+    const int block_size = allocator_->block_size();
+    const int max_blocks = std::max((int)input_ids.size() - 1, 0) / block_size;
+    clock_++;
+    Node *node = &root_;
+    for (int i = 0; i < max_blocks; i++) {
+        std::vector<int> tokens(input_ids.begin() + i * block_size, input_ids.begin() + (i + 1) * block_size);
+        auto it = node->children.find(tokens);
+        if (it == node->children.end()) {
+            break;
+        }
+        node = it->second.get();
+        node->last_access = clock_;
+        allocator_->share(node->block);
+        block_table.emplace_back(node->block);
+    }
+    return block_table.size() * block_size;
+}
+
+void PrefixCache::insert(const std::vector<int> &input_ids, const std::vector<int> &block_table, int num_tokens) {
+    if (!enabled_) {
+        return;
+    }
+    const int block_size = allocator_->block_size();
+    const int num_blocks = std::min(num_tokens / block_size, (int)block_table.size());
+    clock_++;
+    Node *node = &root_;
+    for (int i = 0; i < num_blocks; i++) {
+        std::vector<int> tokens(input_ids.begin() + i * block_size, input_ids.begin() + (i + 1) * block_size);
+        std::unique_ptr<Node> &child = node->children[tokens];
+        if (!child) {
+            child = std::make_unique<Node>();
+            child->tokens = std::move(tokens);
+            child->block = block_table[i];
+            child->parent = node;
+            allocator_->share(child->block);
+            num_cached_blocks_++;
+        }
+        child->last_access = clock_;
+        node = child.get();
+    }
+}
+
+bool PrefixCache::evict(int num_blocks) {
+    while (allocator_->num_free_blocks() < num_blocks) {
+        // least recently used leaf whose block is only referenced by the cache
+        Node *victim = nullptr;
+        std::vector<Node *> stack{&root_};
+        while (!stack.empty()) {
+            Node *node = stack.back();
+            stack.pop_back();
+            for (auto &item : node->children) {
+                stack.emplace_back(item.second.get());
+            }
+            if (node != &root_ && node->children.empty() && allocator_->ref_count(node->block) == 1 &&
+                (!victim || node->last_access < victim->last_access)) {
+                victim = node;
+            }
+        }
+        if (!victim) {
+            return false;
+        }
+        std::vector<int> blocks{victim->block};
+        allocator_->release(blocks);
+        std::vector<int> tokens = std::move(victim->tokens);
+        victim->parent->children.erase(tokens);
+        num_cached_blocks_--;
+    }
+    return true;
+}
+
 BaseModelForCausalLM::BaseModelForCausalLM(ModelConfig config, size_t mem_size, size_t scratch_size, size_t num_weights)
-    : config(config) {
+    : config(config), kv_allocator(config.num_kv_cache_blocks(), config.kv_block_size),
+      // kv cache of a chatglm prompt depends on the whole prompt through its bidirectional attention
+      prefix_cache(&kv_allocator, config.model_type != ModelType::CHATGLM) {
     ctx_.dtype = config.dtype;
     const size_t ctx_w_size = num_weights * ggml_tensor_overhead();
     const size_t ctx_kv_size = 2 * config.num_hidden_layers *
-                               (config.max_length * config.hidden_size / config.num_attention_heads *
+                               (config.kv_cache_size() * config.hidden_size / config.num_attention_heads *
                                     config.num_kv_heads * ggml_type_size(GGML_TYPE_F16) +
                                 ggml_tensor_overhead());
     ctx_.ctx_w = make_unique_ggml_context(ctx_w_size, nullptr, true);
@@ -503,44 +792,239 @@ BaseModelForCausalLM::BaseModelForCausalLM(ModelConfig config, size_t mem_size,
 
 ggml_tensor *BaseModelForCausalLM::forward_graph_compute(const std::vector<int> &input_ids, int n_past, int n_ctx,
                                                          int n_threads, bool is_decoding) {
-    ctx_.ctx_b = make_unique_ggml_context(ctx_.compute_buffer.size(), ctx_.compute_buffer.data(), false);
-    ctx_.gf = {};
+    if (n_past == 0) {
+        kv_allocator.release(default_block_table_); // a new sequence, possibly sharing blocks with the prefix cache
+    }
+    return forward_graph_compute(input_ids, n_past, n_ctx, n_threads, is_decoding, default_block_table_);
+}
+
+ggml_tensor *BaseModelForCausalLM::forward_graph_compute(const std::vector<int> &input_ids, int n_past, int n_ctx,
+                                                         int n_threads, bool is_decoding,
+                                                         std::vector<int> &block_table) {
+    prefix_cache.evict(kv_allocator.num_blocks_needed(block_table, input_ids.size()));
+    CHATGLM_CHECK(kv_allocator.reserve(block_table, input_ids.size()))
+        << "kv cache is full: " << input_ids.size() << " tokens requested but only "
+        << kv_allocator.num_free_blocks() * kv_allocator.block_size() << " more available";
+    std::vector<int> curr_input_ids(input_ids.begin() + n_past, input_ids.end());
+    return forward_graph_compute(
+        curr_input_ids, {{kv_allocator.rows(block_table, input_ids.size()), (int)curr_input_ids.size(), n_past, n_ctx}},
+        n_threads, is_decoding);
+}
+
+ggml_tensor *BaseModelForCausalLM::forward_graph_compute(const std::vector<int> &input_ids,
+                                                         const std::vector<BatchedSequence> &seqs, int n_threads,
+                                                         bool is_decoding) {
+    return graph_compute(input_ids, seqs, n_threads, is_decoding, false);
+}
+
+ggml_tensor *BaseModelForCausalLM::graph_compute(const std::vector<int> &input_ids,
+                                                 const std::vector<BatchedSequence> &seqs, int n_threads,
+                                                 bool is_decoding, bool hidden_states_only) {
+    CHATGLM_CHECK(!seqs.empty()) << "no sequence to forward";
+    int total_qlen = 0;
+    for (const auto &seq : seqs) {
+        CHATGLM_CHECK((int)seq.kv_rows.size() == seq.n_past + seq.qlen)
+            << "expect " << seq.n_past + seq.qlen << " kv rows, got " << seq.kv_rows.size();
+        CHATGLM_CHECK(seq.qlen > 0 && seq.n_past + seq.qlen <= config.max_length)
+            << "sequence length " << seq.n_past + seq.qlen << " exceeds model's max_length (" << config.max_length
+            << ")";
+        total_qlen += seq.qlen;
+    }
+    CHATGLM_CHECK(total_qlen == (int)input_ids.size())
+        << "got " << input_ids.size() << " input ids but sequences expect " << total_qlen;
 
     if (n_threads <= 0) {
         n_threads = get_default_num_threads(); // default thread num
     }
-    int curr_input_ids_size = input_ids.size() - n_past;
-    if (curr_input_ids_size >= 32 && ggml_cpu_has_blas() && !ggml_cpu_has_gpublas()) {
+    if (total_qlen >= 32 && ggml_cpu_has_blas() && !ggml_cpu_has_gpublas()) {
         n_threads = 1; // use 1 thread if BLAS is enabled
     }
 
-    ggml_tensor *curr_input_ids = ggml_new_tensor_1d(ctx_.ctx_b.get(), GGML_TYPE_I32, curr_input_ids_size);
-    memcpy(curr_input_ids->data, input_ids.data() + n_past, ggml_nbytes(curr_input_ids));
-
-    ggml_tensor *lm_logits = forward(&ctx_, curr_input_ids, n_past, n_ctx, is_decoding);
-    lm_logits->backend = GGML_BACKEND_CPU;
+    // A decode step, one new token per sequence, is built with the kv rows of each sequence padded to a multiple of
+    // DECODE_GRAPH_KV_STEP. The following steps run the same graph as long as the padded lengths stay the same.
+    std::vector<int> decode_key;
+#ifndef GGML_USE_CUBLAS // inputs on the gpu cannot be rewritten in place
+    if (!hidden_states_only &&
+        std::all_of(seqs.begin(), seqs.end(), [](const BatchedSequence &seq) { return seq.qlen == 1; })) {
+        for (const auto &seq : seqs) {
+            const int padded_klen = (seq.n_past + DECODE_GRAPH_KV_STEP) / DECODE_GRAPH_KV_STEP * DECODE_GRAPH_KV_STEP;
+            decode_key.push_back(std::min(padded_klen, config.max_length));
+            decode_key.push_back(seq.n_ctx);
+        }
+    }
+#endif
 
-    ggml_build_forward_expand(&ctx_.gf, lm_logits);
+    ggml_tensor *outputs;
+    if (!decode_key.empty() && decode_key == decode_graph_key_) {
+        TraceScope trace("graph_update");
+        update_decode_inputs(decode_graph_, input_ids, seqs);
+        outputs = decode_graph_outputs_;
+    } else {
+        TraceScope trace("graph_build");
+        ctx_.ctx_b = make_unique_ggml_context(ctx_.compute_buffer.size(), ctx_.compute_buffer.data(), false);
+        ctx_.gf = {};
+        graph_plan_threads_ = 0;
+        decode_graph_ = {};
+        decode_graph_key_.clear();
+
+        ggml_tensor *curr_input_ids = ggml_new_tensor_1d(ctx_.ctx_b.get(), GGML_TYPE_I32, total_qlen);
+        memcpy(curr_input_ids->data, input_ids.data(), ggml_nbytes(curr_input_ids));
+
+        std::vector<BatchedSequence> padded_seqs;
+        if (!decode_key.empty()) {
+            // padding gathers a row the sequence already holds, so that masked scores stay finite
+            padded_seqs = seqs;
+            for (size_t i = 0; i < seqs.size(); i++) {
+                padded_seqs[i].kv_rows.resize(decode_key[2 * i], seqs[i].kv_rows.front());
+            }
+            decode_graph_.input_ids = curr_input_ids;
+            ctx_.decode_inputs = &decode_graph_;
+        }
+        const std::vector<BatchedSequence> &graph_seqs = decode_key.empty() ? seqs : padded_seqs;
+        outputs = hidden_states_only ? forward_hidden_states(&ctx_, curr_input_ids, graph_seqs)
+                                     : forward(&ctx_, curr_input_ids, graph_seqs, is_decoding);
+        outputs->backend = GGML_BACKEND_CPU;
+        ctx_.decode_inputs = nullptr;
+
+        ggml_build_forward_expand(&ctx_.gf, outputs);
+        if (!decode_key.empty()) {
+            decode_graph_key_ = std::move(decode_key);
+            decode_graph_outputs_ = outputs;
+        }
+    }
+    {
+        TraceScope trace("graph_compute");
 #ifdef GGML_USE_METAL
-    ggml_metal_graph_compute(ctx_.ctx_metal.get(), &ctx_.gf);
+        ggml_metal_graph_compute(ctx_.ctx_metal.get(), &ctx_.gf);
 #else
-    ggml_graph_compute_helper(ctx_.work_buffer, &ctx_.gf, n_threads);
+        // the plan, and the work buffer it points into, serve every run of the same graph
+        if (graph_plan_threads_ != n_threads) {
+            graph_plan_ = ggml_graph_plan(&ctx_.gf, n_threads);
+            if (graph_plan_.work_size > 0) {
+                ctx_.work_buffer.resize(graph_plan_.work_size);
+                graph_plan_.work_data = (uint8_t *)ctx_.work_buffer.data();
+            }
+            graph_plan_threads_ = n_threads;
+        }
+        ggml_graph_compute(&ctx_.gf, &graph_plan_);
 #endif
+    }
 
 #ifdef GGML_PERF
     ggml_graph_print(&ctx_.gf);
 #endif
 
-    return lm_logits;
+    return outputs;
+}
+
+std::vector<std::vector<float>> BaseModelForCausalLM::embed(const std::vector<std::vector<int>> &inputs,
+                                                            PoolingType pooling, int n_threads) {
+    for (const auto &ids : inputs) {
+        CHATGLM_CHECK(!ids.empty() && (int)ids.size() <= config.max_length)
+            << "cannot embed an input of " << ids.size() << " tokens, expect 1 to " << config.max_length;
+    }
+
+    std::vector<std::vector<float>> embeddings;
+    embeddings.reserve(inputs.size());
+    size_t next = 0;
+    while (next < inputs.size()) {
+        // pack inputs into one graph until it holds max_length tokens, which the buffers are sized for, or as many
+        // sequences as its nodes allow
+        std::vector<int> input_ids;
+        std::vector<BatchedSequence> seqs;
+        std::vector<std::vector<int>> block_tables;
+        for (; next < inputs.size(); next++) {
+            const std::vector<int> &ids = inputs[next];
+            if (!seqs.empty() &&
+                (input_ids.size() + ids.size() > (size_t)config.max_length || (int)seqs.size() == max_graph_seqs())) {
+                break;
+            }
+            std::vector<int> block_table;
+            prefix_cache.evict(kv_allocator.num_blocks_needed(block_table, ids.size()));
+            if (!kv_allocator.reserve(block_table, ids.size())) {
+                CHATGLM_CHECK(!seqs.empty())
+                    << "kv cache is full: " << ids.size() << " tokens requested but only "
+                    << kv_allocator.num_free_blocks() * kv_allocator.block_size() << " more available";
+                break;
+            }
+            input_ids.insert(input_ids.end(), ids.begin(), ids.end());
+            seqs.push_back({kv_allocator.rows(block_table, ids.size()), (int)ids.size(), 0, (int)ids.size()});
+            block_tables.emplace_back(std::move(block_table));
+        }
+
+        ggml_tensor *hidden_states = graph_compute(input_ids, seqs, n_threads, false, true);
+        for (auto &block_table : block_tables) {
+            kv_allocator.release(block_table);
+        }
+
+        // hidden_states: [total_qlen, hidden_size]
+        const int hidden_size = hidden_states->ne[0];
+        const float *row = (float *)hidden_states->data;
+        for (const auto &seq : seqs) {
+            std::vector<float> embedding(hidden_size);
+            if (pooling == PoolingType::MEAN) {
+                for (int i = 0; i < seq.qlen; i++) {
+                    for (int j = 0; j < hidden_size; j++) {
+                        embedding[j] += row[i * hidden_size + j];
+                    }
+                }
+                for (float &x : embedding) {
+                    x /= seq.qlen;
+                }
+            } else {
+                std::copy_n(row + (seq.qlen - 1) * hidden_size, hidden_size, embedding.begin());
+            }
+            embeddings.emplace_back(std::move(embedding));
+            row += seq.qlen * hidden_size;
+        }
+    }
+    return embeddings;
+}
+
+MemoryUsage BaseModelForCausalLM::memory_usage() const {
+    MemoryUsage usage;
+    usage.weights = ctx_.weight_buffer.empty() ? ggml_get_mem_size(ctx_.ctx_w.get()) : ctx_.weight_buffer.size();
+    usage.kv_cache = ggml_get_mem_size(ctx_.ctx_kv.get());
+    usage.compute_buffer = ctx_.compute_buffer.size();
+    usage.scratch_buffer = ctx_.scratch_buffer.size();
+    usage.work_buffer = ctx_.work_buffer.size();
+    usage.kv_tokens_in_use = (kv_allocator.num_blocks() - kv_allocator.num_free_blocks()) * kv_allocator.block_size();
+    return usage;
 }
 
 int BaseModelForCausalLM::generate_next_token(const std::vector<int> &input_ids, const GenerationConfig &gen_config,
                                               int n_past, int n_ctx) {
+    TraceScope trace("generate_next_token");
     ggml_tensor *lm_logits = forward_graph_compute(input_ids, n_past, n_ctx, gen_config.num_threads, true);
+    return sample_next_token((float *)lm_logits->data, lm_logits->ne[0], input_ids, gen_config);
+}
+
+static std::mt19937 &random_engine() {
+    thread_local std::random_device rd;
+    thread_local std::mt19937 gen(rd());
+    return gen;
+}
 
-    int vocab_size = lm_logits->ne[0];
-    float *next_token_logits = (float *)lm_logits->data;
+int BaseModelForCausalLM::sample_next_token(float *next_token_logits, int vocab_size, const std::vector<int> &input_ids,
+                                            const GenerationConfig &gen_config) {
+    TraceScope trace("sample");
+    std::vector<TokenIdScore> token_scores =
+        sampling_distribution(next_token_logits, vocab_size, input_ids, gen_config);
+    if (token_scores.size() == 1) {
+        return token_scores.front().id;
+    }
 
+    // sample next token
+    for (size_t i = 0; i < token_scores.size(); i++) {
+        next_token_logits[i] = token_scores[i].score;
+    }
+    std::discrete_distribution<> dist(next_token_logits, next_token_logits + token_scores.size());
+    return token_scores[dist(random_engine())].id;
+}
+
+std::vector<TokenIdScore> BaseModelForCausalLM::sampling_distribution(float *next_token_logits, int vocab_size,
+                                                                      const std::vector<int> &input_ids,
+                                                                      const GenerationConfig &gen_config) {
     // check nan
     for (int i = 0; i < vocab_size; i++) {
         CHATGLM_CHECK(std::isfinite(next_token_logits[i])) << "nan/inf encountered at lm_logits[" << i << "]";
@@ -552,48 +1036,37 @@ int BaseModelForCausalLM::generate_next_token(const std::vector<int> &input_ids,
                                     gen_config.repetition_penalty);
     }
 
-    int next_token_id;
-    if (gen_config.do_sample) {
-        // temperature sampling
-        if (gen_config.temperature > 0) {
-            sampling_temperature(next_token_logits, next_token_logits + vocab_size, gen_config.temperature);
-        }
-
-        std::vector<TokenIdScore> token_scores(vocab_size);
-        for (int i = 0; i < vocab_size; i++) {
-            token_scores[i] = TokenIdScore(i, next_token_logits[i]);
-        }
-
-        // top_k sampling
-        if (0 < gen_config.top_k && gen_config.top_k < (int)token_scores.size()) {
-            sampling_top_k(token_scores.data(), token_scores.data() + gen_config.top_k,
-                           token_scores.data() + token_scores.size());
-            token_scores.resize(gen_config.top_k);
-        }
+    if (!gen_config.do_sample) {
+        // greedy search
+        int next_token_id = std::max_element(next_token_logits, next_token_logits + vocab_size) - next_token_logits;
+        return {TokenIdScore(next_token_id, 1.f)};
+    }
 
-        // top_p sampling
-        if (0.f < gen_config.top_p && gen_config.top_p < 1.f) {
-            auto pos = sampling_top_p(token_scores.data(), token_scores.data() + token_scores.size(), gen_config.top_p);
-            token_scores.resize(pos - token_scores.data());
-        }
+    // temperature sampling
+    if (gen_config.temperature > 0) {
+        sampling_temperature(next_token_logits, next_token_logits + vocab_size, gen_config.temperature);
+    }
 
-        // sample next token
-        sampling_softmax_inplace(token_scores.data(), token_scores.data() + token_scores.size());
-        for (size_t i = 0; i < token_scores.size(); i++) {
-            next_token_logits[i] = token_scores[i].score;
-        }
+    std::vector<TokenIdScore> token_scores(vocab_size);
+    for (int i = 0; i < vocab_size; i++) {
+        token_scores[i] = TokenIdScore(i, next_token_logits[i]);
+    }
 
-        thread_local std::random_device rd;
-        thread_local std::mt19937 gen(rd());
+    // top_k sampling
+    if (0 < gen_config.top_k && gen_config.top_k < (int)token_scores.size()) {
+        sampling_top_k(token_scores.data(), token_scores.data() + gen_config.top_k,
+                       token_scores.data() + token_scores.size());
+        token_scores.resize(gen_config.top_k);
+    }
 
-        std::discrete_distribution<> dist(next_token_logits, next_token_logits + token_scores.size());
-        next_token_id = token_scores[dist(gen)].id;
-    } else {
-        // greedy search
-        next_token_id = std::max_element(next_token_logits, next_token_logits + vocab_size) - next_token_logits;
+    // top_p sampling
+    if (0.f < gen_config.top_p && gen_config.top_p < 1.f) {
+        auto pos = sampling_top_p(token_scores.data(), token_scores.data() + token_scores.size(), gen_config.top_p);
+        token_scores.resize(pos - token_scores.data());
     }
 
-    return next_token_id;
+    sampling_softmax_inplace(token_scores.data(), token_scores.data() + token_scores.size());
+    return token_scores;
 }
 
 void BaseModelForCausalLM::sampling_repetition_penalty(float *first, float *last, const std::vector<int> &input_ids,
@@ -659,11 +1132,125 @@ void BaseModelForCausalLM::sampling_softmax_inplace(TokenIdScore *first, TokenId
     }
 }
 
+AhoCorasick::AhoCorasick(const std::vector<std::string> &patterns) {
+    // trie of the patterns
+    auto new_state = [this](int depth) {
+        next_.emplace_back();
+        next_.back().fill(-1);
+        depth_.emplace_back(depth);
+        output_.emplace_back(0);
+        return (int)next_.size() - 1;
+    };
+    new_state(0);
+    for (const auto &pattern : patterns) {
+        int state = 0;
+        for (unsigned char c : pattern) {
+            if (next_[state][c] < 0) {
+                const int child = new_state(depth_[state] + 1);
+                next_[state][c] = child;
+            }
+            state = next_[state][c];
+        }
+        output_[state] = pattern.size();
+    }
+
+    // breadth first, so that failure links point to states already complete
+    std::vector<int> fail(next_.size(), 0);
+    std::vector<int> queue;
+    for (int &child : next_[0]) {
+        if (child < 0) {
+            child = 0;
+        } else {
+            queue.emplace_back(child);
+        }
+    }
+    for (size_t i = 0; i < queue.size(); i++) {
+        const int state = queue[i];
+        if (output_[state] == 0) {
+            output_[state] = output_[fail[state]];
+        }
+        for (int c = 0; c < 256; c++) {
+            int &child = next_[state][c];
+            if (child < 0) {
+                child = next_[fail[state]][c];
+            } else {
+                fail[child] = next_[fail[state]][c];
+                queue.emplace_back(child);
+            }
+        }
+    }
+}
+
+size_t AhoCorasick::feed(std::string_view piece) {
+    size_t end = std::string::npos;
+    for (size_t i = 0; i < piece.size(); i++) {
+        state_ = next_[state_][(unsigned char)piece[i]];
+        if (end == std::string::npos && output_[state_] > 0) {
+            end = i + 1;
+            match_size_ = output_[state_];
+        }
+    }
+    return end;
+}
+
+bool StopStringMatcher::put(int token_id) {
+    if (automaton_.empty()) {
+        return false;
+    }
+    token_cache_.emplace_back(token_id);
+    std::string text = tokenizer_->decode(token_cache_);
+    if (text.size() >= 3 && text.compare(text.size() - 3, 3, "\xef\xbf\xbd") == 0) {
+        return false; // ends with an incomplete utf-8 character, wait for the rest
+    }
+    bool found = false;
+    if (text.size() > fed_len_) {
+        found = automaton_.feed(std::string_view(text).substr(fed_len_)) != std::string::npos;
+        fed_len_ = text.size();
+    }
+    if (!text.empty() && text.back() == '\n') {
+        // start over after newline so that decoding stays cheap
+        token_cache_.clear();
+        fed_len_ = 0;
+    }
+    return found;
+}
+
+void StopStringMatcher::truncate(std::string &text, const std::vector<std::string> &stop_strings) {
+    AhoCorasick automaton(stop_strings);
+    const size_t end = automaton.feed(text);
+    if (end != std::string::npos) {
+        text.resize(end - automaton.match_size());
+    }
+}
+
+static bool is_eos_token(const ModelConfig &config, int token_id) {
+    return token_id == config.eos_token_id ||
+           std::find(config.extra_eos_token_ids.begin(), config.extra_eos_token_ids.end(), token_id) !=
+               config.extra_eos_token_ids.end();
+}
+
 std::vector<int> BaseModelForCausalLM::generate(const std::vector<int> &input_ids, const GenerationConfig &gen_config,
-                                                BaseStreamer *streamer) {
+                                                BaseStreamer *streamer, const CancellationToken *cancel_token,
+                                                BaseModelForCausalLM *draft_model, StopStringMatcher *stop_matcher) {
+    // skip the prompt prefix whose kv cache is already known
+    kv_allocator.release(default_block_table_);
+    int n_past = prefix_cache.match(input_ids, default_block_table_);
+    return generate(input_ids, gen_config, streamer, default_block_table_, n_past, cancel_token, draft_model,
+                    stop_matcher);
+}
+
+std::vector<int> BaseModelForCausalLM::generate(const std::vector<int> &input_ids, const GenerationConfig &gen_config,
+                                                BaseStreamer *streamer, std::vector<int> &block_table, int &n_past,
+                                                const CancellationToken *cancel_token,
+                                                BaseModelForCausalLM *draft_model, StopStringMatcher *stop_matcher) {
     CHATGLM_CHECK(gen_config.max_length <= config.max_length)
         << "requested max_length (" << gen_config.max_length << ") is larger than model's max_length ("
         << config.max_length << ")";
+    if (draft_model) {
+        CHATGLM_CHECK(draft_model->config.vocab_size == config.vocab_size)
+            << "draft model vocab_size (" << draft_model->config.vocab_size << ") differs from model's vocab_size ("
+            << config.vocab_size << ")";
+    }
 
     std::vector<int> output_ids;
     output_ids.reserve(gen_config.max_length);
@@ -672,26 +1259,57 @@ std::vector<int> BaseModelForCausalLM::generate(const std::vector<int> &input_id
         streamer->put(input_ids);
     }
 
-    int n_past = 0;
     const int n_ctx = input_ids.size();
     const int max_new_tokens = (gen_config.max_new_tokens > 0) ? gen_config.max_new_tokens : gen_config.max_length;
+    const int max_output_length = std::min(gen_config.max_length, n_ctx + max_new_tokens);
 
-    while ((int)output_ids.size() < std::min(gen_config.max_length, n_ctx + max_new_tokens)) {
-        int next_token_id = generate_next_token(output_ids, gen_config, n_past, n_ctx);
+    std::vector<int> draft_block_table;
+    int draft_n_past = 0;
 
-        n_past = output_ids.size();
-        output_ids.emplace_back(next_token_id);
+    prefill_chunks(output_ids, n_past, n_ctx, gen_config, block_table, cancel_token);
 
-        if (streamer) {
-            streamer->put({next_token_id});
+    bool is_stopped = false;
+    while (!is_stopped && (int)output_ids.size() < max_output_length) {
+        if (cancel_token && cancel_token->is_cancelled()) {
+            break;
+        }
+        // the prompt is prefilled alone, then every step proposes as many draft tokens as the length limits leave
+        int num_draft = 0;
+        if (draft_model && n_past + 1 == (int)output_ids.size()) {
+            num_draft = std::min({gen_config.num_draft_tokens, max_output_length - (int)output_ids.size() - 1,
+                                  draft_model->config.max_length + 1 - (int)output_ids.size()});
         }
 
-        if (next_token_id == config.eos_token_id ||
-            std::find(config.extra_eos_token_ids.begin(), config.extra_eos_token_ids.end(), next_token_id) !=
-                config.extra_eos_token_ids.end()) {
-            break;
+        std::vector<int> next_token_ids;
+        if (num_draft > 0) {
+            next_token_ids = speculate(output_ids, n_ctx, num_draft, gen_config, block_table, draft_model,
+                                       draft_block_table, draft_n_past);
+        } else {
+            ggml_tensor *lm_logits =
+                forward_graph_compute(output_ids, n_past, n_ctx, gen_config.num_threads, true, block_table);
+            next_token_ids = {sample_next_token((float *)lm_logits->data, lm_logits->ne[0], output_ids, gen_config)};
         }
+
+        for (int next_token_id : next_token_ids) {
+            output_ids.emplace_back(next_token_id);
+
+            if (streamer) {
+                streamer->put({next_token_id});
+            }
+
+            if (is_eos_token(config, next_token_id) || (stop_matcher && stop_matcher->put(next_token_id))) {
+                is_stopped = true;
+                break;
+            }
+        }
+        n_past = output_ids.size() - 1;
+    }
+    if (draft_model) {
+        draft_model->kv_allocator.release(draft_block_table);
+        // drop the blocks taken by rejected draft tokens
+        kv_allocator.truncate(block_table, n_past);
     }
+    prefix_cache.insert(output_ids, block_table, n_past);
 
     if (streamer) {
         streamer->end();
@@ -700,6 +1318,460 @@ std::vector<int> BaseModelForCausalLM::generate(const std::vector<int> &input_id
     return output_ids;
 }
 
+std::vector<std::vector<int>> BaseModelForCausalLM::generate_batch(const std::vector<std::vector<int>> &inputs,
+                                                                   const GenerationConfig &gen_config,
+                                                                   int max_batch_size, const BaseTokenizer *tokenizer) {
+    std::vector<std::vector<int>> outputs(inputs.size());
+    size_t next = 0;
+    generate_batch(
+        [&](std::vector<int> &input_ids) {
+            if (next == inputs.size()) {
+                return false;
+            }
+            input_ids = inputs[next++];
+            return true;
+        },
+        [&](size_t index, std::vector<int> &output_ids) { outputs[index] = std::move(output_ids); }, gen_config,
+        max_batch_size, tokenizer);
+    return outputs;
+}
+
+void BaseModelForCausalLM::generate_batch(
+    const std::function<bool(std::vector<int> &input_ids)> &next_input,
+    const std::function<void(size_t index, std::vector<int> &output_ids)> &on_output,
+    const GenerationConfig &gen_config, int max_batch_size, const BaseTokenizer *tokenizer,
+    BatchGenerationStats *stats) {
+    CHATGLM_CHECK(gen_config.max_length <= config.max_length)
+        << "requested max_length (" << gen_config.max_length << ") is larger than model's max_length ("
+        << config.max_length << ")";
+    CHATGLM_CHECK(max_batch_size > 0) << "invalid max_batch_size " << max_batch_size;
+
+    struct Slot {
+        size_t index; // of the input
+        std::vector<int> output_ids;
+        int n_ctx;
+        int n_past;
+        int max_output_length;
+        std::vector<int> block_table;
+        std::unique_ptr<StopStringMatcher> stop_matcher;
+        bool done = false;
+    };
+
+    const int max_new_tokens = (gen_config.max_new_tokens > 0) ? gen_config.max_new_tokens : gen_config.max_length;
+    const int chunk_size = prefill_chunk_size(gen_config);
+
+    std::vector<Slot> slots;
+    size_t num_inputs = 0;
+    std::vector<int> pending; // an input waiting for kv cache
+    bool has_pending = false;
+    bool has_more = true;
+    while (has_more || has_pending || !slots.empty()) {
+        // refill free slots in input order while the kv cache holds their whole output
+        while ((int)slots.size() < max_batch_size) {
+            if (!has_pending) {
+                has_more = has_more && next_input(pending);
+                if (!has_more) {
+                    break;
+                }
+                has_pending = true;
+            }
+            CHATGLM_CHECK(!pending.empty()) << "input " << num_inputs << " is empty";
+            const int n_ctx = pending.size();
+            const int max_output_length = std::min(gen_config.max_length, n_ctx + max_new_tokens);
+            if (n_ctx >= max_output_length) {
+                has_pending = false;
+                on_output(num_inputs++, pending); // no room to generate
+                continue;
+            }
+
+            Slot slot{num_inputs, {}, n_ctx, 0, max_output_length, {}, nullptr};
+            slot.n_past = prefix_cache.match(pending, slot.block_table);
+            prefix_cache.evict(kv_allocator.num_blocks_needed(slot.block_table, max_output_length));
+            if (!kv_allocator.reserve(slot.block_table, max_output_length)) {
+                kv_allocator.release(slot.block_table);
+                CHATGLM_CHECK(!slots.empty())
+                    << "kv cache is full: " << max_output_length << " tokens requested but only "
+                    << kv_allocator.num_free_blocks() * kv_allocator.block_size() << " available";
+                break;
+            }
+            if (tokenizer && !gen_config.stop_strings.empty()) {
+                slot.stop_matcher = std::make_unique<StopStringMatcher>(tokenizer, gen_config.stop_strings);
+            }
+            slot.output_ids = std::move(pending);
+            slot.output_ids.reserve(max_output_length);
+            has_pending = false;
+            num_inputs++;
+            slots.emplace_back(std::move(slot));
+        }
+        if (slots.empty()) {
+            continue;
+        }
+
+        // decoding sequences always run, prompts join as long as the new tokens stay within max_length
+        std::vector<int> input_ids;
+        std::vector<BatchedSequence> batch;
+        std::vector<Slot *> batch_slots;
+        int num_step_tokens = 0;
+        for (const Slot &slot : slots) {
+            num_step_tokens += (slot.n_past + 1 == (int)slot.output_ids.size());
+        }
+        int num_prompt_tokens = 0;
+        bool is_prompt_waiting = false; // later prompts wait too, so that a skipped one goes first once there is room
+        for (Slot &slot : slots) {
+            int end = slot.output_ids.size();
+            if (chunk_size > 0) {
+                end = std::min(end, slot.n_past + chunk_size);
+            }
+            if (slot.n_past + 1 < end) {
+                const int budget = config.max_length - num_step_tokens;
+                if (num_prompt_tokens == 0 && config.model_type != ModelType::CHATGLM) {
+                    // the first prompt of a step always goes on, with as many tokens as the budget leaves
+                    end = std::min(end, slot.n_past + budget);
+                }
+                if (is_prompt_waiting || budget <= 0 || end - slot.n_past > budget) {
+                    is_prompt_waiting = true;
+                    continue;
+                }
+                num_step_tokens += end - slot.n_past;
+                num_prompt_tokens += end - slot.n_past;
+            }
+            input_ids.insert(input_ids.end(), slot.output_ids.begin() + slot.n_past, slot.output_ids.begin() + end);
+            batch.push_back({kv_allocator.rows(slot.block_table, end), end - slot.n_past, slot.n_past, slot.n_ctx});
+            batch_slots.emplace_back(&slot);
+        }
+
+        const int64_t step_start_us = ggml_time_us();
+        ggml_tensor *lm_logits = forward_graph_compute(input_ids, batch, gen_config.num_threads, true);
+        const int vocab_size = lm_logits->ne[0];
+        int num_generated = 0;
+        for (size_t i = 0; i < batch.size(); i++) {
+            Slot &slot = *batch_slots[i];
+            slot.n_past += batch[i].qlen;
+            if (slot.n_past < (int)slot.output_ids.size()) {
+                continue; // the rest of the prompt goes into the next steps
+            }
+
+            const int next_token_id = sample_next_token((float *)lm_logits->data + i * vocab_size, vocab_size,
+                                                        slot.output_ids, gen_config);
+            slot.output_ids.emplace_back(next_token_id);
+            num_generated++;
+            if (is_eos_token(config, next_token_id) || (slot.stop_matcher && slot.stop_matcher->put(next_token_id)) ||
+                (int)slot.output_ids.size() >= slot.max_output_length) {
+                prefix_cache.insert(slot.output_ids, slot.block_table, slot.n_past);
+                kv_allocator.release(slot.block_table);
+                slot.done = true;
+            }
+        }
+        if (stats) {
+            const double step_seconds = (ggml_time_us() - step_start_us) / 1e6;
+            if (num_prompt_tokens > 0) {
+                stats->prefill_tokens += num_prompt_tokens;
+                stats->prefill_seconds += step_seconds;
+            } else {
+                stats->decode_tokens += num_generated;
+                stats->decode_seconds += step_seconds;
+            }
+        }
+
+        for (Slot &slot : slots) {
+            if (slot.done) {
+                on_output(slot.index, slot.output_ids);
+            }
+        }
+        slots.erase(std::remove_if(slots.begin(), slots.end(), [](const Slot &slot) { return slot.done; }),
+                    slots.end());
+    }
+}
+
+std::vector<std::vector<int>> BaseModelForCausalLM::generate_sequences(const std::vector<int> &input_ids,
+                                                                       const GenerationConfig &gen_config,
+                                                                       const CancellationToken *cancel_token) {
+    CHATGLM_CHECK(gen_config.max_length <= config.max_length)
+        << "requested max_length (" << gen_config.max_length << ") is larger than model's max_length ("
+        << config.max_length << ")";
+    CHATGLM_CHECK(!input_ids.empty()) << "input is empty";
+    const bool is_beam_search = gen_config.num_beams > 1;
+    const int num_beams = gen_config.num_beams;
+    const int num_return_sequences = std::max(gen_config.num_return_sequences, 1);
+    CHATGLM_CHECK(!is_beam_search || num_return_sequences <= num_beams)
+        << "cannot return " << num_return_sequences << " sequences out of " << num_beams << " beams";
+
+    const int n_ctx = input_ids.size();
+    const int max_new_tokens = (gen_config.max_new_tokens > 0) ? gen_config.max_new_tokens : gen_config.max_length;
+    const int max_output_length = std::min(gen_config.max_length, n_ctx + max_new_tokens);
+    std::vector<std::vector<int>> outputs(num_return_sequences, input_ids);
+    if (n_ctx >= max_output_length) {
+        return outputs;
+    }
+
+    struct Hypothesis {
+        std::vector<int> output_ids;
+        std::vector<int> block_table;
+        float score;  // sum of the log probabilities of the generated tokens
+        size_t index; // of its output when sampling
+    };
+    struct Candidate {
+        float score;
+        int hyp;
+        int token;
+    };
+    auto normalized_score = [&](float score, int num_new_tokens) {
+        return score / std::pow((float)num_new_tokens, gen_config.length_penalty);
+    };
+
+    // the prompt is computed once, into blocks every hypothesis starts with
+    std::vector<int> prompt_block_table;
+    int n_past = prefix_cache.match(input_ids, prompt_block_table);
+    prefill_chunks(input_ids, n_past, n_ctx, gen_config, prompt_block_table, cancel_token);
+    if (cancel_token && cancel_token->is_cancelled()) {
+        kv_allocator.release(prompt_block_table);
+        return outputs;
+    }
+    ggml_tensor *lm_logits =
+        forward_graph_compute(input_ids, n_past, n_ctx, gen_config.num_threads, true, prompt_block_table);
+    prefix_cache.insert(input_ids, prompt_block_table, n_ctx);
+    const int vocab_size = lm_logits->ne[0];
+
+    std::vector<Hypothesis> hyps;
+    for (int i = 0; i < (is_beam_search ? 1 : num_return_sequences); i++) {
+        for (int block : prompt_block_table) {
+            kv_allocator.share(block);
+        }
+        hyps.push_back({input_ids, prompt_block_table, 0.f, (size_t)i});
+    }
+    kv_allocator.release(prompt_block_table);
+
+    std::vector<std::pair<float, std::vector<int>>> ended_beams; // normalized score and output, best first
+    bool is_prompt_logits = true;                                // all hypotheses continue the prompt's logits
+    while (true) {
+        std::vector<Hypothesis> next_hyps;
+        if (is_beam_search) {
+            // the best 2 * num_beams continuations of every beam, so that num_beams of them go on after some end
+            std::vector<Candidate> candidates;
+            std::vector<TokenIdScore> token_scores(vocab_size);
+            const int num_candidates = std::min(2 * num_beams, vocab_size);
+            for (size_t i = 0; i < hyps.size(); i++) {
+                float *logits = (float *)lm_logits->data + i * vocab_size;
+                if (gen_config.repetition_penalty != 1.f) {
+                    sampling_repetition_penalty(logits, logits + vocab_size, hyps[i].output_ids,
+                                                gen_config.repetition_penalty);
+                }
+                const float max_logit = *std::max_element(logits, logits + vocab_size);
+                float sum = 0.f;
+                for (int j = 0; j < vocab_size; j++) {
+                    sum += std::exp(logits[j] - max_logit);
+                    token_scores[j] = {j, logits[j]};
+                }
+                const float log_sum = max_logit + std::log(sum);
+                std::partial_sort(token_scores.begin(), token_scores.begin() + num_candidates, token_scores.end(),
+                                  std::greater<TokenIdScore>());
+                for (int j = 0; j < num_candidates; j++) {
+                    candidates.push_back(
+                        {hyps[i].score + token_scores[j].score - log_sum, (int)i, token_scores[j].id});
+                }
+            }
+            std::sort(candidates.begin(), candidates.end(),
+                      [](const Candidate &a, const Candidate &b) { return a.score > b.score; });
+
+            for (size_t rank = 0; rank < candidates.size() && (int)next_hyps.size() < num_beams; rank++) {
+                const Candidate &candidate = candidates[rank];
+                const Hypothesis &parent = hyps[candidate.hyp];
+                std::vector<int> output_ids = parent.output_ids;
+                output_ids.emplace_back(candidate.token);
+                if (is_eos_token(config, candidate.token) || (int)output_ids.size() >= max_output_length) {
+                    // an ending beam only counts while it ranks among the best num_beams
+                    if ((int)rank < num_beams) {
+                        ended_beams.emplace_back(normalized_score(candidate.score, output_ids.size() - n_ctx),
+                                                 std::move(output_ids));
+                    }
+                    continue;
+                }
+                // a forked beam shares the blocks of its parent until it writes into them
+                for (int block : parent.block_table) {
+                    kv_allocator.share(block);
+                }
+                next_hyps.push_back({std::move(output_ids), parent.block_table, candidate.score, 0});
+            }
+
+            std::stable_sort(ended_beams.begin(), ended_beams.end(),
+                             [](const auto &a, const auto &b) { return a.first > b.first; });
+            if ((int)ended_beams.size() > num_beams) {
+                ended_beams.erase(ended_beams.begin() + num_beams, ended_beams.end());
+            }
+            // done once the best running beam cannot beat the worst of num_beams ended ones
+            if ((int)ended_beams.size() == num_beams && !next_hyps.empty() &&
+                normalized_score(next_hyps.front().score, next_hyps.front().output_ids.size() - n_ctx) <=
+                    ended_beams.back().first) {
+                for (auto &hyp : next_hyps) {
+                    kv_allocator.release(hyp.block_table);
+                }
+                next_hyps.clear();
+            }
+        } else {
+            for (size_t i = 0; i < hyps.size(); i++) {
+                Hypothesis &hyp = hyps[i];
+                const float *row = (float *)lm_logits->data + (is_prompt_logits ? 0 : i) * vocab_size;
+                std::vector<float> logits(row, row + vocab_size);
+                const int next_token_id = sample_next_token(logits.data(), vocab_size, hyp.output_ids, gen_config);
+                hyp.output_ids.emplace_back(next_token_id);
+                if (is_eos_token(config, next_token_id) || (int)hyp.output_ids.size() >= max_output_length) {
+                    outputs[hyp.index] = std::move(hyp.output_ids);
+                } else {
+                    next_hyps.emplace_back(std::move(hyp));
+                }
+            }
+        }
+        for (auto &hyp : hyps) {
+            kv_allocator.release(hyp.block_table);
+        }
+        hyps = std::move(next_hyps);
+        if (hyps.empty() || (cancel_token && cancel_token->is_cancelled())) {
+            break;
+        }
+
+        // every hypothesis writes its last token into a block of its own, copying the block if others share it
+        std::vector<int> step_input_ids;
+        std::vector<BatchedSequence> seqs;
+        std::vector<std::pair<int, int>> copies;
+        for (auto &hyp : hyps) {
+            const int pos = hyp.output_ids.size() - 1;
+            prefix_cache.evict(1);
+            CHATGLM_CHECK(kv_allocator.reserve(hyp.block_table, pos + 1))
+                << "kv cache is full: no free block for " << hyps.size() << " hypotheses";
+            const int src_block = kv_allocator.copy_on_write(hyp.block_table, pos);
+            if (src_block >= 0) {
+                copies.emplace_back(src_block, hyp.block_table[pos / kv_allocator.block_size()]);
+            }
+            step_input_ids.emplace_back(hyp.output_ids.back());
+            seqs.push_back({kv_allocator.rows(hyp.block_table, pos + 1), 1, pos, n_ctx});
+        }
+        if (!copies.empty()) {
+            TraceScope trace("copy_kv_blocks");
+            copy_kv_blocks(copies);
+        }
+        lm_logits = forward_graph_compute(step_input_ids, seqs, gen_config.num_threads, true);
+        is_prompt_logits = false;
+    }
+
+    // hypotheses still running were cancelled and end where they are
+    if (is_beam_search) {
+        for (const auto &hyp : hyps) {
+            ended_beams.emplace_back(normalized_score(hyp.score, hyp.output_ids.size() - n_ctx), hyp.output_ids);
+        }
+        std::stable_sort(ended_beams.begin(), ended_beams.end(),
+                         [](const auto &a, const auto &b) { return a.first > b.first; });
+        for (size_t i = 0; i < outputs.size() && i < ended_beams.size(); i++) {
+            outputs[i] = std::move(ended_beams[i].second);
+        }
+    } else {
+        for (auto &hyp : hyps) {
+            outputs[hyp.index] = std::move(hyp.output_ids);
+        }
+    }
+    for (auto &hyp : hyps) {
+        kv_allocator.release(hyp.block_table);
+    }
+    return outputs;
+}
+
+void BaseModelForCausalLM::prefill_chunks(const std::vector<int> &input_ids, int &n_past, int n_ctx,
+                                          const GenerationConfig &gen_config, std::vector<int> &block_table,
+                                          const CancellationToken *cancel_token) {
+    const int chunk_size = prefill_chunk_size(gen_config);
+    if (chunk_size <= 0) {
+        return;
+    }
+    while ((int)input_ids.size() - n_past > chunk_size) {
+        if (cancel_token && cancel_token->is_cancelled()) {
+            return;
+        }
+        TraceScope trace("prefill_chunk");
+        std::vector<int> chunk_ids(input_ids.begin(), input_ids.begin() + n_past + chunk_size);
+        forward_graph_compute(chunk_ids, n_past, n_ctx, gen_config.num_threads, true, block_table);
+        n_past = chunk_ids.size();
+    }
+}
+
+std::vector<int> BaseModelForCausalLM::speculate(const std::vector<int> &output_ids, int n_ctx, int num_draft,
+                                                 const GenerationConfig &gen_config, std::vector<int> &block_table,
+                                                 BaseModelForCausalLM *draft_model,
+                                                 std::vector<int> &draft_block_table, int &draft_n_past) {
+    const int vocab_size = config.vocab_size;
+    std::mt19937 &gen = random_engine();
+
+    // the draft proposes tokens one at a time, remembering the distribution it drew each of them from
+    std::vector<int> ids = output_ids;
+    std::vector<std::vector<float>> draft_probs;
+    const int64_t draft_start_us = Tracer::now_us();
+    draft_model->prefill_chunks(ids, draft_n_past, n_ctx, gen_config, draft_block_table, nullptr);
+    for (int i = 0; i < num_draft; i++) {
+        ggml_tensor *draft_logits = draft_model->forward_graph_compute(ids, draft_n_past, n_ctx, gen_config.num_threads,
+                                                                       true, draft_block_table);
+        draft_n_past = ids.size();
+        std::vector<float> probs(vocab_size);
+        for (const auto &ts : sampling_distribution((float *)draft_logits->data, vocab_size, ids, gen_config)) {
+            probs[ts.id] = ts.score;
+        }
+        std::discrete_distribution<> dist(probs.begin(), probs.end());
+        const int draft_token_id = dist(gen);
+        ids.emplace_back(draft_token_id);
+        draft_probs.emplace_back(std::move(probs));
+        if (is_eos_token(config, draft_token_id)) {
+            break;
+        }
+    }
+    if (Tracer::is_enabled()) {
+        Tracer::record("draft", draft_start_us, Tracer::now_us());
+    }
+
+    TraceScope trace("verify"); // until the end of the step
+
+    // one forward of this model scores the last output token and every draft token: [num_draft + 1, vocab_size]
+    const int n_past = output_ids.size() - 1;
+    ggml_tensor *lm_logits = forward_graph_compute(ids, n_past, n_ctx, gen_config.num_threads, false, block_table);
+
+    // accept a draft token with probability min(1, p / q), otherwise replace it with a sample of max(0, p - q)
+    std::vector<int> context = output_ids;
+    std::vector<int> next_token_ids;
+    std::uniform_real_distribution<float> uniform(0.f, 1.f);
+    for (size_t i = 0; i <= draft_probs.size(); i++) {
+        float *next_token_logits = (float *)lm_logits->data + i * vocab_size;
+        if (i == draft_probs.size()) {
+            // every draft token was accepted, this model adds one more of its own
+            next_token_ids.emplace_back(sample_next_token(next_token_logits, vocab_size, context, gen_config));
+            break;
+        }
+
+        std::vector<float> probs(vocab_size);
+        for (const auto &ts : sampling_distribution(next_token_logits, vocab_size, context, gen_config)) {
+            probs[ts.id] = ts.score;
+        }
+        const int draft_token_id = ids[output_ids.size() + i];
+        const std::vector<float> &q = draft_probs[i];
+        if (uniform(gen) * q[draft_token_id] < probs[draft_token_id]) {
+            next_token_ids.emplace_back(draft_token_id);
+            context.emplace_back(draft_token_id);
+            continue;
+        }
+
+        std::vector<float> residual(vocab_size);
+        float residual_sum = 0.f;
+        for (int j = 0; j < vocab_size; j++) {
+            residual[j] = std::max(probs[j] - q[j], 0.f);
+            residual_sum += residual[j];
+        }
+        std::discrete_distribution<> dist =
+            residual_sum > 0.f ? std::discrete_distribution<>(residual.begin(), residual.end())
+                               : std::discrete_distribution<>(probs.begin(), probs.end());
+        next_token_ids.emplace_back(dist(gen));
+        break;
+    }
+
+    // draft kv cache past the first rejected token is stale
+    draft_n_past = std::min(draft_n_past, (int)(output_ids.size() + next_token_ids.size()) - 1);
+    return next_token_ids;
+}
+
 // ===== ChatGLM-6B =====
 
 ChatGLMTokenizer::ChatGLMTokenizer(std::string_view serialized_model_proto) {
@@ -844,6 +1916,10 @@ std::string ChatGLMTokenizer::postprocess(const std::string &text) {
 ggml_tensor *GLMContextMasker::operator()(ModelContext *ctx, ggml_tensor *attn_scores, int n_past) const {
     // attn_scores is of shape [heads, qlen, klen]
     ggml_context *gctx = ctx->ctx_b.get();
+    if (n_past > 0) {
+        // tokens appended after the context are causal
+        return tensor_assign_buffers(ggml_diag_mask_inf_inplace(gctx, attn_scores, n_past));
+    }
     const int qlen = attn_scores->ne[1];
     const int num_attention_heads = attn_scores->ne[2];
     ggml_tensor *inf = ggml_new_tensor_3d(gctx, attn_scores->type, 1, qlen - 1, num_attention_heads);
@@ -856,14 +1932,14 @@ ggml_tensor *GLMContextMasker::operator()(ModelContext *ctx, ggml_tensor *attn_s
     return attn_scores;
 }
 
-ggml_tensor *GLMBlock::forward(ModelContext *ctx, ggml_tensor *hidden_states, ggml_tensor *position_ids, int n_past,
-                               int n_ctx) const {
+ggml_tensor *GLMBlock::forward(ModelContext *ctx, ggml_tensor *hidden_states,
+                               const std::vector<BatchedSequence> &seqs) const {
     ggml_context *gctx = ctx->ctx_b.get();
 
     ggml_tensor *alpha = ggml_new_f32(gctx, alpha_value);
 
     ggml_tensor *attn_input = input_layernorm.forward(ctx, hidden_states);
-    ggml_tensor *attn_output = attention.forward(ctx, attn_input, position_ids, n_past, n_ctx);
+    ggml_tensor *attn_output = attention.forward(ctx, attn_input, seqs);
     ggml_build_forward_expand(&ctx->gf, attn_output);
     attn_input = tensor_assign_buffers(ggml_scale_inplace(gctx, attn_input, alpha));
     hidden_states = tensor_assign_buffers(ggml_add_inplace(gctx, attn_input, attn_output));
@@ -1265,7 +2341,6 @@ std::vector<int> BaichuanTokenizer::encode_messages(const std::vector<ChatMessag
     check_chat_messages(messages);
 
     std::vector<int> ids;
-    ids.reserve(max_length);
     for (const auto &msg : messages) {
         ids.push_back((msg.role == ChatMessage::ROLE_USER) ? USER_TOKEN_ID : ASSISTANT_TOKEN_ID);
         std::vector<int> content_ids = encode(msg.content, max_length);
@@ -1475,8 +2550,31 @@ StateDict InternLMForCausalLM<InternLMModel>::state_dict() const {
 
 // ===== pipeline =====
 
-Pipeline::Pipeline(const std::string &path) {
-    mapped_file = std::make_unique<MappedFile>(path);
+Pipeline::Pipeline(const std::string &path, int kv_cache_size) : mapped_file(std::make_shared<MappedFile>(path)) {
+    load(kv_cache_size);
+}
+
+std::unique_ptr<Pipeline> Pipeline::replicate(int kv_cache_size) const {
+    std::unique_ptr<Pipeline> replica(new Pipeline);
+    replica->mapped_file = mapped_file;
+    replica->tokenizer = tokenizer;
+    replica->load(kv_cache_size);
+    if (draft) {
+        replica->draft = draft->replicate(kv_cache_size);
+    }
+    return replica;
+}
+
+void Pipeline::load_draft_model(const std::string &path, int kv_cache_size) {
+    auto draft_pipeline = std::make_unique<Pipeline>(path, kv_cache_size);
+    CHATGLM_CHECK(draft_pipeline->model->config.vocab_size == model->config.vocab_size)
+        << "draft model " << path << " has vocab_size " << draft_pipeline->model->config.vocab_size
+        << " but the model has " << model->config.vocab_size;
+    draft = std::move(draft_pipeline);
+}
+
+void Pipeline::load(int kv_cache_size) {
+    // a replica already has the tokenizer, it only needs a model of its own
     ModelLoader loader(mapped_file->data, mapped_file->size);
 
     // load magic
@@ -1492,12 +2590,15 @@ Pipeline::Pipeline(const std::string &path) {
 
         // load config
         ModelConfig config(model_type, loader.read_basic<ConfigRecordV1>());
+        config.num_kv_blocks = (kv_cache_size + config.kv_block_size - 1) / config.kv_block_size;
 
         // load tokenizer
         int proto_size = loader.read_basic<int>();
         std::string_view serialized_model_proto((char *)mapped_file->data + loader.tell(), proto_size);
         loader.seek(proto_size, SEEK_CUR);
-        tokenizer = std::make_unique<ChatGLMTokenizer>(serialized_model_proto);
+        if (!tokenizer) {
+            tokenizer = std::make_shared<ChatGLMTokenizer>(serialized_model_proto);
+        }
 
         // load model
         model = std::make_unique<ChatGLMForCausalLM>(config);
@@ -1507,6 +2608,7 @@ Pipeline::Pipeline(const std::string &path) {
 
         // load config
         ModelConfig config(model_type, loader.read_basic<ConfigRecordV2>());
+        config.num_kv_blocks = (kv_cache_size + config.kv_block_size - 1) / config.kv_block_size;
 
         // load tokenizer
         int proto_size = loader.read_basic<int>();
@@ -1514,12 +2616,16 @@ Pipeline::Pipeline(const std::string &path) {
         loader.seek(proto_size, SEEK_CUR);
 
         if (model_type == ModelType::CHATGLM2) {
-            tokenizer = std::make_unique<ChatGLM2Tokenizer>(serialized_model_proto);
+            if (!tokenizer) {
+                tokenizer = std::make_shared<ChatGLM2Tokenizer>(serialized_model_proto);
+            }
             model = std::make_unique<ChatGLM2ForCausalLM>(config);
         } else {
-            auto chatglm3_tokenizer = std::make_unique<ChatGLM3Tokenizer>(serialized_model_proto);
+            if (!tokenizer) {
+                tokenizer = std::make_shared<ChatGLM3Tokenizer>(serialized_model_proto);
+            }
+            auto chatglm3_tokenizer = static_cast<ChatGLM3Tokenizer *>(tokenizer.get());
             config.extra_eos_token_ids = {chatglm3_tokenizer->observation_token_id, chatglm3_tokenizer->user_token_id};
-            tokenizer = std::move(chatglm3_tokenizer);
             model = std::make_unique<ChatGLM3ForCausalLM>(config);
         }
 
@@ -1530,13 +2636,16 @@ Pipeline::Pipeline(const std::string &path) {
 
         // load config
         ModelConfig config(model_type, loader.read_basic<ConfigRecordV1>());
+        config.num_kv_blocks = (kv_cache_size + config.kv_block_size - 1) / config.kv_block_size;
         config.norm_eps = 1e-6;
 
         // load tokenizer
         int proto_size = loader.read_basic<int>();
         std::string_view serialized_model_proto((char *)mapped_file->data + loader.tell(), proto_size);
         loader.seek(proto_size, SEEK_CUR);
-        tokenizer = std::make_unique<BaichuanTokenizer>(serialized_model_proto);
+        if (!tokenizer) {
+            tokenizer = std::make_shared<BaichuanTokenizer>(serialized_model_proto);
+        }
 
         // load model
         model = std::make_unique<Baichuan7BForCausalLM>(config);
@@ -1546,13 +2655,16 @@ Pipeline::Pipeline(const std::string &path) {
 
         // load config
         ModelConfig config(model_type, loader.read_basic<ConfigRecordV1>());
+        config.num_kv_blocks = (kv_cache_size + config.kv_block_size - 1) / config.kv_block_size;
         config.norm_eps = 1e-6;
 
         // load tokenizer
         int proto_size = loader.read_basic<int>();
         std::string_view serialized_model_proto((char *)mapped_file->data + loader.tell(), proto_size);
         loader.seek(proto_size, SEEK_CUR);
-        tokenizer = std::make_unique<BaichuanTokenizer>(serialized_model_proto);
+        if (!tokenizer) {
+            tokenizer = std::make_shared<BaichuanTokenizer>(serialized_model_proto);
+        }
 
         // load model
         model = std::make_unique<Baichuan13BForCausalLM>(config);
@@ -1562,13 +2674,16 @@ Pipeline::Pipeline(const std::string &path) {
 
         // load config
         ModelConfig config(model_type, loader.read_basic<ConfigRecordV1>());
+        config.num_kv_blocks = (kv_cache_size + config.kv_block_size - 1) / config.kv_block_size;
         config.norm_eps = 1e-6;
 
         // load tokenizer
         int proto_size = loader.read_basic<int>();
         std::string_view serialized_model_proto((char *)mapped_file->data + loader.tell(), proto_size);
         loader.seek(proto_size, SEEK_CUR);
-        tokenizer = std::make_unique<InternLMTokenizer>(serialized_model_proto);
+        if (!tokenizer) {
+            tokenizer = std::make_shared<InternLMTokenizer>(serialized_model_proto);
+        }
 
         // load model
         if (config.hidden_size == 4096) {
@@ -1584,25 +2699,161 @@ Pipeline::Pipeline(const std::string &path) {
 
 std::vector<int> Pipeline::generate(const std::vector<int> &input_ids, const GenerationConfig &gen_config,
                                     BaseStreamer *streamer) const {
-    std::vector<int> output_ids = model->generate(input_ids, gen_config, streamer);
+    TraceScope trace("generate");
+    if (gen_config.num_beams > 1) {
+        // the best beam is only known at the end, so it is streamed at once
+        std::vector<int> output_ids = model->generate_sequences(input_ids, gen_config).front();
+        std::vector<int> new_output_ids(output_ids.begin() + input_ids.size(), output_ids.end());
+        if (streamer) {
+            streamer->put(input_ids);
+            streamer->put(new_output_ids);
+            streamer->end();
+        }
+        return new_output_ids;
+    }
+    StopStringMatcher stop_matcher(tokenizer.get(), gen_config.stop_strings);
+    std::vector<int> output_ids = model->generate(input_ids, gen_config, streamer, nullptr,
+                                                  draft ? draft->model.get() : nullptr, &stop_matcher);
     std::vector<int> new_output_ids(output_ids.begin() + input_ids.size(), output_ids.end());
     return new_output_ids;
 }
 
 std::string Pipeline::generate(const std::string &prompt, const GenerationConfig &gen_config,
                                BaseStreamer *streamer) const {
-    std::vector<int> input_ids = tokenizer->encode(prompt, gen_config.max_context_length);
+    std::vector<int> input_ids;
+    {
+        TraceScope trace("encode");
+        input_ids = tokenizer->encode(prompt, gen_config.max_context_length);
+    }
     std::vector<int> new_output_ids = generate(input_ids, gen_config, streamer);
+    TraceScope trace("decode");
     std::string output = tokenizer->decode(new_output_ids);
+    StopStringMatcher::truncate(output, gen_config.stop_strings);
     return output;
 }
 
+std::vector<std::string> Pipeline::generate_sequences(const std::string &prompt,
+                                                      const GenerationConfig &gen_config) const {
+    std::vector<int> input_ids;
+    {
+        TraceScope trace("encode");
+        input_ids = tokenizer->encode(prompt, gen_config.max_context_length);
+    }
+    std::vector<std::vector<int>> outputs;
+    {
+        TraceScope trace("generate_sequences");
+        outputs = model->generate_sequences(input_ids, gen_config);
+    }
+    TraceScope trace("decode");
+    std::vector<std::string> texts;
+    texts.reserve(outputs.size());
+    for (const auto &output_ids : outputs) {
+        std::string text = tokenizer->decode(std::vector<int>(output_ids.begin() + input_ids.size(), output_ids.end()));
+        StopStringMatcher::truncate(text, gen_config.stop_strings);
+        texts.emplace_back(std::move(text));
+    }
+    return texts;
+}
+
+std::vector<std::string> Pipeline::generate_batch(const std::vector<std::string> &prompts,
+                                                  const GenerationConfig &gen_config, int max_batch_size) const {
+    std::vector<std::vector<int>> inputs;
+    inputs.reserve(prompts.size());
+    {
+        TraceScope trace("encode");
+        for (const auto &prompt : prompts) {
+            inputs.emplace_back(tokenizer->encode(prompt, gen_config.max_context_length));
+        }
+    }
+    std::vector<std::vector<int>> outputs;
+    {
+        TraceScope trace("generate_batch");
+        outputs = model->generate_batch(inputs, gen_config, max_batch_size, tokenizer.get());
+    }
+    TraceScope trace("decode");
+    std::vector<std::string> texts;
+    texts.reserve(outputs.size());
+    for (size_t i = 0; i < outputs.size(); i++) {
+        std::string text = tokenizer->decode(std::vector<int>(outputs[i].begin() + inputs[i].size(), outputs[i].end()));
+        StopStringMatcher::truncate(text, gen_config.stop_strings);
+        texts.emplace_back(std::move(text));
+    }
+    return texts;
+}
+
 ChatMessage Pipeline::chat(const std::vector<ChatMessage> &messages, const GenerationConfig &gen_config,
                            BaseStreamer *streamer) const {
-    std::vector<int> input_ids = tokenizer->encode_messages(messages, gen_config.max_context_length);
+    std::vector<int> input_ids;
+    {
+        TraceScope trace("encode_messages");
+        input_ids = tokenizer->encode_messages(messages, gen_config.max_context_length);
+    }
     std::vector<int> new_output_ids = generate(input_ids, gen_config, streamer);
+    TraceScope trace("decode_message");
     ChatMessage output = tokenizer->decode_message(new_output_ids);
+    StopStringMatcher::truncate(output.content, gen_config.stop_strings);
+    return output;
+}
+
+std::vector<std::vector<float>> Pipeline::embed(const std::vector<std::string> &texts, PoolingType pooling,
+                                                int num_threads) const {
+    std::vector<std::vector<int>> inputs;
+    inputs.reserve(texts.size());
+    for (const auto &text : texts) {
+        inputs.emplace_back(tokenizer->encode(text, model->config.max_length));
+    }
+    return model->embed(inputs, pooling, num_threads);
+}
+
+ChatMessage ChatSession::chat(const std::vector<ChatMessage> &messages, const GenerationConfig &gen_config,
+                              BaseStreamer *streamer) {
+    BaseModelForCausalLM *model = pipeline_->model.get();
+    std::vector<int> input_ids;
+    {
+        TraceScope trace("encode_messages");
+        input_ids = pipeline_->tokenizer->encode_messages(messages, gen_config.max_context_length);
+    }
+
+    // reuse the kv cache of the longest common prefix, leaving at least one token to compute
+    int n_past = 0;
+    if (model->config.model_type != ModelType::CHATGLM) {
+        // chatglm prompts attend bidirectionally, so their kv cache depends on the whole prompt
+        const int max_past = std::min((int)cached_ids_.size(), (int)input_ids.size() - 1);
+        while (n_past < max_past && cached_ids_[n_past] == input_ids[n_past]) {
+            n_past++;
+        }
+    }
+    // never write into a block shared with the prefix cache
+    const int block_size = model->kv_allocator.block_size();
+    if (n_past % block_size != 0 && model->kv_allocator.ref_count(block_table_[n_past / block_size]) > 1) {
+        n_past -= n_past % block_size;
+    }
+    model->kv_allocator.truncate(block_table_, n_past);
+    if (n_past == 0) {
+        model->kv_allocator.release(block_table_);
+        n_past = model->prefix_cache.match(input_ids, block_table_);
+    }
+
+    BaseModelForCausalLM *draft_model = pipeline_->draft ? pipeline_->draft->model.get() : nullptr;
+    std::vector<int> output_ids;
+    {
+        TraceScope trace("generate");
+        StopStringMatcher stop_matcher(pipeline_->tokenizer.get(), gen_config.stop_strings);
+        output_ids = model->generate(input_ids, gen_config, streamer, block_table_, n_past, nullptr, draft_model,
+                                     &stop_matcher);
+    }
+    cached_ids_.assign(output_ids.begin(), output_ids.begin() + n_past);
+
+    std::vector<int> new_output_ids(output_ids.begin() + input_ids.size(), output_ids.end());
+    TraceScope trace("decode_message");
+    ChatMessage output = pipeline_->tokenizer->decode_message(new_output_ids);
+    StopStringMatcher::truncate(output.content, gen_config.stop_strings);
     return output;
 }
 
+void ChatSession::reset() {
+    pipeline_->model->kv_allocator.release(block_table_);
+    cached_ids_.clear();
+}
+
 } // namespace chatglm
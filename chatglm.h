@@ -1,8 +1,15 @@
 #pragma once
 
+#include <array>
+#include <atomic>
+#include <chrono>
 #include <cmath>
+#include <functional>
 #include <ggml.h>
 #include <iomanip>
+#include <limits>
+#include <map>
+#include <numeric>
 #include <sentencepiece_processor.h>
 #include <sstream>
 #include <unordered_map>
@@ -107,6 +114,11 @@ class ModelConfig {
 
     std::string model_type_name() const { return to_string(model_type); }
 
+    int num_kv_cache_blocks() const {
+        return (num_kv_blocks > 0) ? num_kv_blocks : (max_length + kv_block_size - 1) / kv_block_size;
+    }
+    int kv_cache_size() const { return num_kv_cache_blocks() * kv_block_size; }
+
   public:
     ModelType model_type;
     ggml_type dtype;
@@ -123,6 +135,10 @@ class ModelConfig {
     int pad_token_id;
     int sep_token_id;
     std::vector<int> extra_eos_token_ids;
+    // the kv cache is paged into blocks of kv_block_size tokens shared by all sequences,
+    // num_kv_blocks <= 0 gives just enough blocks for a single sequence of max_length
+    int num_kv_blocks = 0;
+    int kv_block_size = 16;
 };
 
 struct FunctionMessage {
@@ -239,6 +255,25 @@ struct uninitialized_char {
 
 void ggml_graph_compute_helper(std::vector<uninitialized_char> &buf, ggml_cgraph *graph, int n_threads);
 
+struct BatchedSequence;
+
+// Tensors of a decode graph that change from one step to the next, recorded while building it. Later steps of the
+// same sequences run the graph again once these are rewritten, until a sequence outgrows the kv rows it gathers.
+struct DecodeGraphInputs {
+    struct Sequence {
+        ggml_tensor *position_ids = nullptr;
+        ggml_tensor *kv_indices = nullptr;
+        std::vector<ggml_tensor *> kv_writes; // copies of the new token into its kv cache rows
+        std::vector<ggml_tensor *> past_ops;  // ops taking n_past as their first param
+    };
+
+    ggml_tensor *input_ids = nullptr;
+    std::vector<Sequence> seqs;
+
+    // rewrite all but the position ids for the next step of the sequences, whose kv rows end at their new token
+    void update(const std::vector<int> &next_input_ids, const std::vector<BatchedSequence> &next_seqs);
+};
+
 struct ModelContext {
     ggml_type dtype;
     unique_ggml_context_t ctx_w;  // weight
@@ -253,6 +288,7 @@ struct ModelContext {
     std::vector<uninitialized_char> scratch_buffer; // intermediate tensor buffer
     std::string_view weight_buffer;                 // mapped weight
     std::vector<uninitialized_char> work_buffer;    // temporary buffer for graph computing
+    DecodeGraphInputs *decode_inputs = nullptr;     // set while building a reusable decode graph
 
     void init_device_context();
 };
@@ -379,6 +415,19 @@ class BasicGLU {
     Linear down_proj;
 };
 
+// A sequence packed into a batched forward pass. Its `qlen` new tokens occupy consecutive rows of the hidden states.
+// Key/value states of its i-th token live in row `kv_rows[i]` of the kv cache, for both past and new tokens. Rows
+// past n_past + qlen only pad a reusable decode graph, and are masked out.
+struct BatchedSequence {
+    std::vector<int> kv_rows;
+    int qlen;
+    int n_past;
+    int n_ctx;
+    int index = 0;                       // filled by BasicModel::forward
+    ggml_tensor *position_ids = nullptr; // filled by BasicModel::forward
+    ggml_tensor *kv_indices = nullptr;   // filled by BasicModel::forward
+};
+
 struct CausalContextMasker {
     ggml_tensor *operator()(ModelContext *ctx, ggml_tensor *attn_scores, int n_past) const {
         return tensor_assign_buffers(ggml_diag_mask_inf_inplace(ctx->ctx_b.get(), attn_scores, n_past));
@@ -460,28 +509,58 @@ template <bool USE_QKV_BIAS, bool USE_DENSE_BIAS, bool INTERLEAVED_QKV, typename
 class BasicAttention {
   public:
     BasicAttention() = default;
-    BasicAttention(ModelContext *ctx, int hidden_size, int num_attention_heads, int num_kv_heads, int max_length)
+    BasicAttention(ModelContext *ctx, int hidden_size, int num_attention_heads, int num_kv_heads, int kv_cache_size)
         : num_attention_heads(num_attention_heads), num_kv_heads(num_kv_heads),
           query_key_value(ctx, hidden_size, hidden_size + 2 * (hidden_size / num_attention_heads) * num_kv_heads,
                           USE_QKV_BIAS),
           dense(ctx, hidden_size, hidden_size, USE_DENSE_BIAS),
-          k_cache(ggml_new_tensor_3d(ctx->ctx_kv.get(), GGML_TYPE_F16, hidden_size / num_attention_heads, max_length,
-                                     num_kv_heads)),
-          v_cache(ggml_new_tensor_3d(ctx->ctx_kv.get(), GGML_TYPE_F16, max_length, hidden_size / num_attention_heads,
-                                     num_kv_heads)) {}
+          k_cache(ggml_new_tensor_2d(ctx->ctx_kv.get(), GGML_TYPE_F16,
+                                     hidden_size / num_attention_heads * num_kv_heads, kv_cache_size)),
+          v_cache(ggml_new_tensor_2d(ctx->ctx_kv.get(), GGML_TYPE_F16,
+                                     hidden_size / num_attention_heads * num_kv_heads, kv_cache_size)) {}
 
-    ggml_tensor *forward(ModelContext *ctx, ggml_tensor *hidden_states, ggml_tensor *position_ids, int n_past,
-                         int n_ctx) const {
+    ggml_tensor *forward(ModelContext *ctx, ggml_tensor *hidden_states,
+                         const std::vector<BatchedSequence> &seqs) const {
         ggml_context *gctx = ctx->ctx_b.get();
 
         const int hidden_size = hidden_states->ne[0];
         const int qlen = hidden_states->ne[1];
-        const int head_size = hidden_size / num_attention_heads;
-        const int num_shared_q_heads = num_attention_heads / num_kv_heads;
-        const bool is_gqa = num_shared_q_heads > 1;
 
         ggml_tensor *qkv = query_key_value.forward(ctx, hidden_states); // [qlen, hidden + 2 * kv_hidden]
 
+        ggml_tensor *context_layer;
+        if (seqs.size() == 1) {
+            context_layer = attend(ctx, qkv, seqs.front());
+        } else {
+            // each sequence attends to its own kv slot only, then outputs are packed back into rows
+            context_layer = tensor_assign_buffers(ggml_new_tensor_2d(gctx, GGML_TYPE_F32, hidden_size, qlen));
+            int offset = 0;
+            for (const auto &seq : seqs) {
+                ggml_tensor *seq_qkv = tensor_assign_buffers(
+                    ggml_view_2d(gctx, qkv, qkv->ne[0], seq.qlen, qkv->nb[1], offset * qkv->nb[1]));
+                ggml_tensor *seq_context_layer = attend(ctx, seq_qkv, seq); // [seq_qlen, hidden]
+                ggml_tensor *seq_output = tensor_assign_buffers(ggml_view_2d(
+                    gctx, context_layer, hidden_size, seq.qlen, context_layer->nb[1], offset * context_layer->nb[1]));
+                ggml_build_forward_expand(&ctx->gf, ggml_cpy(gctx, seq_context_layer, seq_output));
+                offset += seq.qlen;
+            }
+        }
+
+        ggml_tensor *attn_output = dense.forward(ctx, context_layer);
+        return attn_output;
+    }
+
+  private:
+    ggml_tensor *attend(ModelContext *ctx, ggml_tensor *qkv, const BatchedSequence &seq) const {
+        ggml_context *gctx = ctx->ctx_b.get();
+
+        const int qlen = seq.qlen;
+        const int n_past = seq.n_past;
+        const int head_size = qkv->ne[0] / (num_attention_heads + 2 * num_kv_heads);
+        const int hidden_size = head_size * num_attention_heads;
+        const int num_shared_q_heads = num_attention_heads / num_kv_heads;
+        const bool is_gqa = num_shared_q_heads > 1;
+
         // split mixed qkv into separate query, key and value
         ggml_tensor *query_layer; // [qlen, heads, head_size]
         ggml_tensor *key_layer;   // [qlen, kv_heads, head_size]
@@ -506,8 +585,8 @@ class BasicAttention {
                                        qkv->nb[1], (hidden_size + head_size * num_kv_heads) * ggml_element_size(qkv));
         }
 
-        query_layer = roper_(ctx, query_layer, position_ids, n_ctx);
-        key_layer = roper_(ctx, key_layer, position_ids, n_ctx);
+        query_layer = roper_(ctx, query_layer, seq.position_ids, seq.n_ctx);
+        key_layer = roper_(ctx, key_layer, seq.position_ids, seq.n_ctx);
 
         query_layer = tensor_assign_buffers(
             ggml_cont(gctx, ggml_permute(gctx, query_layer, 0, 2, 1, 3))); // [heads, qlen, head_size]
@@ -517,27 +596,50 @@ class BasicAttention {
                                                       num_kv_heads)); // [kv_heads, shared_qheads * qlen, head_size]
         }
 
-        key_layer = tensor_assign_buffers(ggml_permute(gctx, key_layer, 0, 2, 1, 3)); // [kv_heads, qlen, head_size]
-
-        value_layer = tensor_assign_buffers(ggml_permute(gctx, value_layer, 1, 2, 0, 3)); // [kv_heads, head_size, qlen]
-
-        // store key & value to cache
-        ggml_tensor *k_cache_view = tensor_assign_buffers(
-            ggml_view_3d(gctx, k_cache, head_size, qlen, num_kv_heads, k_cache->nb[1], k_cache->nb[2],
-                         n_past * head_size * ggml_element_size(k_cache))); // [kv_heads, qlen, head_size]
-        ggml_build_forward_expand(&ctx->gf, ggml_cpy(gctx, key_layer, k_cache_view));
-        ggml_tensor *v_cache_view = tensor_assign_buffers(
-            ggml_view_3d(gctx, v_cache, qlen, head_size, num_kv_heads, v_cache->nb[1], v_cache->nb[2],
-                         n_past * ggml_element_size(v_cache))); // [kv_heads, head_size, qlen]
-        ggml_build_forward_expand(&ctx->gf, ggml_cpy(gctx, value_layer, v_cache_view));
+        // store key & value to the kv cache rows of the new tokens, one copy per run of consecutive rows
+        for (int i = 0; i < qlen;) {
+            const int row = seq.kv_rows[n_past + i];
+            int run = 1;
+            while (i + run < qlen && seq.kv_rows[n_past + i + run] == row + run) {
+                run++;
+            }
+            ggml_tensor *k_new =
+                tensor_assign_buffers(ggml_view_3d(gctx, key_layer, head_size, num_kv_heads, run, key_layer->nb[1],
+                                                   key_layer->nb[2], i * key_layer->nb[2]));
+            ggml_tensor *k_cache_view = tensor_assign_buffers(
+                ggml_view_3d(gctx, k_cache, head_size, num_kv_heads, run, head_size * ggml_element_size(k_cache),
+                             k_cache->nb[1], row * k_cache->nb[1])); // [run, kv_heads, head_size]
+            ggml_tensor *k_write = ggml_cpy(gctx, k_new, k_cache_view);
+            ggml_build_forward_expand(&ctx->gf, k_write);
+            ggml_tensor *v_new =
+                tensor_assign_buffers(ggml_view_3d(gctx, value_layer, head_size, num_kv_heads, run, value_layer->nb[1],
+                                                   value_layer->nb[2], i * value_layer->nb[2]));
+            ggml_tensor *v_cache_view = tensor_assign_buffers(
+                ggml_view_3d(gctx, v_cache, head_size, num_kv_heads, run, head_size * ggml_element_size(v_cache),
+                             v_cache->nb[1], row * v_cache->nb[1])); // [run, kv_heads, head_size]
+            ggml_tensor *v_write = ggml_cpy(gctx, v_new, v_cache_view);
+            ggml_build_forward_expand(&ctx->gf, v_write);
+            if (ctx->decode_inputs) {
+                auto &kv_writes = ctx->decode_inputs->seqs[seq.index].kv_writes;
+                kv_writes.push_back(k_write);
+                kv_writes.push_back(v_write);
+            }
+            i += run;
+        }
 
-        // concat key & value with past kv
-        key_layer = tensor_assign_buffers(ggml_view_3d(gctx, k_cache, head_size, n_past + qlen, num_kv_heads,
-                                                       k_cache->nb[1], k_cache->nb[2],
-                                                       0)); // [kv_heads, klen, head_size]
-        value_layer = tensor_assign_buffers(ggml_view_3d(gctx, v_cache, n_past + qlen, head_size, num_kv_heads,
-                                                         v_cache->nb[1], v_cache->nb[2],
-                                                         0)); // [kv_heads, head_size, klen]
+        // gather past & new key and value through the kv cache rows of this sequence
+        const int klen = seq.kv_rows.size();
+        key_layer = tensor_assign_buffers(ggml_get_rows(gctx, k_cache, seq.kv_indices)); // [klen, kv_heads * head_size]
+        key_layer = tensor_assign_buffers(ggml_reshape_3d(gctx, key_layer, head_size, num_kv_heads, klen));
+        key_layer = tensor_assign_buffers(ggml_permute(gctx, key_layer, 0, 2, 1, 3)); // [kv_heads, klen, head_size]
+#ifdef GGML_USE_CUBLAS
+        key_layer = tensor_assign_buffers(ggml_cont(gctx, key_layer));
+#endif
+        value_layer =
+            tensor_assign_buffers(ggml_get_rows(gctx, v_cache, seq.kv_indices)); // [klen, kv_heads * head_size]
+        value_layer = tensor_assign_buffers(ggml_reshape_3d(gctx, value_layer, head_size, num_kv_heads, klen));
+        value_layer = tensor_assign_buffers(
+            ggml_cont(gctx, ggml_permute(gctx, value_layer, 1, 2, 0, 3))); // [kv_heads, head_size, klen]
 
         // attention
         ggml_tensor *attn_scores =
@@ -546,16 +648,25 @@ class BasicAttention {
             ggml_scale_inplace(gctx, attn_scores, ggml_new_f32(gctx, 1.f / std::sqrt(head_size))));
         if constexpr (USE_ALIBI) {
             attn_scores = tensor_assign_buffers(ggml_alibi(gctx, attn_scores, n_past, num_attention_heads, 8));
+            if (ctx->decode_inputs) {
+                ctx->decode_inputs->seqs[seq.index].past_ops.push_back(attn_scores);
+            }
         }
-        if (n_past == 0) {
-            // build attention mask for context input
+        if (qlen > 1 || ctx->decode_inputs) {
+            // build attention mask for context input, new tokens also see all past tokens of their own sequence
             if (num_shared_q_heads > 1) {
-                attn_scores = ggml_reshape_3d(gctx, attn_scores, n_past + qlen, qlen,
-                                              num_attention_heads); // [heads, qlen, klen]
+                attn_scores =
+                    ggml_reshape_3d(gctx, attn_scores, klen, qlen, num_attention_heads); // [heads, qlen, klen]
+            }
+            if (qlen > 1) {
+                attn_scores = context_masker_(ctx, attn_scores, n_past);
+            } else {
+                // the token sees kv rows up to its own, the rest pad the graph for later steps
+                attn_scores = tensor_assign_buffers(ggml_diag_mask_inf_inplace(gctx, attn_scores, n_past));
+                ctx->decode_inputs->seqs[seq.index].past_ops.push_back(attn_scores);
             }
-            attn_scores = context_masker_(ctx, attn_scores, n_past);
             if (num_shared_q_heads > 1) {
-                attn_scores = ggml_reshape_3d(gctx, attn_scores, n_past + qlen, num_shared_q_heads * qlen,
+                attn_scores = ggml_reshape_3d(gctx, attn_scores, klen, num_shared_q_heads * qlen,
                                               num_kv_heads); // [kv_heads, shared_qheads * qlen, klen]
             }
         }
@@ -573,8 +684,7 @@ class BasicAttention {
         context_layer =
             tensor_assign_buffers(ggml_reshape_2d(gctx, context_layer, hidden_size, qlen)); // [qlen, hidden]
 
-        ggml_tensor *attn_output = dense.forward(ctx, context_layer);
-        return attn_output;
+        return context_layer;
     }
 
   public:
@@ -582,8 +692,8 @@ class BasicAttention {
     int num_kv_heads;
     Linear query_key_value;
     Linear dense;
-    ggml_tensor *k_cache; // [kv_heads, max_len, head_size]
-    ggml_tensor *v_cache; // [kv_heads, head_size, max_len]
+    ggml_tensor *k_cache; // [kv_cache_size, kv_heads * head_size]
+    ggml_tensor *v_cache; // [kv_cache_size, kv_heads * head_size]
 
   private:
     Roper roper_;
@@ -595,18 +705,18 @@ class BasicBlock {
   public:
     BasicBlock() = default;
     BasicBlock(ModelContext *ctx, int hidden_size, int num_attention_heads, int num_kv_heads, int intermediate_size,
-               int max_length, float norm_eps)
+               int kv_cache_size, float norm_eps)
         : input_layernorm(ctx, hidden_size, false, norm_eps),
-          attention(ctx, hidden_size, num_attention_heads, num_kv_heads, max_length),
+          attention(ctx, hidden_size, num_attention_heads, num_kv_heads, kv_cache_size),
           post_attention_layernorm(ctx, hidden_size, false, norm_eps), mlp(ctx, hidden_size, intermediate_size) {}
 
-    ggml_tensor *forward(ModelContext *ctx, ggml_tensor *hidden_states, ggml_tensor *position_ids, int n_past,
-                         int n_ctx) const {
+    ggml_tensor *forward(ModelContext *ctx, ggml_tensor *hidden_states,
+                         const std::vector<BatchedSequence> &seqs) const {
         ggml_context *gctx = ctx->ctx_b.get();
 
         ggml_tensor *residual = hidden_states;
         hidden_states = input_layernorm.forward(ctx, hidden_states);
-        hidden_states = attention.forward(ctx, hidden_states, position_ids, n_past, n_ctx);
+        hidden_states = attention.forward(ctx, hidden_states, seqs);
         hidden_states = tensor_assign_buffers(ggml_add_inplace(gctx, hidden_states, residual));
 
         residual = hidden_states;
@@ -631,27 +741,36 @@ class BasicBlock {
 
 struct NoopPositionIdsGenerator {
     ggml_tensor *operator()(ggml_context *ctx, int qlen, int n_past, int n_ctx) const { return nullptr; }
+    void fill(ggml_tensor *position_ids, int qlen, int n_past, int n_ctx) const {}
 };
 
 struct BasicPositionIdsGenerator {
     ggml_tensor *operator()(ggml_context *ctx, int qlen, int n_past, int n_ctx) const {
         ggml_tensor *position_ids = ggml_new_tensor_1d(ctx, GGML_TYPE_I32, qlen);
+        fill(position_ids, qlen, n_past, n_ctx);
+        return position_ids;
+    }
+
+    void fill(ggml_tensor *position_ids, int qlen, int n_past, int n_ctx) const {
         for (int i = 0; i < qlen; i++) {
             ((int *)position_ids->data)[i] = n_past + i;
         }
-        return position_ids;
     }
 };
 
 struct GLMPositionIdsGenerator {
     ggml_tensor *operator()(ggml_context *ctx, int qlen, int n_past, int n_ctx) const {
         ggml_tensor *position_ids = ggml_new_tensor_1d(ctx, GGML_TYPE_I32, qlen * 2);
+        fill(position_ids, qlen, n_past, n_ctx);
+        return position_ids;
+    }
+
+    void fill(ggml_tensor *position_ids, int qlen, int n_past, int n_ctx) const {
         for (int i = 0; i < qlen; i++) {
             const int p = n_past + i;
             ((int *)position_ids->data)[i] = std::min(p, n_ctx - 2);
             ((int *)position_ids->data)[qlen + i] = std::max(p - (n_ctx - 2), 0);
         }
-        return position_ids;
     }
 };
 
@@ -667,19 +786,41 @@ class BasicModel {
         : word_embeddings(ctx, config.vocab_size, config.hidden_size), layers(build_layers(ctx, config)),
           final_layernorm(ctx, config.hidden_size) {}
 
+    // a single sequence stored at the beginning of the kv cache
     ggml_tensor *forward(ModelContext *ctx, ggml_tensor *input_ids, int n_past, int n_ctx) const {
+        const int qlen = input_ids->ne[0];
+        std::vector<int> kv_rows(n_past + qlen);
+        std::iota(kv_rows.begin(), kv_rows.end(), 0);
+        return forward(ctx, input_ids, {{std::move(kv_rows), qlen, n_past, n_ctx}});
+    }
+
+    // input_ids holds the new tokens of all sequences back to back
+    ggml_tensor *forward(ModelContext *ctx, ggml_tensor *input_ids, std::vector<BatchedSequence> seqs) const {
         ggml_context *gctx = ctx->ctx_b.get();
-        ggml_tensor *position_ids = pos_ids_gen_(gctx, input_ids->ne[0], n_past, n_ctx);
-        if (position_ids) {
-            tensor_to_device(position_ids);
+        for (size_t i = 0; i < seqs.size(); i++) {
+            BatchedSequence &seq = seqs[i];
+            seq.index = i;
+            seq.position_ids = pos_ids_gen_(gctx, seq.qlen, seq.n_past, seq.n_ctx);
+            if (seq.position_ids) {
+                tensor_to_device(seq.position_ids);
+            }
+            seq.kv_indices = ggml_new_tensor_1d(gctx, GGML_TYPE_I32, seq.kv_rows.size());
+            memcpy(seq.kv_indices->data, seq.kv_rows.data(), ggml_nbytes(seq.kv_indices));
+            tensor_to_device(seq.kv_indices);
+            if (ctx->decode_inputs) {
+                ctx->decode_inputs->seqs.push_back({seq.position_ids, seq.kv_indices});
+            }
         }
         ggml_tensor *hidden_states = word_embeddings.forward(ctx, input_ids);
         for (const auto &layer : layers) {
             ggml_set_scratch(gctx, ctx->scratch);
-            hidden_states = layer.forward(ctx, hidden_states, position_ids, n_past, n_ctx);
+            hidden_states = layer.forward(ctx, hidden_states, seqs);
         }
-        if (position_ids) {
-            tensor_to_cpu(position_ids);
+        for (auto &seq : seqs) {
+            if (seq.position_ids) {
+                tensor_to_cpu(seq.position_ids);
+            }
+            tensor_to_cpu(seq.kv_indices);
         }
         ggml_scratch empty_scratch = {0, 0, nullptr};
         ggml_set_scratch(gctx, empty_scratch);
@@ -687,6 +828,17 @@ class BasicModel {
         return hidden_states;
     }
 
+    // rewrite the inputs of a decode graph recorded by forward for the next step of seqs
+    void update_decode_inputs(DecodeGraphInputs &inputs, const std::vector<int> &input_ids,
+                              const std::vector<BatchedSequence> &seqs) const {
+        inputs.update(input_ids, seqs);
+        for (size_t i = 0; i < seqs.size(); i++) {
+            if (inputs.seqs[i].position_ids) {
+                pos_ids_gen_.fill(inputs.seqs[i].position_ids, seqs[i].qlen, seqs[i].n_past, seqs[i].n_ctx);
+            }
+        }
+    }
+
   private:
     std::vector<Block> build_layers(ModelContext *ctx, const ModelConfig &config) {
         std::vector<Block> layers;
@@ -694,7 +846,7 @@ class BasicModel {
         for (int layer_id = 0; layer_id < config.num_hidden_layers; layer_id++) {
             // TODO: reduce max length? 32k might be too large for cpu inference
             layers.emplace_back(ctx, config.hidden_size, config.num_attention_heads, config.num_kv_heads,
-                                config.intermediate_size, config.max_length, config.norm_eps);
+                                config.intermediate_size, config.kv_cache_size(), config.norm_eps);
         }
         return layers;
     }
@@ -708,6 +860,56 @@ class BasicModel {
     PositionIdsGenerator pos_ids_gen_;
 };
 
+// ===== tracing =====
+
+// Timed spans of work, kept per thread and dumped as a chrome://tracing or Perfetto trace. Recording is off until
+// enabled, and then costs two clock reads and a write into a ring buffer of the calling thread: no lock is taken,
+// and the oldest spans of a thread are overwritten once its buffer is full.
+class Tracer {
+  public:
+    static constexpr size_t RING_SIZE = 1 << 14; // spans kept per thread
+
+    static void set_enabled(bool enabled);
+    static bool is_enabled() { return enabled_.load(std::memory_order_relaxed); }
+
+    static int64_t now_us() {
+        return std::chrono::duration_cast<std::chrono::microseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch())
+            .count();
+    }
+
+    // name must outlive the tracer, as string literals do. id ties a span to a request, 0 for none.
+    static void record(const char *name, int64_t start_us, int64_t end_us, int64_t id = 0);
+    // label the calling thread in the trace
+    static void set_thread_name(const std::string &name);
+
+    // write the spans recorded so far by all threads as a trace event json
+    static void dump(std::ostream &os);
+
+  private:
+    static std::atomic<bool> enabled_;
+};
+
+// Records the lifetime of the scope as a span when tracing is enabled.
+class TraceScope {
+  public:
+    TraceScope(const char *name, int64_t id = 0)
+        : name_(name), id_(id), start_us_(Tracer::is_enabled() ? Tracer::now_us() : -1) {}
+    ~TraceScope() {
+        if (start_us_ >= 0) {
+            Tracer::record(name_, start_us_, Tracer::now_us(), id_);
+        }
+    }
+
+    TraceScope(const TraceScope &) = delete;
+    TraceScope &operator=(const TraceScope &) = delete;
+
+  private:
+    const char *name_;
+    int64_t id_;
+    int64_t start_us_;
+};
+
 class BaseStreamer {
   public:
     virtual ~BaseStreamer() = default;
@@ -822,13 +1024,87 @@ struct GenerationConfig {
     float temperature;
     float repetition_penalty;
     int num_threads;
+    int num_draft_tokens;   // tokens proposed per step when decoding with a draft model
+    int prefill_chunk_size; // prompt tokens computed per forward while prefilling, 0 for the whole prompt at once
+    std::vector<std::string> stop_strings; // generation ends once the output contains one of them, which is cut off
+    int num_beams = 1;            // hypotheses kept by beam search, 1 to decode a single one
+    int num_return_sequences = 1; // outputs of generate_sequences
+    float length_penalty = 1.f;   // beam scores are summed log probabilities over the output length to this power
 
     GenerationConfig(int max_length = 2048, int max_new_tokens = -1, int max_context_length = 512,
                      bool do_sample = true, int top_k = 0, float top_p = 0.7, float temperature = 0.95,
-                     float repetition_penalty = 1.f, int num_threads = 0)
+                     float repetition_penalty = 1.f, int num_threads = 0, int num_draft_tokens = 4,
+                     int prefill_chunk_size = 0)
         : max_length(max_length), max_new_tokens(max_new_tokens), max_context_length(max_context_length),
           do_sample(do_sample), top_k(top_k), top_p(top_p), temperature(temperature),
-          repetition_penalty(repetition_penalty), num_threads(num_threads) {}
+          repetition_penalty(repetition_penalty), num_threads(num_threads), num_draft_tokens(num_draft_tokens),
+          prefill_chunk_size(prefill_chunk_size) {}
+};
+
+// Lets another thread stop a generation, which checks the token before every decoding step.
+class CancellationToken {
+  public:
+    using clock = std::chrono::steady_clock;
+
+    void cancel() { cancelled_ = true; }
+    // cancel automatically once deadline has passed
+    void set_deadline(clock::time_point deadline) { deadline_ = deadline.time_since_epoch().count(); }
+    bool is_cancelled() const { return cancelled_ || clock::now().time_since_epoch().count() >= deadline_; }
+
+  private:
+    std::atomic<bool> cancelled_{false};
+    std::atomic<clock::rep> deadline_{std::numeric_limits<clock::rep>::max()}; // ticks since clock epoch
+};
+
+// Aho-Corasick automaton over bytes, finding the first occurrence of any of several patterns in text that arrives
+// piece by piece. Each byte costs one table lookup whatever the number of patterns.
+class AhoCorasick {
+  public:
+    AhoCorasick() : AhoCorasick(std::vector<std::string>{}) {}
+    explicit AhoCorasick(const std::vector<std::string> &patterns);
+
+    bool empty() const { return next_.size() == 1; }
+
+    // Continue the text with piece. Returns the offset in piece just past the end of the first pattern found, or
+    // std::string::npos. The state moves on to the end of piece either way.
+    size_t feed(std::string_view piece);
+    // length of the longest pattern ending where the last match was found
+    int match_size() const { return match_size_; }
+    // bytes at the end of the text so far that may be the start of a pattern
+    int partial_match_size() const { return depth_[state_]; }
+
+    void reset() {
+        state_ = 0;
+        match_size_ = 0;
+    }
+
+  private:
+    std::vector<std::array<int, 256>> next_; // goto function with the failure links folded in
+    std::vector<int> depth_;                 // length of the prefix each state stands for
+    std::vector<int> output_;                // longest pattern ending at each state, 0 for none
+    int state_ = 0;
+    int match_size_ = 0;
+};
+
+// Tells when the text of generated tokens contains a stop string. Tokens are decoded a line at a time as the
+// streamers do, and only the new bytes of each token run through the automaton, so the whole output is never decoded
+// again.
+class StopStringMatcher {
+  public:
+    StopStringMatcher(const BaseTokenizer *tokenizer, const std::vector<std::string> &stop_strings)
+        : tokenizer_(tokenizer), automaton_(stop_strings) {}
+
+    // add the next generated token, returns true once the output contains a stop string
+    bool put(int token_id);
+
+    // cut text at the first stop string in it
+    static void truncate(std::string &text, const std::vector<std::string> &stop_strings);
+
+  private:
+    const BaseTokenizer *tokenizer_;
+    AhoCorasick automaton_;
+    std::vector<int> token_cache_; // tokens of the current line
+    size_t fed_len_ = 0;           // bytes of the current line run through the automaton
 };
 
 int get_num_physical_cores();
@@ -849,24 +1125,192 @@ struct TokenIdScore {
     }
 };
 
+// Hands out fixed-size blocks of kv cache rows. Each sequence keeps a block table, the list of blocks holding its
+// tokens in order, so kv cache memory is only taken by tokens in use. Blocks are reference counted so that several
+// block tables can share them.
+class KVBlockAllocator {
+  public:
+    KVBlockAllocator() = default;
+    KVBlockAllocator(int num_blocks, int block_size);
+
+    int num_blocks() const { return num_blocks_; }
+    int block_size() const { return block_size_; }
+    int num_free_blocks() const { return free_blocks_.size(); }
+    int ref_count(int block) const { return ref_counts_[block]; }
+
+    // number of blocks block_table still lacks to hold num_tokens tokens
+    int num_blocks_needed(const std::vector<int> &block_table, int num_tokens) const {
+        return std::max((num_tokens + block_size_ - 1) / block_size_ - (int)block_table.size(), 0);
+    }
+    // grow block_table to hold num_tokens tokens, returns false and leaves it untouched when blocks run out
+    bool reserve(std::vector<int> &block_table, int num_tokens);
+    // take one more reference to a block in use
+    void share(int block) { ref_counts_[block]++; }
+    // drop the references of block_table, blocks nobody references go back to the pool
+    void release(std::vector<int> &block_table);
+    // drop the blocks of block_table beyond its first num_tokens tokens
+    void truncate(std::vector<int> &block_table, int num_tokens);
+    // Give block_table a block of its own for token pos before it is written. A block others still reference is
+    // swapped for a free one, and the old block is returned for its kv cache to be copied over, otherwise -1.
+    int copy_on_write(std::vector<int> &block_table, int pos);
+    // kv cache rows of the first num_tokens tokens
+    std::vector<int> rows(const std::vector<int> &block_table, int num_tokens) const;
+
+  private:
+    int num_blocks_ = 0;
+    int block_size_ = 1;
+    std::vector<int> free_blocks_;
+    std::vector<int> ref_counts_;
+};
+
+// Radix tree over token ids whose edges are kv cache blocks: a path from the root spells a cached prefix, one full
+// block of tokens per edge. Sequences starting with a cached prefix share its blocks and only compute the rest.
+class PrefixCache {
+  public:
+    PrefixCache(KVBlockAllocator *allocator, bool enabled = true) : allocator_(allocator), enabled_(enabled) {}
+
+    // share the blocks of the longest cached prefix of input_ids into an empty block table and return its length,
+    // leaving at least one token to compute
+    int match(const std::vector<int> &input_ids, std::vector<int> &block_table);
+    // remember the full blocks of block_table, which hold kv cache of the first num_tokens tokens of input_ids
+    void insert(const std::vector<int> &input_ids, const std::vector<int> &block_table, int num_tokens);
+    // drop least recently used prefixes no sequence is using until num_blocks blocks are free, returns false if
+    // that is not possible
+    bool evict(int num_blocks);
+
+    int num_cached_blocks() const { return num_cached_blocks_; }
+
+  private:
+    struct Node {
+        std::vector<int> tokens;
+        int block = -1;
+        int64_t last_access = 0;
+        Node *parent = nullptr;
+        std::map<std::vector<int>, std::unique_ptr<Node>> children;
+    };
+
+    KVBlockAllocator *allocator_;
+    bool enabled_;
+    Node root_;
+    int64_t clock_ = 0;
+    int num_cached_blocks_ = 0;
+};
+
+// bytes of memory held by a model
+struct MemoryUsage {
+    size_t weights;        // mapped or loaded weights
+    size_t kv_cache;       // kv cache of all sequences
+    size_t compute_buffer; // graph tensors
+    size_t scratch_buffer; // intermediate tensors of the layers
+    size_t work_buffer;    // grows to the largest graph computed so far
+    int kv_tokens_in_use;  // kv cache taken by sequences and the prefix cache, in tokens
+
+    size_t total() const { return weights + kv_cache + compute_buffer + scratch_buffer + work_buffer; }
+};
+
+// tokens computed by a batched generation and the time it took, split by the kind of step
+struct BatchGenerationStats {
+    int64_t prefill_tokens = 0; // prompt tokens
+    double prefill_seconds = 0; // steps with prompt tokens, which also decode the running sequences
+    int64_t decode_tokens = 0;  // tokens generated by steps without prompt tokens
+    double decode_seconds = 0;
+};
+
+// how to reduce the final hidden states of a sequence to one embedding
+enum class PoolingType {
+    MEAN, // average over all tokens
+    LAST, // the last token, which has attended to the whole input
+};
+
 class BaseModelForCausalLM {
   public:
     BaseModelForCausalLM(ModelConfig config, size_t mem_size, size_t scratch_size, size_t num_weights);
     virtual ~BaseModelForCausalLM() = default;
 
     virtual void load(ModelLoader &loader) = 0;
-    virtual ggml_tensor *forward(ModelContext *ctx, ggml_tensor *input_ids, int n_past, int n_ctx,
+    virtual ggml_tensor *forward(ModelContext *ctx, ggml_tensor *input_ids, const std::vector<BatchedSequence> &seqs,
                                  bool is_decoding) const = 0;
-
+    // the hidden states of all new tokens after final_layernorm, without the lm_head projection
+    virtual ggml_tensor *forward_hidden_states(ModelContext *ctx, ggml_tensor *input_ids,
+                                               const std::vector<BatchedSequence> &seqs) const = 0;
+    // rewrite the inputs of a decode graph recorded by forward for the next step of seqs
+    virtual void update_decode_inputs(DecodeGraphInputs &inputs, const std::vector<int> &input_ids,
+                                      const std::vector<BatchedSequence> &seqs) const = 0;
+    // copy the kv cache of whole blocks in every layer, from the first block of each pair to the second
+    virtual void copy_kv_blocks(const std::vector<std::pair<int, int>> &copies) = 0;
+
+    // run the default sequence, whose kv cache blocks are kept by the model across calls
     ggml_tensor *forward_graph_compute(const std::vector<int> &input_ids, int n_past, int n_ctx, int n_threads,
                                        bool is_decoding);
 
+    // run a single sequence whose kv cache lives in block_table, growing it as needed
+    ggml_tensor *forward_graph_compute(const std::vector<int> &input_ids, int n_past, int n_ctx, int n_threads,
+                                       bool is_decoding, std::vector<int> &block_table);
+
+    // Run a single graph over several sequences whose new tokens are packed back to back in input_ids.
+    // Their kv_rows should come from block tables of kv_allocator. When decoding, returns next token logits of shape
+    // [num_seqs, vocab_size].
+    ggml_tensor *forward_graph_compute(const std::vector<int> &input_ids, const std::vector<BatchedSequence> &seqs,
+                                       int n_threads, bool is_decoding);
+
+    // With a draft_model sharing the vocabulary, decoding is speculative: the draft proposes
+    // gen_config.num_draft_tokens tokens and a single forward of this model verifies them all. Rejection sampling
+    // keeps the output distribution that of this model alone. Generation also ends once stop_matcher finds a stop
+    // string in the output.
+    std::vector<int> generate(const std::vector<int> &input_ids, const GenerationConfig &gen_config,
+                              BaseStreamer *streamer = nullptr, const CancellationToken *cancel_token = nullptr,
+                              BaseModelForCausalLM *draft_model = nullptr, StopStringMatcher *stop_matcher = nullptr);
+
+    // Continue a sequence whose kv cache lives in block_table and already holds the first n_past tokens of
+    // input_ids. On return n_past is the number of output tokens in kv cache.
     std::vector<int> generate(const std::vector<int> &input_ids, const GenerationConfig &gen_config,
-                              BaseStreamer *streamer = nullptr);
+                              BaseStreamer *streamer, std::vector<int> &block_table, int &n_past,
+                              const CancellationToken *cancel_token = nullptr,
+                              BaseModelForCausalLM *draft_model = nullptr, StopStringMatcher *stop_matcher = nullptr);
+
+    // Generate for many inputs at once, up to max_batch_size sequences sharing each forward pass so that decoding
+    // multiplies weights by matrices rather than vectors. A finished sequence hands its slot to the next input, which
+    // is prefilled along with the running ones. Every sequence takes kv cache for its whole output once admitted, so
+    // kv_allocator should hold max_batch_size sequences of gen_config.max_length tokens. With a tokenizer, sequences
+    // also end at gen_config.stop_strings. Returns the output ids of each input, in order.
+    std::vector<std::vector<int>> generate_batch(const std::vector<std::vector<int>> &inputs,
+                                                 const GenerationConfig &gen_config, int max_batch_size = 8,
+                                                 const BaseTokenizer *tokenizer = nullptr);
+
+    // Streamed generate_batch: next_input is asked for an input whenever a slot is free and returns false once there
+    // are none left, on_output gets the output ids of each input with its index as soon as the sequence ends.
+    void generate_batch(const std::function<bool(std::vector<int> &input_ids)> &next_input,
+                        const std::function<void(size_t index, std::vector<int> &output_ids)> &on_output,
+                        const GenerationConfig &gen_config, int max_batch_size = 8,
+                        const BaseTokenizer *tokenizer = nullptr, BatchGenerationStats *stats = nullptr);
+
+    // Several outputs for one input. With gen_config.num_beams > 1 this is beam search, returning the
+    // num_return_sequences best finished beams, best first. Otherwise num_return_sequences outputs are sampled
+    // independently. The prompt is computed once and all hypotheses advance in one batched forward. They share the kv
+    // cache blocks of their common prefix, a block being copied only when a hypothesis writes into one that others
+    // still reference.
+    std::vector<std::vector<int>> generate_sequences(const std::vector<int> &input_ids,
+                                                     const GenerationConfig &gen_config,
+                                                     const CancellationToken *cancel_token = nullptr);
 
     int generate_next_token(const std::vector<int> &input_ids, const GenerationConfig &gen_config, int n_past,
                             int n_ctx);
 
+    // Prompt tokens to compute per forward while prefilling, 0 for all of them. The scratch memory of a chunk is
+    // bounded by its size and not by the length of the prompt. Chatglm prompts attend to the whole prompt, so they
+    // are never split.
+    int prefill_chunk_size(const GenerationConfig &gen_config) const {
+        return config.model_type == ModelType::CHATGLM ? 0 : std::max(gen_config.prefill_chunk_size, 0);
+    }
+
+    // pick the next token from logits of the last position, input_ids being the sequence so far
+    static int sample_next_token(float *next_token_logits, int vocab_size, const std::vector<int> &input_ids,
+                                 const GenerationConfig &gen_config);
+    // the candidates sample_next_token draws from and their probabilities, a single one for greedy search
+    static std::vector<TokenIdScore> sampling_distribution(float *next_token_logits, int vocab_size,
+                                                           const std::vector<int> &input_ids,
+                                                           const GenerationConfig &gen_config);
+
     // logits processor
     static void sampling_repetition_penalty(float *first, float *last, const std::vector<int> &input_ids,
                                             float penalty);
@@ -877,11 +1321,58 @@ class BaseModelForCausalLM {
 
     static void sampling_softmax_inplace(TokenIdScore *first, TokenIdScore *last);
 
+    // Embed each input by pooling its final hidden states. Inputs are packed into as few graphs as the buffers and the
+    // free kv cache allow, and their kv cache is released afterwards.
+    std::vector<std::vector<float>> embed(const std::vector<std::vector<int>> &inputs, PoolingType pooling,
+                                          int n_threads);
+
+    // Most sequences one graph holds: each adds its own attention nodes to every layer, and half of the node budget
+    // is left to the layers themselves.
+    int max_graph_seqs() const {
+        return std::max(1, GGML_MAX_NODES / 2 / (config.num_hidden_layers * GRAPH_NODES_PER_SEQ_LAYER));
+    }
+
+    MemoryUsage memory_usage() const;
+
+    // One step of speculative decoding after output_ids, whose tokens but the last are in kv cache. Returns the
+    // accepted draft tokens followed by one token of this model. The draft keeps its own kv cache in
+    // draft_block_table, of which the first draft_n_past tokens are valid. Blocks of block_table taken by rejected
+    // draft tokens are left to the caller to truncate.
+    std::vector<int> speculate(const std::vector<int> &output_ids, int n_ctx, int num_draft,
+                               const GenerationConfig &gen_config, std::vector<int> &block_table,
+                               BaseModelForCausalLM *draft_model, std::vector<int> &draft_block_table,
+                               int &draft_n_past);
+
   protected:
     ModelContext ctx_;
+    std::vector<int> default_block_table_;
+
+  private:
+    ggml_tensor *graph_compute(const std::vector<int> &input_ids, const std::vector<BatchedSequence> &seqs,
+                               int n_threads, bool is_decoding, bool hidden_states_only);
+
+    // Compute kv cache of input_ids past n_past chunk by chunk, leaving the last chunk to the forward that also gives
+    // the next token logits.
+    void prefill_chunks(const std::vector<int> &input_ids, int &n_past, int n_ctx, const GenerationConfig &gen_config,
+                        std::vector<int> &block_table, const CancellationToken *cancel_token);
+
+    // A decode step gathers kv rows of each sequence rounded up to this, so that the graph of one step serves the
+    // next ones until a sequence crosses a multiple of it.
+    static constexpr int DECODE_GRAPH_KV_STEP = 64;
+
+    // upper bound of the graph nodes attending one sequence adds to a layer
+    static constexpr int GRAPH_NODES_PER_SEQ_LAYER = 32;
+
+    DecodeGraphInputs decode_graph_;
+    std::vector<int> decode_graph_key_; // padded kv length and n_ctx of each sequence, empty without a decode graph
+    ggml_tensor *decode_graph_outputs_ = nullptr;
+    ggml_cplan graph_plan_;
+    int graph_plan_threads_ = 0; // 0 until the graph in ctx_ is planned
 
   public:
     ModelConfig config;
+    KVBlockAllocator kv_allocator;
+    PrefixCache prefix_cache;
 };
 
 using StateDict = std::vector<std::pair<std::string, ggml_tensor *>>;
@@ -900,19 +1391,67 @@ class BasicModelForCausalLM : public BaseModelForCausalLM {
     ~BasicModelForCausalLM() { to_cpu(); }
 
   public:
-    ggml_tensor *forward(ModelContext *ctx, ggml_tensor *input_ids, int n_past, int n_ctx,
+    using BaseModelForCausalLM::forward;
+
+    ggml_tensor *forward(ModelContext *ctx, ggml_tensor *input_ids, const std::vector<BatchedSequence> &seqs,
                          bool is_decoding) const override {
-        ggml_tensor *transformer_outputs = transformer.forward(ctx, input_ids, n_past, n_ctx);
+        ggml_context *gctx = ctx->ctx_b.get();
+        ggml_tensor *transformer_outputs = transformer.forward(ctx, input_ids, seqs);
         // NOTE: only compute next token logits for decoding
-        if (is_decoding && input_ids->ne[0] > 1) {
-            transformer_outputs = tensor_assign_buffers(
-                ggml_view_1d(ctx->ctx_b.get(), transformer_outputs, config.hidden_size,
-                             (input_ids->ne[0] - 1) * config.hidden_size * ggml_element_size(transformer_outputs)));
+        if (is_decoding && input_ids->ne[0] > (int64_t)seqs.size()) {
+            if (seqs.size() == 1) {
+                transformer_outputs = tensor_assign_buffers(
+                    ggml_view_1d(gctx, transformer_outputs, config.hidden_size,
+                                 (input_ids->ne[0] - 1) * config.hidden_size * ggml_element_size(transformer_outputs)));
+            } else {
+                // gather the last row of each sequence
+                ggml_tensor *last_ids = ggml_new_tensor_1d(gctx, GGML_TYPE_I32, seqs.size());
+                int offset = 0;
+                for (size_t i = 0; i < seqs.size(); i++) {
+                    offset += seqs[i].qlen;
+                    ((int *)last_ids->data)[i] = offset - 1;
+                }
+                transformer_outputs = tensor_assign_buffers(ggml_get_rows(gctx, transformer_outputs, last_ids));
+            }
         }
         ggml_tensor *lm_logits = lm_head.forward(ctx, transformer_outputs);
         return lm_logits;
     }
 
+    ggml_tensor *forward_hidden_states(ModelContext *ctx, ggml_tensor *input_ids,
+                                       const std::vector<BatchedSequence> &seqs) const override {
+        return transformer.forward(ctx, input_ids, seqs);
+    }
+
+    void update_decode_inputs(DecodeGraphInputs &inputs, const std::vector<int> &input_ids,
+                              const std::vector<BatchedSequence> &seqs) const override {
+        transformer.update_decode_inputs(inputs, input_ids, seqs);
+    }
+
+    void copy_kv_blocks(const std::vector<std::pair<int, int>> &copies) override {
+        // a small graph of its own, leaving the graph in ctx_ to be reused by the next decode step
+        auto gctx = make_unique_ggml_context(copies.size() * transformer.layers.size() * 6 * ggml_tensor_overhead(),
+                                             nullptr, true);
+        auto gf = std::make_unique<ggml_cgraph>();
+        const int block_size = config.kv_block_size;
+        auto block_view = [&](ggml_tensor *cache, int block) {
+            return tensor_assign_buffers(ggml_view_2d(gctx.get(), cache, cache->ne[0], block_size, cache->nb[1],
+                                                      block * block_size * cache->nb[1]));
+        };
+        for (const auto &copy : copies) {
+            for (const auto &layer : transformer.layers) {
+                for (ggml_tensor *cache : {layer.attention.k_cache, layer.attention.v_cache}) {
+                    ggml_build_forward_expand(
+                        gf.get(), ggml_cpy(gctx.get(), block_view(cache, copy.first), block_view(cache, copy.second)));
+                }
+            }
+        }
+        ggml_cplan plan = ggml_graph_plan(gf.get(), 1);
+        std::vector<uint8_t> work_buffer(plan.work_size);
+        plan.work_data = work_buffer.data();
+        ggml_graph_compute(gf.get(), &plan);
+    }
+
   protected:
     void to_cpu() {
         for (auto &item : state_dict_) {
@@ -989,14 +1528,13 @@ class GLMBlock : public BasicBlock<LayerNorm, GLMAttention, GLMMLP> {
   public:
     GLMBlock() = default;
     GLMBlock(ModelContext *ctx, int hidden_size, int num_attention_heads, int num_kv_heads, int intermediate_size,
-             int max_length, float norm_eps)
+             int kv_cache_size, float norm_eps)
         : BasicBlock(LayerNorm(ctx, hidden_size, false, norm_eps),
-                     GLMAttention(ctx, hidden_size, num_attention_heads, num_attention_heads, max_length),
+                     GLMAttention(ctx, hidden_size, num_attention_heads, num_attention_heads, kv_cache_size),
                      LayerNorm(ctx, hidden_size, false, norm_eps), GLMMLP(ctx, hidden_size, intermediate_size)),
           alpha_value(std::sqrt(2.f * 28)) {}
 
-    ggml_tensor *forward(ModelContext *ctx, ggml_tensor *hidden_states, ggml_tensor *position_ids, int n_past,
-                         int n_ctx) const;
+    ggml_tensor *forward(ModelContext *ctx, ggml_tensor *hidden_states, const std::vector<BatchedSequence> &seqs) const;
 
   public:
     float alpha_value;
@@ -1263,9 +1801,18 @@ using InternLM20BForCausalLM = InternLMForCausalLM<InternLM20BModel>;
 
 // ===== pipeline =====
 
+// Pipelines are not thread-safe. To serve from several threads, give each thread a replica: replicas share the
+// mapped weights and the tokenizer, and only have a model of their own with its kv cache and buffers.
 class Pipeline {
   public:
-    Pipeline(const std::string &path);
+    // kv_cache_size is the number of tokens the kv cache holds for all sequences, 0 for the model's max_length
+    Pipeline(const std::string &path, int kv_cache_size = 0);
+
+    std::unique_ptr<Pipeline> replicate(int kv_cache_size = 0) const;
+
+    // Decode speculatively from now on, with the smaller model at path proposing tokens. It must share the
+    // vocabulary of this model.
+    void load_draft_model(const std::string &path, int kv_cache_size = 0);
 
     std::vector<int> generate(const std::vector<int> &input_ids, const GenerationConfig &gen_config,
                               BaseStreamer *streamer = nullptr) const;
@@ -1276,10 +1823,49 @@ class Pipeline {
     ChatMessage chat(const std::vector<ChatMessage> &messages, const GenerationConfig &gen_config,
                      BaseStreamer *streamer = nullptr) const;
 
+    // num_return_sequences texts generated for prompt, by beam search when num_beams > 1
+    std::vector<std::string> generate_sequences(const std::string &prompt, const GenerationConfig &gen_config) const;
+
+    // the text generated for each prompt, max_batch_size prompts decoded together at a time
+    std::vector<std::string> generate_batch(const std::vector<std::string> &prompts, const GenerationConfig &gen_config,
+                                            int max_batch_size = 8) const;
+
+    // one embedding of hidden_size floats per text, texts longer than max_length tokens are truncated
+    std::vector<std::vector<float>> embed(const std::vector<std::string> &texts, PoolingType pooling,
+                                          int num_threads = 0) const;
+
+  private:
+    Pipeline() = default;
+    void load(int kv_cache_size);
+
   public:
-    std::unique_ptr<BaseTokenizer> tokenizer;
+    std::shared_ptr<BaseTokenizer> tokenizer;
     std::unique_ptr<BaseModelForCausalLM> model;
-    std::unique_ptr<MappedFile> mapped_file;
+    std::shared_ptr<MappedFile> mapped_file;
+    std::unique_ptr<Pipeline> draft; // null unless decoding speculatively
+};
+
+// A conversation that keeps its kv cache between turns. Each turn only prefills the tokens after the longest common
+// prefix of the new prompt and the tokens already in kv cache.
+class ChatSession {
+  public:
+    ChatSession(Pipeline &pipeline) : pipeline_(&pipeline) {}
+    ChatSession(const ChatSession &) = delete;
+    ChatSession &operator=(const ChatSession &) = delete;
+    ~ChatSession() { reset(); }
+
+    ChatMessage chat(const std::vector<ChatMessage> &messages, const GenerationConfig &gen_config,
+                     BaseStreamer *streamer = nullptr);
+
+    // forget the conversation and free its kv cache
+    void reset();
+
+    int num_cached_tokens() const { return cached_ids_.size(); }
+
+  private:
+    Pipeline *pipeline_;
+    std::vector<int> block_table_;
+    std::vector<int> cached_ids_; // tokens whose kv cache is in block_table_
 };
 
 } // namespace chatglm
@@ -28,10 +28,9 @@ class PyBaseModelForCausalLM : public BaseModelForCausalLM {
 
     void load(ModelLoader &loader) override { PYBIND11_OVERLOAD_PURE(void, PyBaseModelForCausalLM, load, loader); }
 
-    ggml_tensor *forward(ModelContext *ctx, ggml_tensor *input_ids, int n_past, int n_ctx,
+    ggml_tensor *forward(ModelContext *ctx, ggml_tensor *input_ids, const std::vector<BatchedSequence> &seqs,
                          bool is_decoding) const override {
-        PYBIND11_OVERLOAD_PURE(ggml_tensor *, PyBaseModelForCausalLM, forward, ctx, input_ids, n_past, n_ctx,
-                               is_decoding)
+        PYBIND11_OVERLOAD_PURE(ggml_tensor *, PyBaseModelForCausalLM, forward, ctx, input_ids, seqs, is_decoding)
     }
 };
 
@@ -72,9 +71,10 @@ PYBIND11_MODULE(_C, m) {
         .def_property_readonly("model_type_name", &ModelConfig::model_type_name);
 
     py::class_<GenerationConfig>(m, "GenerationConfig")
-        .def(py::init<int, int, int, bool, int, float, float, float, int>(), "max_length"_a = 2048,
+        .def(py::init<int, int, int, bool, int, float, float, float, int, int, int>(), "max_length"_a = 2048,
              "max_new_tokens"_a = -1, "max_context_length"_a = 512, "do_sample"_a = true, "top_k"_a = 0,
-             "top_p"_a = 0.7, "temperature"_a = 0.95, "repetition_penalty"_a = 1.0, "num_threads"_a = 0)
+             "top_p"_a = 0.7, "temperature"_a = 0.95, "repetition_penalty"_a = 1.0, "num_threads"_a = 0,
+             "num_draft_tokens"_a = 4, "prefill_chunk_size"_a = 0)
         .def_readwrite("max_length", &GenerationConfig::max_length)
         .def_readwrite("max_new_tokens", &GenerationConfig::max_new_tokens)
         .def_readwrite("max_context_length", &GenerationConfig::max_context_length)
@@ -83,7 +83,13 @@ PYBIND11_MODULE(_C, m) {
         .def_readwrite("top_p", &GenerationConfig::top_p)
         .def_readwrite("temperature", &GenerationConfig::temperature)
         .def_readwrite("repetition_penalty", &GenerationConfig::repetition_penalty)
-        .def_readwrite("num_threads", &GenerationConfig::num_threads);
+        .def_readwrite("num_threads", &GenerationConfig::num_threads)
+        .def_readwrite("num_draft_tokens", &GenerationConfig::num_draft_tokens)
+        .def_readwrite("prefill_chunk_size", &GenerationConfig::prefill_chunk_size)
+        .def_readwrite("stop_strings", &GenerationConfig::stop_strings)
+        .def_readwrite("num_beams", &GenerationConfig::num_beams)
+        .def_readwrite("num_return_sequences", &GenerationConfig::num_return_sequences)
+        .def_readwrite("length_penalty", &GenerationConfig::length_penalty);
 
     py::class_<FunctionMessage>(m, "FunctionMessage")
         .def("__repr__", &to_string<FunctionMessage>)
@@ -162,7 +168,10 @@ PYBIND11_MODULE(_C, m) {
     // ===== Pipeline ====
 
     py::class_<Pipeline>(m, "Pipeline")
-        .def(py::init<const std::string &>(), "path"_a)
+        .def(py::init<const std::string &, int>(), "path"_a, "kv_cache_size"_a = 0)
+        .def("load_draft_model", &Pipeline::load_draft_model, "path"_a, "kv_cache_size"_a = 0)
+        .def("generate_batch", &Pipeline::generate_batch, "prompts"_a, "gen_config"_a, "max_batch_size"_a = 8)
+        .def("generate_sequences", &Pipeline::generate_sequences, "prompt"_a, "gen_config"_a)
         .def_property_readonly("model", [](const Pipeline &self) { return self.model.get(); })
         .def_property_readonly("tokenizer", [](const Pipeline &self) { return self.tokenizer.get(); });
 }
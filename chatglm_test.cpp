@@ -1,6 +1,7 @@
 #include "chatglm.h"
 #include <filesystem>
 #include <gtest/gtest.h>
+#include <thread>
 
 #ifdef GGML_USE_CUBLAS
 #include <cuda_runtime.h>
@@ -217,6 +218,69 @@ TEST(Sampling, TopP) {
     }
 }
 
+TEST(Sampling, Distribution) {
+    std::vector<float> logits(1024);
+    for (float &v : logits) {
+        v = random();
+    }
+    const int argmax = std::max_element(logits.begin(), logits.end()) - logits.begin();
+
+    // greedy search: the best token for sure
+    {
+        GenerationConfig gen_config;
+        gen_config.do_sample = false;
+        std::vector<float> scores = logits;
+        std::vector<TokenIdScore> dist =
+            BaseModelForCausalLM::sampling_distribution(scores.data(), scores.size(), {}, gen_config);
+        ASSERT_EQ(dist.size(), 1u);
+        EXPECT_EQ(dist.front().id, argmax);
+        EXPECT_FLOAT_EQ(dist.front().score, 1.f);
+    }
+    // sampling: probabilities of the top_k candidates
+    {
+        GenerationConfig gen_config;
+        gen_config.top_k = 20;
+        gen_config.top_p = 1.f;
+        std::vector<float> scores = logits;
+        std::vector<TokenIdScore> dist =
+            BaseModelForCausalLM::sampling_distribution(scores.data(), scores.size(), {}, gen_config);
+        ASSERT_EQ(dist.size(), (size_t)gen_config.top_k);
+        float sum = 0.f;
+        for (const auto &ts : dist) {
+            sum += ts.score;
+        }
+        EXPECT_NEAR(sum, 1.f, 1e-5);
+        EXPECT_TRUE(
+            std::any_of(dist.begin(), dist.end(), [argmax](const TokenIdScore &ts) { return ts.id == argmax; }));
+    }
+}
+
+TEST(AhoCorasick, Feed) {
+    AhoCorasick automaton({"he", "she", "his", "hers", ""});
+    EXPECT_FALSE(automaton.empty());
+
+    // the first pattern to end wins, reported with the longest pattern ending there
+    EXPECT_EQ(automaton.feed("ushers"), 4u);
+    EXPECT_EQ(automaton.match_size(), 3);
+
+    // matches span pieces fed separately
+    automaton.reset();
+    EXPECT_EQ(automaton.feed("xh"), std::string::npos);
+    EXPECT_EQ(automaton.partial_match_size(), 1);
+    EXPECT_EQ(automaton.feed("i"), std::string::npos);
+    EXPECT_EQ(automaton.partial_match_size(), 2);
+    EXPECT_EQ(automaton.feed("sx"), 1u);
+    EXPECT_EQ(automaton.match_size(), 3);
+    EXPECT_EQ(automaton.partial_match_size(), 0);
+
+    EXPECT_TRUE(AhoCorasick().empty());
+    EXPECT_EQ(AhoCorasick().feed("anything"), std::string::npos);
+
+    std::string text = "say hello, then bye";
+    StopStringMatcher::truncate(text, {"bye", ", "});
+    EXPECT_EQ(text, "say hello");
+}
+
 class ChatGLMTest : public ::testing::Test {
   protected:
     ModelContext ctx;
@@ -809,6 +873,304 @@ TEST_F(ChatGLMTest, GLM3Model) {
     test_model(model, config, data_path, seq_len, all_weights);
 }
 
+TEST(KVBlockAllocator, ReserveRelease) {
+    KVBlockAllocator kv_allocator(4, 2);
+    std::vector<int> a, b;
+    EXPECT_TRUE(kv_allocator.reserve(a, 3));
+    EXPECT_TRUE(equal(a, {0, 1}));
+    EXPECT_TRUE(kv_allocator.reserve(b, 4));
+    EXPECT_TRUE(equal(b, {2, 3}));
+    EXPECT_EQ(kv_allocator.num_free_blocks(), 0);
+    // out of blocks: the table is left untouched
+    EXPECT_FALSE(kv_allocator.reserve(a, 5));
+    EXPECT_TRUE(equal(a, {0, 1}));
+
+    kv_allocator.release(b);
+    EXPECT_TRUE(b.empty());
+    EXPECT_TRUE(kv_allocator.reserve(a, 5));
+    EXPECT_TRUE(equal(a, {0, 1, 2}));
+    EXPECT_TRUE(equal(kv_allocator.rows({3, 0}, 3), {6, 7, 0}));
+
+    // truncation keeps the block holding the last kept token
+    kv_allocator.truncate(a, 3);
+    EXPECT_TRUE(equal(a, {0, 1}));
+    EXPECT_EQ(kv_allocator.num_free_blocks(), 2);
+    kv_allocator.truncate(a, 0);
+    EXPECT_TRUE(a.empty());
+}
+
+TEST(KVBlockAllocator, CopyOnWrite) {
+    KVBlockAllocator kv_allocator(4, 2);
+    std::vector<int> a;
+    EXPECT_TRUE(kv_allocator.reserve(a, 3));
+    std::vector<int> b = a;
+    for (int block : b) {
+        kv_allocator.share(block);
+    }
+    // a shared block is swapped for a copy, the full block before it stays shared
+    EXPECT_EQ(kv_allocator.copy_on_write(a, 2), 1);
+    EXPECT_TRUE(equal(a, {0, 2}));
+    EXPECT_EQ(kv_allocator.ref_count(0), 2);
+    EXPECT_EQ(kv_allocator.ref_count(1), 1);
+    // the last holder writes in place
+    EXPECT_EQ(kv_allocator.copy_on_write(b, 2), -1);
+    EXPECT_TRUE(equal(b, {0, 1}));
+    EXPECT_EQ(kv_allocator.num_free_blocks(), 1);
+}
+
+TEST(PrefixCache, MatchInsertEvict) {
+    KVBlockAllocator kv_allocator(4, 2);
+    PrefixCache prefix_cache(&kv_allocator);
+
+    // a finished sequence of 5 tokens leaves its 2 full blocks in the cache
+    std::vector<int> a;
+    ASSERT_TRUE(kv_allocator.reserve(a, 5));
+    prefix_cache.insert({1, 2, 3, 4, 5}, a, 5);
+    EXPECT_EQ(prefix_cache.num_cached_blocks(), 2);
+    kv_allocator.release(a);
+    EXPECT_EQ(kv_allocator.num_free_blocks(), 2);
+
+    // shares the common prefix only
+    std::vector<int> b;
+    EXPECT_EQ(prefix_cache.match({1, 2, 3, 9, 9}, b), 2);
+    EXPECT_TRUE(equal(b, {0}));
+    // at least one token is left to compute
+    std::vector<int> c;
+    EXPECT_EQ(prefix_cache.match({1, 2, 3, 4}, c), 2);
+    EXPECT_TRUE(equal(c, {0}));
+
+    // blocks in use are never evicted
+    EXPECT_FALSE(prefix_cache.evict(4));
+    EXPECT_EQ(prefix_cache.num_cached_blocks(), 1);
+    kv_allocator.release(b);
+    kv_allocator.release(c);
+    EXPECT_TRUE(prefix_cache.evict(4));
+    EXPECT_EQ(prefix_cache.num_cached_blocks(), 0);
+    EXPECT_EQ(kv_allocator.num_free_blocks(), 4);
+}
+
+static int count_substr(const std::string &s, const std::string &sub) {
+    int count = 0;
+    for (size_t pos = s.find(sub); pos != std::string::npos; pos = s.find(sub, pos + sub.size())) {
+        count++;
+    }
+    return count;
+}
+
+TEST(Tracer, RecordDump) {
+    // nothing is recorded while disabled
+    { TraceScope trace("tracer_test_disabled"); }
+
+    Tracer::set_enabled(true);
+    { TraceScope trace("tracer_test_scope", 42); }
+    // a full ring keeps the latest spans of its thread
+    std::thread([] {
+        Tracer::set_thread_name("tracer test");
+        for (size_t i = 0; i < Tracer::RING_SIZE + 10; i++) {
+            Tracer::record("tracer_test_overflow", i, i + 1);
+        }
+    }).join();
+    Tracer::set_enabled(false);
+
+    std::ostringstream oss;
+    Tracer::dump(oss);
+    const std::string trace = oss.str();
+    EXPECT_EQ(trace.rfind("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[", 0), 0u);
+    EXPECT_EQ(trace.back(), '}');
+    EXPECT_EQ(count_substr(trace, "tracer_test_disabled"), 0);
+    EXPECT_EQ(count_substr(trace, "\"name\":\"tracer_test_scope\""), 1);
+    EXPECT_NE(trace.find("\"args\":{\"id\":42}"), std::string::npos);
+    EXPECT_NE(trace.find("\"args\":{\"name\":\"tracer test\"}"), std::string::npos);
+    EXPECT_EQ(count_substr(trace, "tracer_test_overflow"), (int)Tracer::RING_SIZE);
+    EXPECT_NE(trace.find("\"ts\":10,\"dur\":1"), std::string::npos);
+    EXPECT_EQ(trace.find("\"ts\":9,\"dur\":1"), std::string::npos);
+}
+
+TEST_F(ChatGLMTest, BatchedModel) {
+    ModelConfig config;
+    config.vocab_size = 5;
+    config.hidden_size = 32;
+    config.num_attention_heads = 8;
+    config.num_kv_heads = 2;
+    config.num_hidden_layers = 1;
+    config.intermediate_size = 48;
+    config.norm_eps = 1e-5;
+    config.max_length = 8;
+    config.num_kv_blocks = 8;
+    config.kv_block_size = 2;
+
+    ChatGLM3Model model(&ctx, config);
+
+    std::vector<ggml_tensor *> all_weights{model.word_embeddings.weight,
+                                           model.layers[0].input_layernorm.weight,
+                                           model.layers[0].attention.query_key_value.weight,
+                                           model.layers[0].attention.query_key_value.bias,
+                                           model.layers[0].attention.dense.weight,
+                                           model.layers[0].post_attention_layernorm.weight,
+                                           model.layers[0].mlp.gate_proj.weight,
+                                           model.layers[0].mlp.up_proj.weight,
+                                           model.layers[0].mlp.down_proj.weight,
+                                           model.final_layernorm.weight};
+    for (auto tensor : all_weights) {
+        random_fill(tensor);
+        if (tensor != model.word_embeddings.weight) {
+            tensor_to_device(tensor);
+        }
+    }
+    tensor_to_device(model.layers[0].attention.k_cache);
+    tensor_to_device(model.layers[0].attention.v_cache);
+
+    auto forward = [&](const std::vector<int> &input_ids, const std::vector<BatchedSequence> &seqs) {
+        reset_cgraph();
+        ggml_tensor *x = ggml_new_tensor_1d(ctx.ctx_b.get(), GGML_TYPE_I32, input_ids.size());
+        memcpy(x->data, input_ids.data(), ggml_nbytes(x));
+        ggml_tensor *y = model.forward(&ctx, x, seqs);
+        y->backend = GGML_BACKEND_CPU;
+        ggml_build_forward_expand(&ctx.gf, y);
+        device_graph_compute(get_num_threads());
+        return std::vector<float>((float *)y->data, (float *)y->data + ggml_nelements(y));
+    };
+    auto concat = [](std::initializer_list<std::vector<float>> parts) {
+        std::vector<float> out;
+        for (const auto &part : parts) {
+            out.insert(out.end(), part.begin(), part.end());
+        }
+        return out;
+    };
+    auto expect_vector_close = [](const std::vector<float> &a, const std::vector<float> &b) {
+        ASSERT_EQ(a.size(), b.size());
+        for (size_t i = 0; i < a.size(); i++) {
+            EXPECT_NEAR(a[i], b[i], 1e-4) << "at index " << i;
+        }
+    };
+
+    // kv cache rows through scattered blocks: sequence a takes blocks {5, 2, 3}, sequence b takes blocks {0, 7}
+    KVBlockAllocator kv_allocator(config.num_kv_blocks, config.kv_block_size);
+    const std::vector<int> a_rows = kv_allocator.rows({5, 2, 3}, 4);
+    const std::vector<int> b_rows = kv_allocator.rows({0, 7}, 4);
+    auto rows = [](const std::vector<int> &kv_rows, int n) {
+        return std::vector<int>(kv_rows.begin(), kv_rows.begin() + n);
+    };
+
+    // reference: each sequence runs alone, one new token at a time after its prompt
+    std::vector<float> ref_a1 = forward({1, 3, 0}, {{rows(a_rows, 3), 3, 0, 3}});
+    std::vector<float> ref_a2 = forward({2}, {{rows(a_rows, 4), 1, 3, 3}});
+    std::vector<float> ref_b1 = forward({4, 2}, {{rows(b_rows, 2), 2, 0, 2}});
+    std::vector<float> ref_b2 = forward({1}, {{rows(b_rows, 3), 1, 2, 2}});
+    std::vector<float> ref_b3 = forward({3}, {{rows(b_rows, 4), 1, 3, 2}});
+
+    // batched: both prompts in one graph, then a decoding step mixed with a two-token append
+    std::vector<float> out1 = forward({1, 3, 0, 4, 2}, {{rows(a_rows, 3), 3, 0, 3}, {rows(b_rows, 2), 2, 0, 2}});
+    expect_vector_close(out1, concat({ref_a1, ref_b1}));
+    std::vector<float> out2 = forward({2, 1, 3}, {{rows(a_rows, 4), 1, 3, 3}, {rows(b_rows, 4), 2, 2, 2}});
+    expect_vector_close(out2, concat({ref_a2, ref_b2, ref_b3}));
+
+    for (auto tensor : all_weights) {
+        tensor_to_cpu(tensor);
+    }
+    tensor_to_cpu(model.layers[0].attention.k_cache);
+    tensor_to_cpu(model.layers[0].attention.v_cache);
+}
+
+TEST_F(ChatGLMTest, DecodeGraphReuse) {
+    ModelConfig config;
+    config.vocab_size = 5;
+    config.hidden_size = 32;
+    config.num_attention_heads = 8;
+    config.num_kv_heads = 2;
+    config.num_hidden_layers = 1;
+    config.intermediate_size = 48;
+    config.norm_eps = 1e-5;
+    config.max_length = 8;
+    config.num_kv_blocks = 8;
+    config.kv_block_size = 2;
+
+    ChatGLM3Model model(&ctx, config);
+
+    std::vector<ggml_tensor *> all_weights{model.word_embeddings.weight,
+                                           model.layers[0].input_layernorm.weight,
+                                           model.layers[0].attention.query_key_value.weight,
+                                           model.layers[0].attention.query_key_value.bias,
+                                           model.layers[0].attention.dense.weight,
+                                           model.layers[0].post_attention_layernorm.weight,
+                                           model.layers[0].mlp.gate_proj.weight,
+                                           model.layers[0].mlp.up_proj.weight,
+                                           model.layers[0].mlp.down_proj.weight,
+                                           model.final_layernorm.weight};
+    for (auto tensor : all_weights) {
+        random_fill(tensor);
+        if (tensor != model.word_embeddings.weight) {
+            tensor_to_device(tensor);
+        }
+    }
+    tensor_to_device(model.layers[0].attention.k_cache);
+    tensor_to_device(model.layers[0].attention.v_cache);
+
+    auto forward = [&](const std::vector<int> &input_ids, const std::vector<BatchedSequence> &seqs) {
+        reset_cgraph();
+        ggml_tensor *x = ggml_new_tensor_1d(ctx.ctx_b.get(), GGML_TYPE_I32, input_ids.size());
+        memcpy(x->data, input_ids.data(), ggml_nbytes(x));
+        ggml_tensor *y = model.forward(&ctx, x, seqs);
+        y->backend = GGML_BACKEND_CPU;
+        ggml_build_forward_expand(&ctx.gf, y);
+        device_graph_compute(get_num_threads());
+        return std::vector<float>((float *)y->data, (float *)y->data + ggml_nelements(y));
+    };
+
+    KVBlockAllocator kv_allocator(config.num_kv_blocks, config.kv_block_size);
+    const std::vector<int> a_rows = kv_allocator.rows({5, 2, 3}, 6);
+    const std::vector<int> b_rows = kv_allocator.rows({0, 7, 6}, 6);
+    auto rows = [](const std::vector<int> &kv_rows, int n) {
+        return std::vector<int>(kv_rows.begin(), kv_rows.begin() + n);
+    };
+    // decoding step i of both sequences after their prompts
+    const std::vector<std::vector<int>> step_ids{{2, 1}, {4, 3}, {1, 0}};
+    auto step_seqs = [&](int i) {
+        return std::vector<BatchedSequence>{{rows(a_rows, 4 + i), 1, 3 + i, 3}, {rows(b_rows, 3 + i), 1, 2 + i, 2}};
+    };
+
+    // reference: a new graph for every step
+    forward({1, 3, 0, 4, 2}, {{rows(a_rows, 3), 3, 0, 3}, {rows(b_rows, 2), 2, 0, 2}});
+    std::vector<std::vector<float>> ref_outputs;
+    for (int i = 0; i < (int)step_ids.size(); i++) {
+        ref_outputs.emplace_back(forward(step_ids[i], step_seqs(i)));
+    }
+
+    // a single graph gathering 6 kv rows per sequence, its inputs rewritten between the steps
+    reset_cgraph();
+    std::vector<BatchedSequence> padded_seqs = step_seqs(0);
+    for (auto &seq : padded_seqs) {
+        seq.kv_rows.resize(6, seq.kv_rows.front());
+    }
+    DecodeGraphInputs inputs;
+    inputs.input_ids = ggml_new_tensor_1d(ctx.ctx_b.get(), GGML_TYPE_I32, 2);
+    memcpy(inputs.input_ids->data, step_ids[0].data(), ggml_nbytes(inputs.input_ids));
+    ctx.decode_inputs = &inputs;
+    ggml_tensor *y = model.forward(&ctx, inputs.input_ids, padded_seqs);
+    ctx.decode_inputs = nullptr;
+    y->backend = GGML_BACKEND_CPU;
+    ggml_build_forward_expand(&ctx.gf, y);
+    ASSERT_EQ(inputs.seqs.size(), 2u);
+
+    for (int i = 0; i < (int)step_ids.size(); i++) {
+        if (i > 0) {
+            model.update_decode_inputs(inputs, step_ids[i], step_seqs(i));
+        }
+        device_graph_compute(get_num_threads());
+        std::vector<float> output((float *)y->data, (float *)y->data + ggml_nelements(y));
+        ASSERT_EQ(output.size(), ref_outputs[i].size());
+        for (size_t j = 0; j < output.size(); j++) {
+            EXPECT_NEAR(output[j], ref_outputs[i][j], 1e-4) << "step " << i << " at index " << j;
+        }
+    }
+
+    for (auto tensor : all_weights) {
+        tensor_to_cpu(tensor);
+    }
+    tensor_to_cpu(model.layers[0].attention.k_cache);
+    tensor_to_cpu(model.layers[0].attention.v_cache);
+}
+
 TEST_F(ChatGLMTest, Baichuan7BModel) {
     fs::path data_path = fs::path(__FILE__).parent_path() / "tests/data/baichuan7b_model.data";
 
@@ -1144,6 +1506,194 @@ TEST(Pipeline, ChatGLM2) {
         ChatMessage output = pipeline.chat(messages, gen_config);
         EXPECT_EQ(output.content, "你好👋！我是人工智能助手 ChatGLM2-6B，很高兴见到你，欢迎问我任何问题。");
     }
+
+    // chat session: reusing the kv cache between turns answers as a fresh chat does, also when a turn only shares a
+    // prefix with the cached tokens
+    {
+        GenerationConfig gen_config;
+        gen_config.do_sample = false;
+        gen_config.max_new_tokens = 32;
+        std::unique_ptr<Pipeline> replica = pipeline.replicate();
+        ChatSession session(*replica);
+        EXPECT_EQ(session.num_cached_tokens(), 0);
+
+        std::vector<ChatMessage> messages{{ChatMessage::ROLE_USER, "你好"}};
+        ChatMessage output = session.chat(messages, gen_config);
+        EXPECT_EQ(output.content, pipeline.chat(messages, gen_config).content);
+        const int num_cached_tokens = session.num_cached_tokens();
+        EXPECT_GT(num_cached_tokens, 0);
+
+        messages.emplace_back(std::move(output));
+        messages.emplace_back(ChatMessage::ROLE_USER, "晚上睡不着应该怎么办");
+        EXPECT_EQ(session.chat(messages, gen_config).content, pipeline.chat(messages, gen_config).content);
+        EXPECT_GT(session.num_cached_tokens(), num_cached_tokens);
+
+        messages.back().content = "你是谁";
+        EXPECT_EQ(session.chat(messages, gen_config).content, pipeline.chat(messages, gen_config).content);
+        EXPECT_GT(session.num_cached_tokens(), num_cached_tokens);
+
+        session.reset();
+        EXPECT_EQ(session.num_cached_tokens(), 0);
+        EXPECT_EQ(session.chat(messages, gen_config).content, pipeline.chat(messages, gen_config).content);
+    }
+
+    // replica: shares weights and tokenizer, answers the same
+    {
+        std::unique_ptr<Pipeline> replica = pipeline.replicate();
+        EXPECT_EQ(replica->mapped_file.get(), pipeline.mapped_file.get());
+        EXPECT_EQ(replica->tokenizer.get(), pipeline.tokenizer.get());
+        EXPECT_NE(replica->model.get(), pipeline.model.get());
+
+        GenerationConfig gen_config;
+        gen_config.do_sample = false;
+        std::vector<ChatMessage> messages{{ChatMessage::ROLE_USER, "你好"}};
+        EXPECT_EQ(replica->chat(messages, gen_config).content, pipeline.chat(messages, gen_config).content);
+    }
+
+    // stop strings: generation ends at the first one, which is cut off
+    {
+        GenerationConfig gen_config;
+        gen_config.do_sample = false;
+        gen_config.stop_strings = {"ChatGLM2", "欢迎"};
+        std::vector<ChatMessage> messages{{ChatMessage::ROLE_USER, "你好"}};
+        ChatMessage output = pipeline.chat(messages, gen_config);
+        EXPECT_EQ(output.content, "你好👋！我是人工智能助手 ");
+    }
+
+    // chunked prefill: the prompt computed a few tokens at a time gives the same greedy output
+    {
+        GenerationConfig gen_config;
+        gen_config.do_sample = false;
+        gen_config.max_new_tokens = 16;
+        std::vector<ChatMessage> messages{
+            {ChatMessage::ROLE_USER, "你好"},
+            {ChatMessage::ROLE_ASSISTANT, "你好👋！我是人工智能助手 ChatGLM2-6B，很高兴见到你，欢迎问我任何问题。"},
+            {ChatMessage::ROLE_USER, "晚上睡不着应该怎么办"}};
+        const std::string expected = pipeline.chat(messages, gen_config).content;
+
+        for (int prefill_chunk_size : {1, 7}) {
+            // a replica starts with an empty prefix cache, so the whole prompt is prefilled
+            std::unique_ptr<Pipeline> replica = pipeline.replicate();
+            gen_config.prefill_chunk_size = prefill_chunk_size;
+            EXPECT_EQ(replica->chat(messages, gen_config).content, expected);
+        }
+    }
+
+    // speculative decoding: greedy output does not depend on the draft
+    {
+        GenerationConfig gen_config;
+        gen_config.do_sample = false;
+        std::vector<ChatMessage> messages{{ChatMessage::ROLE_USER, "你好"}};
+        const std::string expected = pipeline.chat(messages, gen_config).content;
+
+        std::unique_ptr<Pipeline> replica = pipeline.replicate();
+        replica->load_draft_model(model_path.string());
+        for (int num_draft_tokens : {1, 4}) {
+            gen_config.num_draft_tokens = num_draft_tokens;
+            EXPECT_EQ(replica->chat(messages, gen_config).content, expected);
+        }
+        EXPECT_EQ(replica->draft->model->kv_allocator.num_free_blocks(),
+                  replica->draft->model->kv_allocator.num_blocks());
+    }
+
+    // batched generation: two slots refilled from four prompts give the greedy output of each prompt alone
+    {
+        GenerationConfig gen_config;
+        gen_config.do_sample = false;
+        gen_config.max_new_tokens = 16;
+        std::vector<std::string> prompts{"你好", "晚上睡不着应该怎么办", "你是谁", "1+1="};
+
+        std::unique_ptr<Pipeline> replica = pipeline.replicate();
+        std::vector<std::string> outputs = replica->generate_batch(prompts, gen_config, 2);
+        ASSERT_EQ(outputs.size(), prompts.size());
+        for (size_t i = 0; i < prompts.size(); i++) {
+            EXPECT_EQ(outputs[i], pipeline.generate(prompts[i], gen_config));
+        }
+        EXPECT_EQ(replica->model->kv_allocator.num_free_blocks(), replica->model->kv_allocator.num_blocks() -
+                                                                      replica->model->prefix_cache.num_cached_blocks());
+    }
+
+    // batched generation: a prompt close to max_length joining decoding sequences is prefilled in chunks that keep
+    // each step within max_length tokens
+    {
+        const int max_length = pipeline.model->config.max_length;
+        GenerationConfig gen_config;
+        gen_config.do_sample = false;
+        gen_config.max_length = max_length;
+        gen_config.max_context_length = max_length - 8;
+        gen_config.max_new_tokens = 4;
+        std::ostringstream oss;
+        for (int i = 0; i < max_length; i++) {
+            oss << "你好";
+        }
+        std::vector<std::string> prompts{"你好", "你是谁", "1+1=", oss.str()};
+
+        std::unique_ptr<Pipeline> replica = pipeline.replicate(2 * max_length);
+        std::vector<std::string> outputs = replica->generate_batch(prompts, gen_config, prompts.size());
+        ASSERT_EQ(outputs.size(), prompts.size());
+        for (size_t i = 0; i < prompts.size(); i++) {
+            EXPECT_EQ(outputs[i], pipeline.generate(prompts[i], gen_config));
+        }
+    }
+
+    // n-best decoding: greedy samples sharing the prompt blocks match the single greedy output, and beam search
+    // returns distinct beams, best first
+    {
+        GenerationConfig gen_config;
+        gen_config.do_sample = false;
+        gen_config.max_new_tokens = 16;
+        gen_config.num_return_sequences = 3;
+        const std::string prompt = "晚上睡不着应该怎么办";
+
+        std::unique_ptr<Pipeline> replica = pipeline.replicate();
+        std::vector<std::string> outputs = replica->generate_sequences(prompt, gen_config);
+        ASSERT_EQ(outputs.size(), 3u);
+        for (const auto &output : outputs) {
+            EXPECT_EQ(output, pipeline.generate(prompt, gen_config));
+        }
+
+        gen_config.num_beams = 4;
+        gen_config.num_return_sequences = 2;
+        outputs = replica->generate_sequences(prompt, gen_config);
+        ASSERT_EQ(outputs.size(), 2u);
+        EXPECT_NE(outputs[0], outputs[1]);
+        EXPECT_EQ(replica->generate(prompt, gen_config), outputs[0]);
+        EXPECT_EQ(replica->model->kv_allocator.num_free_blocks(), replica->model->kv_allocator.num_blocks() -
+                                                                      replica->model->prefix_cache.num_cached_blocks());
+    }
+
+    // embedding: a batch pools the same hidden states as each input alone
+    {
+        std::vector<std::string> texts{"你好", "晚上睡不着应该怎么办"};
+        for (PoolingType pooling : {PoolingType::MEAN, PoolingType::LAST}) {
+            std::vector<std::vector<float>> batched = pipeline.embed(texts, pooling);
+            ASSERT_EQ(batched.size(), texts.size());
+            for (size_t i = 0; i < texts.size(); i++) {
+                std::vector<float> single = pipeline.embed({texts[i]}, pooling).front();
+                ASSERT_EQ(batched[i].size(), (size_t)pipeline.model->config.hidden_size);
+                for (size_t j = 0; j < single.size(); j++) {
+                    EXPECT_NEAR(batched[i][j], single[j], 1e-3);
+                }
+            }
+        }
+
+        // many 1-token inputs span several graphs, each within its node budget
+        const int num_inputs = 4 * pipeline.model->max_graph_seqs() + 1;
+        std::vector<std::vector<int>> inputs;
+        for (int i = 0; i < num_inputs; i++) {
+            inputs.push_back({100 + i});
+        }
+        std::vector<std::vector<float>> batched = pipeline.model->embed(inputs, PoolingType::MEAN, 1);
+        ASSERT_EQ(batched.size(), inputs.size());
+        for (int i : {0, num_inputs / 2, num_inputs - 1}) {
+            std::vector<float> single = pipeline.model->embed({inputs[i]}, PoolingType::MEAN, 1).front();
+            for (size_t j = 0; j < single.size(); j++) {
+                EXPECT_NEAR(batched[i][j], single[j], 1e-3);
+            }
+        }
+        EXPECT_EQ(pipeline.model->kv_allocator.num_free_blocks(), pipeline.model->kv_allocator.num_blocks() -
+                                                                      pipeline.model->prefix_cache.num_cached_blocks());
+    }
 }
 
 static inline std::string read_text(const fs::path &path) {
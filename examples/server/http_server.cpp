@@ -0,0 +1,452 @@
+#include "http_server.h"
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+static constexpr uint64_t LISTEN_ID = 0;
+static constexpr uint64_t WAKE_ID = 1;
+
+static constexpr size_t MAX_HEADER_SIZE = 64 * 1024;
+static constexpr size_t MAX_BODY_SIZE = 64 * 1024 * 1024;
+
+static const char *status_text(int status) {
+    switch (status) {
+    case 200: return "OK";
+    case 400: return "Bad Request";
+    case 404: return "Not Found";
+    case 413: return "Payload Too Large";
+    case 429: return "Too Many Requests";
+    case 500: return "Internal Server Error";
+    case 503: return "Service Unavailable";
+    default: return "";
+    }
+}
+
+static string lower(string s) {
+    transform(s.begin(), s.end(), s.begin(), [](unsigned char c) { return tolower(c); });
+    return s;
+}
+
+static string trim(const string &s) {
+    size_t begin = s.find_first_not_of(" \t");
+    size_t end = s.find_last_not_of(" \t\r");
+    return begin == string::npos ? string() : s.substr(begin, end - begin + 1);
+}
+
+void HttpExchange::respond(int status, string body, const string &content_type) {
+    _server->post(_conn_id, [this_server = _server, id = _conn_id, status, body = std::move(body),
+                             content_type](HttpServer::Connection &conn) {
+        conn.out += "HTTP/1.1 " + to_string(status) + " " + status_text(status) + "\r\n";
+        conn.out += "Content-Type: " + content_type + "\r\n";
+        conn.out += "Content-Length: " + to_string(body.size()) + "\r\n";
+        conn.out += conn.keep_alive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+        conn.out += body;
+        this_server->end_response(id, conn, status);
+    });
+}
+
+void HttpExchange::start_stream(const string &content_type) {
+    _server->post(_conn_id, [content_type](HttpServer::Connection &conn) {
+        conn.out += "HTTP/1.1 200 OK\r\n";
+        conn.out += "Content-Type: " + content_type + "\r\n";
+        conn.out += "Cache-Control: no-cache\r\n";
+        conn.out += "Transfer-Encoding: chunked\r\n";
+        conn.out += conn.keep_alive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+        conn.streaming = true;
+    });
+}
+
+void HttpExchange::send(string data) {
+    if (data.empty()) {
+        return; // an empty chunk would end the response
+    }
+    _server->post(_conn_id, [data = std::move(data)](HttpServer::Connection &conn) {
+        char size[32];
+        snprintf(size, sizeof(size), "%zx\r\n", data.size());
+        conn.out += size;
+        conn.out += data;
+        conn.out += "\r\n";
+    });
+}
+
+void HttpExchange::finish() {
+    _server->post(_conn_id, [this_server = _server, id = _conn_id](HttpServer::Connection &conn) {
+        conn.out += "0\r\n\r\n";
+        conn.streaming = false;
+        this_server->end_response(id, conn, 200);
+    });
+}
+
+void HttpExchange::relay(shared_ptr<ServerTaskChannel> channel, function<bool(const json &result)> on_result) {
+    HttpServer *server = _server;
+    const uint64_t id = _conn_id;
+    server->post(
+        id,
+        [server, id, channel, on_result = std::move(on_result)](HttpServer::Connection &conn) {
+            conn.channel = channel;
+            conn.on_result = on_result;
+            // results already there are delivered right away
+            channel->set_notify([server, id] {
+                server->post(id, [server, id](HttpServer::Connection &conn) { server->drain_channel(id, conn); });
+            });
+        },
+        [channel] { channel->cancel(); });
+}
+
+HttpServer::HttpServer(int num_handler_threads, bool verbose) : _handler_pool(num_handler_threads), _verbose(verbose) {
+    _epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    _wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (_epoll_fd < 0 || _wake_fd < 0) {
+        throw runtime_error(string("cannot create event loop: ") + strerror(errno));
+    }
+    epoll_event event{};
+    event.events = EPOLLIN;
+    event.data.u64 = WAKE_ID;
+    epoll_ctl(_epoll_fd, EPOLL_CTL_ADD, _wake_fd, &event);
+}
+
+HttpServer::~HttpServer() {
+    for (auto &item : _conns) {
+        close(item.second.fd);
+    }
+    if (_listen_fd >= 0) close(_listen_fd);
+    close(_wake_fd);
+    close(_epoll_fd);
+}
+
+bool HttpServer::bind_to_port(const string &host, int port) {
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    addrinfo *result = nullptr;
+    if (getaddrinfo(host.empty() ? nullptr : host.c_str(), to_string(port).c_str(), &hints, &result) != 0) {
+        return false;
+    }
+    for (addrinfo *ai = result; ai; ai = ai->ai_next) {
+        int fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd < 0) {
+            continue;
+        }
+        int yes = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+        if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, SOMAXCONN) == 0) {
+            _listen_fd = fd;
+            break;
+        }
+        close(fd);
+    }
+    freeaddrinfo(result);
+    if (_listen_fd < 0) {
+        return false;
+    }
+    epoll_event event{};
+    event.events = EPOLLIN;
+    event.data.u64 = LISTEN_ID;
+    return epoll_ctl(_epoll_fd, EPOLL_CTL_ADD, _listen_fd, &event) == 0;
+}
+
+void HttpServer::listen_after_bind() {
+    vector<epoll_event> events(256);
+    while (true) {
+        int n = epoll_wait(_epoll_fd, events.data(), events.size(), -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            throw runtime_error(string("epoll_wait failed: ") + strerror(errno));
+        }
+        for (int i = 0; i < n; i++) {
+            const uint64_t id = events[i].data.u64;
+            if (id == LISTEN_ID) {
+                accept_connections();
+                continue;
+            }
+            if (id == WAKE_ID) {
+                uint64_t count;
+                while (read(_wake_fd, &count, sizeof(count)) > 0) {
+                }
+                continue;
+            }
+            auto it = _conns.find(id);
+            if (it == _conns.end()) {
+                continue;
+            }
+            if (events[i].events & (EPOLLHUP | EPOLLERR)) {
+                close_connection(id);
+                continue;
+            }
+            if (events[i].events & EPOLLIN) {
+                read_connection(id, it->second);
+            }
+            it = _conns.find(id);
+            if (it != _conns.end() && (events[i].events & EPOLLOUT)) {
+                write_connection(id, it->second);
+            }
+        }
+        run_posts();
+    }
+}
+
+void HttpServer::post(uint64_t conn_id, function<void(Connection &conn)> fn, function<void()> on_gone) {
+    _posts.push({conn_id, std::move(fn), std::move(on_gone)});
+    const uint64_t one = 1;
+    ssize_t written = write(_wake_fd, &one, sizeof(one));
+    (void)written; // only fails when the counter is about to overflow, and then the loop is awake anyway
+}
+
+void HttpServer::run_posts() {
+    // callbacks may post more, they run in this round too
+    vector<uint64_t> touched;
+    while (optional<LoopCall> p = _posts.try_pop()) {
+        auto it = _conns.find(p->conn_id);
+        if (it == _conns.end()) {
+            if (p->on_gone) p->on_gone();
+            continue;
+        }
+        p->fn(it->second);
+        touched.push_back(p->conn_id);
+    }
+    sort(touched.begin(), touched.end());
+    touched.erase(unique(touched.begin(), touched.end()), touched.end());
+    for (uint64_t id : touched) {
+        auto it = _conns.find(id);
+        if (it != _conns.end()) {
+            write_connection(id, it->second);
+        }
+    }
+}
+
+void HttpServer::accept_connections() {
+    while (true) {
+        int fd = accept4(_listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            return; // EAGAIN, or out of descriptors until some connection closes
+        }
+        int yes = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+
+        const uint64_t id = _next_conn_id++;
+        Connection &conn = _conns[id];
+        conn.fd = fd;
+        epoll_event event{};
+        event.events = EPOLLIN | EPOLLRDHUP;
+        event.data.u64 = id;
+        epoll_ctl(_epoll_fd, EPOLL_CTL_ADD, fd, &event);
+    }
+}
+
+void HttpServer::read_connection(uint64_t conn_id, Connection &conn) {
+    char buf[16384];
+    while (true) {
+        ssize_t n = recv(conn.fd, buf, sizeof(buf), 0);
+        if (n > 0) {
+            conn.in.append(buf, n);
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        // the client is gone, cancel what it was waiting for
+        close_connection(conn_id);
+        return;
+    }
+    if (conn.in.size() > MAX_HEADER_SIZE + MAX_BODY_SIZE) {
+        close_connection(conn_id);
+        return;
+    }
+    handle_next(conn_id, conn);
+}
+
+void HttpServer::write_connection(uint64_t conn_id, Connection &conn) {
+    while (!conn.out.empty()) {
+        ssize_t n = ::send(conn.fd, conn.out.data(), conn.out.size(), MSG_NOSIGNAL);
+        if (n > 0) {
+            conn.out.erase(0, n);
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        close_connection(conn_id);
+        return;
+    }
+    if (conn.out.empty() && !conn.busy && !conn.keep_alive) {
+        close_connection(conn_id);
+        return;
+    }
+    update_events(conn_id, conn);
+}
+
+void HttpServer::update_events(uint64_t conn_id, Connection &conn) {
+    const bool want_write = !conn.out.empty();
+    if (want_write == conn.want_write) {
+        return;
+    }
+    conn.want_write = want_write;
+    epoll_event event{};
+    event.events = EPOLLIN | EPOLLRDHUP | (want_write ? EPOLLOUT : 0);
+    event.data.u64 = conn_id;
+    epoll_ctl(_epoll_fd, EPOLL_CTL_MOD, conn.fd, &event);
+}
+
+void HttpServer::close_connection(uint64_t conn_id) {
+    auto it = _conns.find(conn_id);
+    if (it == _conns.end()) {
+        return;
+    }
+    Connection &conn = it->second;
+    if (conn.channel) {
+        conn.channel->set_notify(nullptr);
+        conn.channel->cancel();
+    }
+    epoll_ctl(_epoll_fd, EPOLL_CTL_DEL, conn.fd, nullptr);
+    close(conn.fd);
+    _conns.erase(it);
+}
+
+void HttpServer::handle_next(uint64_t conn_id, Connection &conn) {
+    if (conn.busy || !conn.keep_alive) {
+        return;
+    }
+    const size_t header_end = conn.in.find("\r\n\r\n");
+    if (header_end == string::npos) {
+        if (conn.in.size() > MAX_HEADER_SIZE) {
+            conn.keep_alive = false;
+            respond_error(conn, 413, "request header too large");
+            write_connection(conn_id, conn);
+        }
+        return;
+    }
+
+    HttpRequest req;
+    size_t line_end = conn.in.find("\r\n");
+    {
+        const string line = conn.in.substr(0, line_end);
+        const size_t sp1 = line.find(' ');
+        const size_t sp2 = line.rfind(' ');
+        if (sp1 == string::npos || sp2 == sp1) {
+            conn.keep_alive = false;
+            respond_error(conn, 400, "malformed request line");
+            write_connection(conn_id, conn);
+            return;
+        }
+        req.method = line.substr(0, sp1);
+        req.path = line.substr(sp1 + 1, sp2 - sp1 - 1);
+        req.version = line.substr(sp2 + 1);
+        req.path = req.path.substr(0, req.path.find('?'));
+    }
+    while (line_end < header_end) {
+        const size_t next = conn.in.find("\r\n", line_end + 2);
+        const string line = conn.in.substr(line_end + 2, next - line_end - 2);
+        const size_t colon = line.find(':');
+        if (colon != string::npos) {
+            req.headers[lower(line.substr(0, colon))] = trim(line.substr(colon + 1));
+        }
+        line_end = next;
+    }
+
+    if (!req.header("transfer-encoding").empty()) {
+        conn.keep_alive = false;
+        respond_error(conn, 400, "chunked request bodies are not supported");
+        write_connection(conn_id, conn);
+        return;
+    }
+    const size_t body_size = strtoull(req.header("content-length").c_str(), nullptr, 10);
+    if (body_size > MAX_BODY_SIZE) {
+        conn.keep_alive = false;
+        respond_error(conn, 413, "request body too large");
+        write_connection(conn_id, conn);
+        return;
+    }
+    if (conn.in.size() < header_end + 4 + body_size) {
+        // the client waits for this before sending the body, once
+        if (lower(req.header("expect")) == "100-continue" && conn.in.size() == header_end + 4) {
+            conn.out += "HTTP/1.1 100 Continue\r\n\r\n";
+            write_connection(conn_id, conn);
+        }
+        return;
+    }
+    req.body = conn.in.substr(header_end + 4, body_size);
+    conn.in.erase(0, header_end + 4 + body_size);
+
+    const string connection = lower(req.header("connection"));
+    conn.keep_alive = req.version == "HTTP/1.0" ? connection == "keep-alive" : connection != "close";
+    conn.method = req.method;
+    conn.path = req.path;
+    conn.busy = true;
+    if (_verbose) {
+        cout << req.method << " " << req.path << " " << req.body << endl;
+    }
+
+    auto handler = _handlers.find({req.method, req.path});
+    if (handler == _handlers.end()) {
+        respond_error(conn, 404, "no route for " + req.method + " " + req.path);
+        end_response(conn_id, conn, 404);
+        return;
+    }
+    auto exchange = make_shared<HttpExchange>(this, conn_id, std::move(req));
+    _handler_pool.run([handler = handler->second, exchange] {
+        try {
+            handler(exchange);
+        } catch (const json::parse_error &e) {
+            exchange->respond(400, json{{"error", e.what()}}.dump(), "application/json");
+        } catch (const exception &e) {
+            exchange->respond(500, json{{"error", e.what()}}.dump(), "application/json");
+        }
+    });
+}
+
+void HttpServer::respond_error(Connection &conn, int status, const string &message) {
+    const string body = json{{"error", message}}.dump();
+    conn.out += "HTTP/1.1 " + to_string(status) + " " + status_text(status) + "\r\n";
+    conn.out += "Content-Type: application/json\r\n";
+    conn.out += "Content-Length: " + to_string(body.size()) + "\r\n";
+    conn.out += conn.keep_alive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+    conn.out += body;
+}
+
+void HttpServer::end_response(uint64_t conn_id, Connection &conn, int status) {
+    if (_verbose) {
+        cout << conn.method << " " << conn.path << " " << status << endl;
+    }
+    if (conn.channel) {
+        conn.channel->set_notify(nullptr);
+        conn.channel.reset();
+    }
+    conn.on_result = nullptr;
+    conn.busy = false;
+    // a pipelined request may be waiting already
+    handle_next(conn_id, conn);
+}
+
+void HttpServer::drain_channel(uint64_t conn_id, Connection &conn) {
+    while (conn.channel) {
+        optional<json> result = conn.channel->try_pop();
+        if (!result) {
+            return;
+        }
+        bool more;
+        try {
+            more = conn.on_result(*result);
+        } catch (const exception &e) {
+            cout << conn.method << " " << conn.path << " failed: " << e.what() << endl;
+            close_connection(conn_id);
+            return;
+        }
+        if (!more) {
+            // the response is complete once the callbacks it posted have run
+            conn.channel->set_notify(nullptr);
+            conn.channel.reset();
+            conn.on_result = nullptr;
+        }
+    }
+}
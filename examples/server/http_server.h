@@ -0,0 +1,131 @@
+#ifndef _HTTP_SERVER_H
+#define _HTTP_SERVER_H
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+#include "utils.h"
+
+using namespace std;
+
+struct HttpRequest {
+    string method;
+    string path; // without the query string
+    string version;
+    map<string, string> headers; // names in lower case
+    string body;
+
+    string header(const string &name) const {
+        auto it = headers.find(name);
+        return it == headers.end() ? string() : it->second;
+    }
+};
+
+class HttpServer;
+
+// The response side of a request, held by its handler and by the callbacks relaying its task. It may be used from any
+// thread: everything is handed to the event loop, which drops it once the client is gone.
+class HttpExchange {
+    HttpServer *_server;
+    uint64_t _conn_id;
+
+    public:
+        const HttpRequest request;
+
+        HttpExchange(HttpServer *server, uint64_t conn_id, HttpRequest request) :
+                     _server(server), _conn_id(conn_id), request(std::move(request)) {
+        }
+
+        // a whole response
+        void respond(int status, string body, const string &content_type);
+
+        // a response streamed in chunks: start it, send any number of chunks, then finish it
+        void start_stream(const string &content_type);
+        void send(string data);
+        void finish();
+
+        // Call on_result on the event loop thread for every result of channel as it arrives, until it returns false.
+        // When the client goes away first, the task is cancelled.
+        void relay(shared_ptr<ServerTaskChannel> channel, function<bool(const json &result)> on_result);
+};
+
+using HttpHandler = function<void(shared_ptr<HttpExchange> exchange)>;
+
+// HTTP/1.1 server on a single epoll event loop. A connection is a small state machine on that loop, so idle and
+// streaming clients cost a socket and a few buffers rather than a thread. Handlers run on a few threads of their own,
+// as they may tokenize or load a model, but they never wait for generation: they relay the task channel, whose
+// results wake up the loop.
+class HttpServer {
+    struct Connection {
+        int fd;
+        string in;  // received, not handled yet
+        string out; // to send
+        bool keep_alive = true;
+        bool busy = false;      // a request is being handled, the next one waits in the input
+        bool streaming = false; // a chunked response is in progress
+        bool want_write = false;
+
+        string method;
+        string path;
+
+        shared_ptr<ServerTaskChannel> channel;
+        function<bool(const json &result)> on_result;
+    };
+
+    // a callback for the loop thread, for a connection that may be gone by then
+    struct LoopCall {
+        uint64_t conn_id;
+        function<void(Connection &conn)> fn;
+        function<void()> on_gone;
+    };
+
+    int _listen_fd = -1;
+    int _epoll_fd = -1;
+    int _wake_fd = -1;
+
+    unordered_map<uint64_t, Connection> _conns; // owned by the loop thread
+    uint64_t _next_conn_id = 2;                 // 0 and 1 tag the listening socket and the wake up event
+    MPSCQueue<LoopCall> _posts;
+
+    map<pair<string, string>, HttpHandler> _handlers;
+    ThreadPool _handler_pool;
+    bool _verbose; // log requests and their status
+
+    public:
+        HttpServer(int num_handler_threads, bool verbose);
+        ~HttpServer();
+
+        HttpServer(const HttpServer &) = delete;
+        HttpServer &operator=(const HttpServer &) = delete;
+
+        void Get(const string &path, HttpHandler handler) { _handlers[{"GET", path}] = std::move(handler); }
+        void Post(const string &path, HttpHandler handler) { _handlers[{"POST", path}] = std::move(handler); }
+
+        bool bind_to_port(const string &host, int port);
+        // serve until the process ends
+        void listen_after_bind();
+
+    private:
+        friend class HttpExchange;
+
+        // run fn on the loop thread, or on_gone there if the connection is closed by then
+        void post(uint64_t conn_id, function<void(Connection &conn)> fn, function<void()> on_gone = nullptr);
+
+        void accept_connections();
+        void read_connection(uint64_t conn_id, Connection &conn);
+        void write_connection(uint64_t conn_id, Connection &conn);
+        void close_connection(uint64_t conn_id);
+        void run_posts();
+
+        // start handling the request at the front of the input if it is complete
+        void handle_next(uint64_t conn_id, Connection &conn);
+        void respond_error(Connection &conn, int status, const string &message);
+        void end_response(uint64_t conn_id, Connection &conn, int status);
+        void drain_channel(uint64_t conn_id, Connection &conn);
+        void update_events(uint64_t conn_id, Connection &conn);
+};
+
+#endif
@@ -0,0 +1,103 @@
+#include "metrics.h"
+
+#include <algorithm>
+
+Histogram::Histogram(vector<double> bounds) :
+                     _bounds(std::move(bounds)), _counts(new atomic<uint64_t>[_bounds.size() + 1]) {
+    for (size_t i = 0; i <= _bounds.size(); i++) {
+        _counts[i] = 0;
+    }
+}
+
+void Histogram::observe(double value) {
+    size_t bucket = lower_bound(_bounds.begin(), _bounds.end(), value) - _bounds.begin();
+    _counts[bucket].fetch_add(1, memory_order_relaxed);
+    atomic_add(_sum, value);
+}
+
+void Histogram::render(ostream &os, const string &name, const string &labels) const {
+    uint64_t count = 0;
+    for (size_t i = 0; i < _bounds.size(); i++) {
+        count += _counts[i].load(memory_order_relaxed);
+        os << name << "_bucket{" << labels << ",le=\"" << _bounds[i] << "\"} " << count << "\n";
+    }
+    count += _counts[_bounds.size()].load(memory_order_relaxed);
+    os << name << "_bucket{" << labels << ",le=\"+Inf\"} " << count << "\n";
+    os << name << "_sum{" << labels << "} " << _sum.load(memory_order_relaxed) << "\n";
+    os << name << "_count{" << labels << "} " << count << "\n";
+}
+
+static string model_label(const string &model) {
+    string label = "model=\"";
+    for (char c : model) {
+        if (c == '\\' || c == '"') label += '\\';
+        label += c;
+    }
+    return label + "\"";
+}
+
+void render_metrics(ostream &os, const vector<ServerMetricsSource> &sources) {
+    auto header = [&os](const char *name, const char *type, const char *help) {
+        os << "# HELP " << name << " " << help << "\n";
+        os << "# TYPE " << name << " " << type << "\n";
+    };
+    auto histogram = [&](const char *name, const char *help, const Histogram ServerMetrics::*member) {
+        header(name, "histogram", help);
+        for (const auto &source : sources) {
+            (source.metrics->*member).render(os, name, model_label(source.model));
+        }
+    };
+    auto value = [&](const char *name, const char *type, const char *help, auto get) {
+        header(name, type, help);
+        for (const auto &source : sources) {
+            os << name << "{" << model_label(source.model) << "} " << get(source) << "\n";
+        }
+    };
+
+    histogram("chatglm_time_to_first_token_seconds", "Time from submission to the first output token.",
+              &ServerMetrics::time_to_first_token);
+    histogram("chatglm_time_per_output_token_seconds", "Average time between output tokens of a request.",
+              &ServerMetrics::time_per_output_token);
+    histogram("chatglm_queue_wait_seconds", "Time from submission to joining the running batch.",
+              &ServerMetrics::queue_wait);
+
+    value("chatglm_requests_total", "counter", "Requests submitted.",
+          [](const ServerMetricsSource &s) { return s.metrics->requests.load(); });
+    value("chatglm_requests_rejected_total", "counter", "Requests rejected by admission control.",
+          [](const ServerMetricsSource &s) { return s.metrics->requests_rejected.load(); });
+    value("chatglm_requests_cancelled_total", "counter", "Requests cancelled by their clients.",
+          [](const ServerMetricsSource &s) { return s.metrics->requests_cancelled.load(); });
+    value("chatglm_requests_failed_total", "counter", "Requests failed with an error.",
+          [](const ServerMetricsSource &s) { return s.metrics->requests_failed.load(); });
+
+    value("chatglm_prefill_tokens_total", "counter", "Prompt tokens prefilled.",
+          [](const ServerMetricsSource &s) { return s.metrics->prefill_tokens.load(); });
+    value("chatglm_decode_tokens_total", "counter", "Tokens decoded.",
+          [](const ServerMetricsSource &s) { return s.metrics->decode_tokens.load(); });
+    value("chatglm_prefill_seconds_total", "counter", "Time spent in steps that prefill prompts.",
+          [](const ServerMetricsSource &s) { return s.metrics->prefill_seconds.load(); });
+    value("chatglm_decode_seconds_total", "counter", "Time spent in steps that only decode.",
+          [](const ServerMetricsSource &s) { return s.metrics->decode_seconds.load(); });
+
+    value("chatglm_queue_depth", "gauge", "Requests waiting to join the running batch.",
+          [](const ServerMetricsSource &s) { return s.queue_depth; });
+    value("chatglm_running_requests", "gauge", "Requests in the running batches.",
+          [](const ServerMetricsSource &s) { return s.metrics->running.load(); });
+    value("chatglm_kv_cache_tokens_in_use", "gauge", "Kv cache taken by requests and the prefix cache, in tokens.",
+          [](const ServerMetricsSource &s) { return s.memory.kv_tokens_in_use; });
+
+    const pair<const char *, size_t chatglm::MemoryUsage::*> memory[] = {
+        {"weights", &chatglm::MemoryUsage::weights},
+        {"kv_cache", &chatglm::MemoryUsage::kv_cache},
+        {"compute_buffer", &chatglm::MemoryUsage::compute_buffer},
+        {"scratch_buffer", &chatglm::MemoryUsage::scratch_buffer},
+        {"work_buffer", &chatglm::MemoryUsage::work_buffer},
+    };
+    header("chatglm_memory_bytes", "gauge", "Memory held by a model.");
+    for (const auto &source : sources) {
+        for (const auto &item : memory) {
+            os << "chatglm_memory_bytes{" << model_label(source.model) << ",kind=\"" << item.first << "\"} "
+               << source.memory.*item.second << "\n";
+        }
+    }
+}
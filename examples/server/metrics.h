@@ -0,0 +1,68 @@
+#ifndef _METRICS_H
+#define _METRICS_H
+
+#include <atomic>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "../../chatglm.h"
+
+using namespace std;
+
+// Histogram over fixed buckets. Observing only does atomic adds, so the scheduler never waits for a scrape.
+class Histogram {
+    vector<double> _bounds;                 // upper bounds of the buckets, +Inf is implied
+    unique_ptr<atomic<uint64_t>[]> _counts; // per bucket, not cumulative
+    atomic<double> _sum{0};
+
+    public:
+        Histogram(vector<double> bounds);
+
+        void observe(double value);
+
+        // prometheus text lines of the histogram series with the given labels
+        void render(ostream &os, const string &name, const string &labels) const;
+};
+
+// add to an atomic double, which has no fetch_add before C++20
+inline void atomic_add(atomic<double> &value, double delta) {
+    double old = value.load(memory_order_relaxed);
+    while (!value.compare_exchange_weak(old, old + delta, memory_order_relaxed)) {
+    }
+}
+
+// Serving metrics of a model.
+struct ServerMetrics {
+    Histogram time_to_first_token{{0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30, 60}};
+    Histogram time_per_output_token{{0.005, 0.01, 0.02, 0.04, 0.06, 0.08, 0.1, 0.15, 0.2, 0.3, 0.5, 1}};
+    Histogram queue_wait{{0.001, 0.01, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30, 60}};
+
+    atomic<uint64_t> requests{0};           // submitted
+    atomic<uint64_t> requests_rejected{0};  // by admission control
+    atomic<uint64_t> requests_cancelled{0};
+    atomic<uint64_t> requests_failed{0};
+
+    // Steps that prefill any prompt count as prefill with all their tokens, the others as decode. Tokens per second
+    // of either is the rate of its tokens over the rate of its seconds.
+    atomic<uint64_t> prefill_tokens{0};
+    atomic<uint64_t> decode_tokens{0};
+    atomic<double> prefill_seconds{0};
+    atomic<double> decode_seconds{0};
+
+    atomic<int> running{0}; // requests in the running batches of all workers
+};
+
+// the metrics of one model as scraped
+struct ServerMetricsSource {
+    string model;
+    const ServerMetrics *metrics;
+    int queue_depth;
+    chatglm::MemoryUsage memory;
+};
+
+// render the metrics of all models in the prometheus text format
+void render_metrics(ostream &os, const vector<ServerMetricsSource> &sources);
+
+#endif
@@ -0,0 +1,278 @@
+#include "model_registry.h"
+
+#include <algorithm>
+#include <filesystem>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#endif
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+// Pin the calling thread to its share of the cores. The threads ggml starts for its graphs inherit the affinity,
+// so replicas do not compete for cores.
+static void pin_to_core_group(int index, int count) {
+#ifdef __linux__
+    const int num_cpus = thread::hardware_concurrency();
+    if (count <= 1 || num_cpus < count) {
+        return;
+    }
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    for (int cpu = num_cpus * index / count; cpu < num_cpus * (index + 1) / count; cpu++) {
+        CPU_SET(cpu, &cpus);
+    }
+    pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+#endif
+}
+
+ServerModel::Worker::Worker(unique_ptr<chatglm::Pipeline> pl, const chatglm::GenerationConfig &gen_config,
+                            const ServerModelOptions &options, ServerMetrics &metrics) :
+                            pl(std::move(pl)), request_task_queue(options.max_queue_size, options.max_queue_tokens),
+                            scheduler(*this->pl, gen_config, options.max_batch_size, options.max_queue_time,
+                                      request_task_queue, metrics) {
+}
+
+ServerModel::ServerModel(const string &name, const string &path, const string &draft_path,
+                         const ServerModelOptions &options) :
+                         _name(name) {
+    const int num_workers = max(options.num_workers, 1);
+    chatglm::GenerationConfig gen_config = options.gen_config;
+    if (gen_config.num_threads <= 0) {
+        // split the cores between the workers instead of each one taking all of them
+        gen_config.num_threads = max(chatglm::get_default_num_threads() / num_workers, 1);
+    }
+
+    auto pl = make_unique<chatglm::Pipeline>(path, options.kv_cache_size);
+#if defined(__unix__) || defined(__APPLE__)
+    // read the weights ahead instead of faulting them in during the first requests
+    madvise(pl->mapped_file->data, pl->mapped_file->size, MADV_WILLNEED);
+#endif
+    if (!draft_path.empty()) {
+        // it only decodes one request at a time, so its kv cache holds max_length tokens
+        pl->load_draft_model(draft_path);
+    }
+    for (int i = 0; i < num_workers; i++) {
+        auto replica = i + 1 < num_workers ? pl->replicate(options.kv_cache_size) : std::move(pl);
+        _workers.emplace_back(make_unique<Worker>(std::move(replica), gen_config, options, _metrics));
+    }
+    for (int i = 0; i < num_workers; i++) {
+        Worker *worker = _workers[i].get();
+        worker->runner = thread([worker, i, num_workers, name] {
+            chatglm::Tracer::set_thread_name(name + " worker " + to_string(i));
+            pin_to_core_group(i, num_workers);
+            worker->scheduler.run();
+        });
+    }
+}
+
+ServerModel::~ServerModel() {
+    for (auto &worker : _workers) {
+        worker->request_task_queue.close();
+    }
+    for (auto &worker : _workers) {
+        worker->runner.join();
+    }
+}
+
+chatglm::MemoryUsage ServerModel::memory_usage() const {
+    chatglm::MemoryUsage usage = _workers.front()->scheduler.memory_usage();
+    for (size_t i = 1; i < _workers.size(); i++) {
+        chatglm::MemoryUsage replica = _workers[i]->scheduler.memory_usage();
+        usage.kv_cache += replica.kv_cache;
+        usage.compute_buffer += replica.compute_buffer;
+        usage.scratch_buffer += replica.scratch_buffer;
+        usage.work_buffer += replica.work_buffer;
+        usage.kv_tokens_in_use += replica.kv_tokens_in_use;
+    }
+    return usage;
+}
+
+int ServerModel::queue_depth() const {
+    int depth = 0;
+    for (const auto &worker : _workers) {
+        depth += worker->request_task_queue.size();
+    }
+    return depth;
+}
+
+shared_ptr<ServerTaskChannel> ServerModel::submit(json data, ServerTask::TaskType type) {
+    Worker *target = nullptr;
+    int min_load = 0;
+    for (const auto &worker : _workers) {
+        const int load = worker->request_task_queue.size() + worker->scheduler.num_running();
+        if (!target || load < min_load) {
+            target = worker.get();
+            min_load = load;
+        }
+    }
+    return target->scheduler.submit(std::move(data), type);
+}
+
+ModelRegistry::ModelRegistry(const ServerModelOptions &options, size_t memory_budget) :
+                             _options(options), _memory_budget(memory_budget) {
+}
+
+void ModelRegistry::add(const string &name, const string &path) {
+    lock_guard lk(_m);
+    Entry &entry = _entries[name];
+    entry.path = path;
+    entry.registered = true;
+    if (_default_name.empty()) {
+        _default_name = name;
+    }
+}
+
+shared_ptr<ServerModel> ModelRegistry::get(const string &name) {
+    vector<shared_ptr<ServerModel>> unloaded; // destroyed after the lock is released
+    unique_lock lk(_m);
+    return get_locked(lk, name.empty() ? _default_name : name, unloaded);
+}
+
+shared_ptr<ServerModel> ModelRegistry::load(const string &name_or_path, const string &draft_path) {
+    vector<shared_ptr<ServerModel>> unloaded; // destroyed after the lock is released
+    unique_lock lk(_m);
+    string name = name_or_path;
+    if (_entries.find(name) == _entries.end()) {
+        // not registered yet, serve the file under its path
+        _entries[name].path = name_or_path;
+    }
+    Entry &entry = _entries[name];
+    if (entry.draft_path != draft_path) {
+        entry.draft_path = draft_path;
+        unloaded.emplace_back(std::move(entry.model));
+    }
+    shared_ptr<ServerModel> model = get_locked(lk, name, unloaded);
+    _default_name = name;
+    return model;
+}
+
+string ModelRegistry::default_name() {
+    lock_guard lk(_m);
+    return _default_name;
+}
+
+vector<shared_ptr<ServerModel>> ModelRegistry::loaded_models() {
+    lock_guard lk(_m);
+    vector<shared_ptr<ServerModel>> models;
+    for (const auto &item : _entries) {
+        if (item.second.model) {
+            models.emplace_back(item.second.model);
+        }
+    }
+    return models;
+}
+
+void ModelRegistry::scrape_metrics(ostream &os) {
+    vector<shared_ptr<ServerModel>> models = loaded_models();
+    vector<ServerMetricsSource> sources;
+    for (const auto &model : models) {
+        sources.push_back({model->name(), &model->metrics(), model->queue_depth(), model->memory_usage()});
+    }
+    render_metrics(os, sources);
+}
+
+shared_ptr<ServerModel> ModelRegistry::get_locked(unique_lock<mutex> &lk, const string &name,
+                                                  vector<shared_ptr<ServerModel>> &unloaded) {
+    for (;;) {
+        auto it = _entries.find(name);
+        if (it == _entries.end()) {
+            throw out_of_range("model " + name + " not found");
+        }
+        Entry &entry = it->second;
+        entry.last_used = ++_clock;
+        if (entry.model) {
+            return entry.model;
+        }
+        if (!entry.loading) {
+            break;
+        }
+        // another request is loading it
+        _loaded.wait(lk);
+    }
+
+    // entries are only erased by the request loading them, so this one stays valid while the lock is released
+    Entry &entry = _entries.at(name);
+    const string path = entry.path;
+    const string draft_path = entry.draft_path;
+    entry.loading = true;
+    shared_ptr<ServerModel> model;
+    exception_ptr error;
+    try {
+        if (_memory_budget > 0) {
+            // make room for the weights before mapping them, the kv cache and buffers are known once loaded
+            const size_t weights_size =
+                filesystem::file_size(path) + (draft_path.empty() ? 0 : filesystem::file_size(draft_path));
+            while (loaded_memory_size() + weights_size > _memory_budget && evict_one(name, unloaded)) {
+            }
+            // concurrent loads see the weights of this one
+            entry.loading_size = weights_size;
+        }
+        lk.unlock();
+        // free what was unloaded before mapping this one
+        unloaded.clear();
+        cout << "loading model " << name << " from " << path << (draft_path.empty() ? "" : " with draft " + draft_path)
+             << endl;
+        model = make_shared<ServerModel>(name, path, draft_path, _options);
+    } catch (...) {
+        error = current_exception();
+    }
+    if (!lk.owns_lock()) {
+        lk.lock();
+    }
+    entry.loading = false;
+    entry.loading_size = 0;
+    _loaded.notify_all();
+    if (error) {
+        if (!entry.registered) {
+            // a path that does not load is forgotten
+            _entries.erase(name);
+        }
+        rethrow_exception(error);
+    }
+    entry.model = model;
+
+    if (_memory_budget > 0) {
+        while (loaded_memory_size() > _memory_budget && evict_one(name, unloaded)) {
+        }
+        if (loaded_memory_size() > _memory_budget) {
+            entry.model.reset();
+            unloaded.emplace_back(std::move(model));
+            throw runtime_error("not enough memory to load model " + name);
+        }
+    }
+    return model;
+}
+
+size_t ModelRegistry::loaded_memory_size() const {
+    size_t size = 0;
+    for (const auto &item : _entries) {
+        const Entry &entry = item.second;
+        size += entry.model ? entry.model->memory_size() : entry.loading_size;
+    }
+    return size;
+}
+
+bool ModelRegistry::evict_one(const string &keep, vector<shared_ptr<ServerModel>> &unloaded) {
+    // a model is idle when nothing but the registry holds it
+    Entry *victim = nullptr;
+    string victim_name;
+    for (auto &item : _entries) {
+        Entry &entry = item.second;
+        if (item.first == keep || !entry.model || entry.model.use_count() > 1) {
+            continue;
+        }
+        if (!victim || entry.last_used < victim->last_used) {
+            victim = &entry;
+            victim_name = item.first;
+        }
+    }
+    if (!victim) {
+        return false;
+    }
+    cout << "unloading model " << victim_name << endl;
+    unloaded.emplace_back(std::move(victim->model));
+    return true;
+}
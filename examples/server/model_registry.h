@@ -0,0 +1,124 @@
+#ifndef _MODEL_REGISTRY_H
+#define _MODEL_REGISTRY_H
+
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "utils.h"
+#include "scheduler.h"
+#include "../../chatglm.h"
+
+// settings shared by every model served
+struct ServerModelOptions {
+    chatglm::GenerationConfig gen_config;
+    int kv_cache_size;
+    int max_batch_size;
+    int max_queue_size;
+    int max_queue_tokens;
+    chrono::milliseconds max_queue_time;
+    int num_workers;
+};
+
+// A loaded model served by num_workers workers. Each worker is a replica of the model with its own kv cache,
+// buffers, request queue and scheduler thread, pinned to its share of the cores. All replicas compute with the
+// same mapping of the weights. With a draft model, every replica has a replica of the draft as well.
+class ServerModel {
+    struct Worker {
+        unique_ptr<chatglm::Pipeline> pl;
+        ServerRequestTaskQueue request_task_queue;
+        ServerScheduler scheduler;
+        thread runner;
+
+        Worker(unique_ptr<chatglm::Pipeline> pl, const chatglm::GenerationConfig &gen_config,
+               const ServerModelOptions &options, ServerMetrics &metrics);
+    };
+
+    string _name;
+    ServerMetrics _metrics;
+    vector<unique_ptr<Worker>> _workers;
+
+    public:
+        // draft_path is empty unless decoding speculatively
+        ServerModel(const string &name, const string &path, const string &draft_path,
+                    const ServerModelOptions &options);
+        // finishes the queued requests first
+        ~ServerModel();
+
+        ServerModel(const ServerModel &) = delete;
+        ServerModel &operator=(const ServerModel &) = delete;
+
+        const string &name() const { return _name; }
+        // the first replica, for what all of them share such as the tokenizer and config
+        chatglm::Pipeline &pipeline() { return *_workers.front()->pl; }
+        // memory of all replicas as of their last steps, the shared weights counted once
+        chatglm::MemoryUsage memory_usage() const;
+        size_t memory_size() const { return memory_usage().total(); }
+        const ServerMetrics &metrics() const { return _metrics; }
+        int queue_depth() const;
+
+        // queue a request on the least loaded worker
+        shared_ptr<ServerTaskChannel> submit(json data, ServerTask::TaskType type);
+};
+
+// Models known by name, loaded on first use. When loading one would exceed the memory budget, the least recently
+// used models that no request holds are unloaded. Their weights stay in the page cache, so loading them again only
+// maps the file and allocates the kv cache. A model loads without holding the registry lock, so requests for the
+// loaded models go on meanwhile; only those for the same model wait for it.
+class ModelRegistry {
+    struct Entry {
+        string path;
+        string draft_path; // empty unless decoding speculatively
+        shared_ptr<ServerModel> model; // null while unloaded
+        int64_t last_used = 0;
+        bool registered = false; // added by name rather than loaded by path
+        bool loading = false;
+        size_t loading_size = 0; // weights counted against the budget while loading
+    };
+
+    ServerModelOptions _options;
+    size_t _memory_budget; // bytes, 0 for no limit
+
+    mutex _m;
+    condition_variable _loaded; // a model is done loading
+    map<string, Entry> _entries;
+    string _default_name;
+    int64_t _clock = 0;
+
+    public:
+        ModelRegistry(const ServerModelOptions &options, size_t memory_budget);
+
+        // make a model file known under name without loading it
+        void add(const string &name, const string &path);
+
+        // The model for a request, loading it if needed. An empty name selects the default model. Throws
+        // out_of_range for an unknown name and runtime_error when the model does not fit into the budget.
+        shared_ptr<ServerModel> get(const string &name);
+
+        // Load a model by name or path and serve it by default from now on, with the draft model at draft_path
+        // proposing tokens unless it is empty. A model loaded with another draft is loaded again.
+        shared_ptr<ServerModel> load(const string &name_or_path, const string &draft_path = "");
+
+        string default_name();
+
+        // models loaded right now
+        vector<shared_ptr<ServerModel>> loaded_models();
+
+        // metrics of the loaded models in the prometheus text format
+        void scrape_metrics(ostream &os);
+
+    private:
+        // Loads the model with lk unlocked if needed. Unloaded models are moved to unloaded, so that the caller
+        // destroys them, which waits for their workers, after releasing the lock.
+        shared_ptr<ServerModel> get_locked(unique_lock<mutex> &lk, const string &name,
+                                           vector<shared_ptr<ServerModel>> &unloaded);
+        // of the loaded models and the ones being loaded
+        size_t loaded_memory_size() const;
+        bool evict_one(const string &keep, vector<shared_ptr<ServerModel>> &unloaded);
+};
+
+#endif
@@ -0,0 +1,656 @@
+#include "scheduler.h"
+
+#include <algorithm>
+
+static double seconds_since(chrono::steady_clock::time_point start) {
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+// trace a request from the time it was queued, tracer timestamps count from the same clock
+static void trace_since(const char *name, chrono::steady_clock::time_point start, int id) {
+    if (chatglm::Tracer::is_enabled()) {
+        const int64_t start_us = chrono::duration_cast<chrono::microseconds>(start.time_since_epoch()).count();
+        chatglm::Tracer::record(name, start_us, chatglm::Tracer::now_us(), id);
+    }
+}
+
+ServerScheduler::ServerScheduler(chatglm::Pipeline &pl, const chatglm::GenerationConfig &default_gen_config,
+                                 int max_batch_size, chrono::milliseconds max_queue_time,
+                                 ServerRequestTaskQueue &request_task_queue, ServerMetrics &metrics) :
+                                 _pl(pl), _default_gen_config(default_gen_config),
+                                 _request_task_queue(request_task_queue), _metrics(metrics),
+                                 _max_batch_size(max_batch_size),
+                                 // the buffers of a step are sized for max_length tokens
+                                 _max_step_tokens(min(default_gen_config.max_context_length,
+                                                      pl.model->config.max_length)),
+                                 _max_queue_time(max_queue_time) {
+    publish_memory_usage();
+}
+
+shared_ptr<ServerTaskChannel> ServerScheduler::submit(json data, ServerTask::TaskType type) {
+    auto channel = make_shared<ServerTaskChannel>();
+    ServerTask task(_request_task_queue.next_id(), std::move(data), type, channel);
+    _metrics.requests++;
+    chatglm::TraceScope trace("encode", task._id);
+    try {
+        string priority = task._data.value("priority", "interactive");
+        if (priority == "batch") {
+            task._priority = ServerTask::PRIORITY_BATCH;
+        } else if (priority != "interactive") {
+            throw invalid_argument("unknown priority " + priority);
+        }
+        if (type == ServerTask::TASK_EMBEDDING) {
+            string pooling = task._data.value("pooling", "mean");
+            if (pooling == "last") {
+                task._pooling = chatglm::PoolingType::LAST;
+            } else if (pooling != "mean") {
+                throw invalid_argument("unknown pooling " + pooling);
+            }
+            task._embedding_inputs = encode_embedding_inputs(task._data);
+        } else {
+            task._gen_config = make_gen_config(task._data);
+            task._input_ids = encode(task);
+        }
+    } catch (const exception &e) {
+        _metrics.requests_failed++;
+        channel->push({{"error", e.what()}, {"status", 400}});
+        return channel;
+    }
+
+    // admission is charged with the kv cache the request may take
+    if (type == ServerTask::TASK_EMBEDDING) {
+        for (const auto &input_ids : task._embedding_inputs) {
+            task._cost += input_ids.size();
+        }
+    } else {
+        const chatglm::GenerationConfig &gen_config = task._gen_config;
+        const int n_ctx = task._input_ids.size();
+        const int max_new_tokens =
+            (gen_config.max_new_tokens > 0) ? gen_config.max_new_tokens : gen_config.max_length;
+        task._cost = max(n_ctx, min(gen_config.max_length, n_ctx + max_new_tokens));
+    }
+    task._enqueue_time = chrono::steady_clock::now();
+
+    const int task_id = task._id;
+    if (!_request_task_queue.push(std::move(task))) {
+        cout << "request task id:" << task_id << " rejected, queue is full" << endl;
+        _metrics.requests_rejected++;
+        channel->push({{"error", "too many requests"}, {"status", 429}});
+    }
+    return channel;
+}
+
+void ServerScheduler::run() {
+    for (;;) {
+        reject_expired();
+        // block only when there is nothing to decode or embed
+        if (_running.empty() && _embedding_jobs.empty()) {
+            optional<ServerTask> task = _request_task_queue.pop();
+            if (!task) {
+                return;
+            }
+            admit(std::move(*task));
+        }
+        while ((int)_running.size() < _max_batch_size) {
+            optional<ServerTask> task = _request_task_queue.try_pop();
+            if (!task) break;
+            admit(std::move(*task));
+        }
+        drop_cancelled();
+        if (!_running.empty()) {
+            step();
+        }
+        if (!_embedding_jobs.empty()) {
+            embed_step();
+        }
+        _metrics.running += (int)_running.size() - _num_running;
+        _num_running = _running.size();
+        publish_memory_usage();
+    }
+}
+
+chatglm::GenerationConfig ServerScheduler::make_gen_config(const json &data) const {
+    chatglm::GenerationConfig gen_config = _default_gen_config;
+    auto has = [&data](const char *key) { return data.contains(key) && !data[key].is_null(); };
+    if (has("max_tokens")) gen_config.max_length = data["max_tokens"];
+    if (has("n")) gen_config.top_k = data["n"];
+    if (has("temperature")) gen_config.temperature = data["temperature"];
+    if (has("top_p")) gen_config.top_p = data["top_p"];
+    if (has("num_draft_tokens")) gen_config.num_draft_tokens = data["num_draft_tokens"];
+    if (has("stop")) {
+        // a string or a list of them
+        gen_config.stop_strings = data["stop"].is_string() ? vector<string>{data["stop"].get<string>()}
+                                                            : data["stop"].get<vector<string>>();
+    }
+    gen_config.do_sample = gen_config.temperature > 0;
+    gen_config.max_length = min(gen_config.max_length, _pl.model->config.max_length);
+    return gen_config;
+}
+
+vector<int> ServerScheduler::encode(const ServerTask &task) const {
+    const int max_context_length = task._gen_config.max_context_length;
+    if (task._type == ServerTask::TASK_COMPLETION) {
+        string prompt = task._data["prompt"];
+        return _pl.tokenizer->encode(prompt, max_context_length);
+    }
+    vector<chatglm::ChatMessage> messages;
+    for (const auto &message : task._data["messages"]) {
+        messages.emplace_back(message["role"].get<string>(), message["content"].get<string>());
+    }
+    return _pl.tokenizer->encode_messages(messages, max_context_length);
+}
+
+vector<vector<int>> ServerScheduler::encode_embedding_inputs(const json &data) const {
+    // a string or an array of strings, truncated to the model's max_length
+    const json &input = data.at("input");
+    vector<string> texts;
+    if (input.is_string()) {
+        texts.emplace_back(input.get<string>());
+    } else {
+        texts = input.get<vector<string>>();
+    }
+    if (texts.empty()) {
+        throw invalid_argument("input is empty");
+    }
+    vector<vector<int>> inputs;
+    for (const auto &text : texts) {
+        inputs.emplace_back(_pl.tokenizer->encode(text, _pl.model->config.max_length));
+        if (inputs.back().empty()) {
+            throw invalid_argument("cannot embed an empty input");
+        }
+    }
+    return inputs;
+}
+
+bool ServerScheduler::is_expired(const ServerTask &task) const {
+    return _max_queue_time.count() > 0 && chrono::steady_clock::now() - task._enqueue_time > _max_queue_time;
+}
+
+void ServerScheduler::reject_expired() {
+    if (_max_queue_time.count() <= 0) {
+        return;
+    }
+    // the oldest requests of each class are at the front, so this stops at the first one still within budget
+    const chrono::steady_clock::time_point deadline = chrono::steady_clock::now() - _max_queue_time;
+    while (optional<ServerTask> task = _request_task_queue.pop_expired(deadline)) {
+        cout << "request task id:" << task->_id << " rejected, queue time budget exceeded" << endl;
+        _metrics.requests_rejected++;
+        task->_channel->push({{"error", "queue time budget exceeded"}, {"status", 429}});
+    }
+}
+
+void ServerScheduler::admit(ServerTask task) {
+    task.dump();
+
+    Sequence seq{std::move(task)};
+    if (seq.task._channel->is_cancelled()) {
+        fail(seq, "request cancelled");
+        return;
+    }
+    if (is_expired(seq.task)) {
+        fail(seq, "queue time budget exceeded", 429);
+        return;
+    }
+    seq.gen_config = seq.task._gen_config;
+    seq.output_ids = std::move(seq.task._input_ids);
+    _metrics.queue_wait.observe(seconds_since(seq.task._enqueue_time));
+    trace_since("queue_wait", seq.task._enqueue_time, seq.task._id);
+    if (seq.task._type == ServerTask::TASK_EMBEDDING) {
+        _embedding_jobs.push_back({std::move(seq)});
+        return;
+    }
+
+    const chatglm::KVBlockAllocator &kv_allocator = _pl.model->kv_allocator;
+    seq.n_ctx = seq.output_ids.size();
+    seq.n_past = 0;
+    const int max_new_tokens =
+        (seq.gen_config.max_new_tokens > 0) ? seq.gen_config.max_new_tokens : seq.gen_config.max_length;
+    // a request must fit into the kv cache on its own
+    seq.max_length = min({seq.gen_config.max_length, seq.n_ctx + max_new_tokens,
+                          kv_allocator.num_blocks() * kv_allocator.block_size()});
+    if (seq.task._data.value("stream", false)) {
+        vector<shared_ptr<chatglm::BaseStreamer>> streamers{
+            make_shared<chatglm::PerfStreamer>(),
+            make_shared<TaskStreamer>(_pl.tokenizer.get(), seq.task._channel, seq.gen_config.stop_strings)};
+        seq.streamer = make_unique<chatglm::StreamerGroup>(std::move(streamers));
+    } else {
+        seq.streamer = make_unique<chatglm::PerfStreamer>();
+    }
+    seq.streamer->put(seq.output_ids);
+    if (!seq.gen_config.stop_strings.empty()) {
+        seq.stop_matcher = make_unique<chatglm::StopStringMatcher>(_pl.tokenizer.get(), seq.gen_config.stop_strings);
+    }
+
+    if (seq.n_ctx == 0 || seq.n_ctx >= seq.max_length) {
+        finish(seq);
+        return;
+    }
+
+    // the prompt is prefilled by the next step together with the running requests
+    _running.emplace_back(std::move(seq));
+}
+
+void ServerScheduler::embed_step() {
+    EmbeddingJob &job = _embedding_jobs.front();
+    Sequence &seq = job.seq;
+    if (seq.task._channel->is_cancelled()) {
+        fail(seq, "request cancelled");
+        _embedding_jobs.pop_front();
+        return;
+    }
+
+    // whole inputs up to the token budget of a step and the sequences of one graph, at least one of them
+    const vector<vector<int>> &inputs = seq.task._embedding_inputs;
+    const int max_step_seqs = _pl.model->max_graph_seqs();
+    vector<vector<int>> step_inputs;
+    int num_tokens = 0;
+    while (job.next_input < inputs.size() &&
+           (step_inputs.empty() || (num_tokens + (int)inputs[job.next_input].size() <= _max_step_tokens &&
+                                    (int)step_inputs.size() < max_step_seqs))) {
+        num_tokens += inputs[job.next_input].size();
+        step_inputs.emplace_back(inputs[job.next_input++]);
+    }
+
+    // the running requests keep their kv cache, the inputs only take blocks while their graph runs
+    vector<vector<float>> embeddings;
+    const chrono::steady_clock::time_point start_time = chrono::steady_clock::now();
+    {
+        chatglm::TraceScope trace("embed", seq.task._id);
+        try {
+            embeddings = _pl.model->embed(step_inputs, seq.task._pooling, _default_gen_config.num_threads);
+        } catch (const exception &e) {
+            fail(seq, e.what(), 503);
+            _embedding_jobs.pop_front();
+            return;
+        }
+    }
+    // a forward pass over whole inputs, like prefill
+    _metrics.prefill_tokens += num_tokens;
+    atomic_add(_metrics.prefill_seconds, seconds_since(start_time));
+    job.num_tokens += num_tokens;
+    for (auto &embedding : embeddings) {
+        job.embeddings.emplace_back(std::move(embedding));
+    }
+    if (job.next_input < inputs.size()) {
+        return;
+    }
+
+    json response_body;
+    response_body["embeddings"] = job.embeddings;
+    response_body["tokens"] = job.num_tokens;
+    seq.task._channel->push(response_body);
+    trace_since("request", seq.task._enqueue_time, seq.task._id);
+    _embedding_jobs.pop_front();
+}
+
+void ServerScheduler::drop_cancelled() {
+    // their kv cache blocks go back to the pool before this step reserves any
+    auto is_cancelled = [this](Sequence &seq) {
+        if (!seq.task._channel->is_cancelled()) {
+            return false;
+        }
+        fail(seq, "request cancelled");
+        return true;
+    };
+    _running.erase(remove_if(_running.begin(), _running.end(), is_cancelled), _running.end());
+}
+
+void ServerScheduler::step() {
+    if (speculative_step()) {
+        return;
+    }
+    chatglm::TraceScope trace("step");
+    chatglm::KVBlockAllocator &kv_allocator = _pl.model->kv_allocator;
+    for (auto &seq : _running) {
+        // the draft only keeps up with a request decoding alone
+        release_draft_kv(seq);
+    }
+
+    vector<int> input_ids;
+    vector<chatglm::BatchedSequence> batch;
+    vector<size_t> batch_indices;
+
+    // decoding requests always run, prompts are prefilled as long as they fit into the budget, the first one in a chunk
+    // of what is left if needed
+    bool prefilling = false;
+    bool prompt_waiting = false; // later prompts wait too, so that a skipped one goes first once there is room
+    int num_step_tokens = 0;
+    const int prefill_chunk_size = _pl.model->prefill_chunk_size(_default_gen_config);
+    for (auto &seq : _running) {
+        if (seq.n_past == 0 && seq.block_table.empty()) {
+            // start after the longest prefix whose kv cache is already known
+            seq.n_past = _pl.model->prefix_cache.match(seq.output_ids, seq.block_table);
+        }
+        num_step_tokens += (seq.n_past + 1 == (int)seq.output_ids.size());
+    }
+    for (size_t i = 0; i < _running.size(); i++) {
+        Sequence &seq = _running[i];
+        // a preempted request is prefilled again in two parts: its prompt, then the tokens it has generated
+        int end = (seq.n_past == 0) ? seq.n_ctx : seq.output_ids.size();
+        if (prefill_chunk_size > 0) {
+            end = min(end, seq.n_past + prefill_chunk_size); // the rest of a long prompt waits for the next steps
+        }
+        const bool decoding = (seq.n_past + 1 == end);
+        if (!decoding) {
+            const int budget = _max_step_tokens - num_step_tokens;
+            if (!prefilling && _pl.model->config.model_type != chatglm::ModelType::CHATGLM) {
+                end = min(end, seq.n_past + budget); // chatglm prompts cannot be split and wait for room instead
+            }
+            // alone in a step, a sequence of up to max_length tokens always fits into the buffers
+            if (prompt_waiting || budget <= 0 || (end - seq.n_past > budget && num_step_tokens > 0)) {
+                prompt_waiting = true;
+                continue;
+            }
+        }
+        if (!reserve_kv(i, end)) {
+            kv_allocator.release(seq.block_table);
+            seq.n_past = 0;
+            continue;
+        }
+        if (!decoding) {
+            num_step_tokens += end - seq.n_past;
+            prefilling = true;
+        }
+
+        input_ids.insert(input_ids.end(), seq.output_ids.begin() + seq.n_past, seq.output_ids.begin() + end);
+        batch.push_back({kv_allocator.rows(seq.block_table, end), end - seq.n_past, seq.n_past, seq.n_ctx});
+        batch_indices.emplace_back(i);
+    }
+    if (batch.empty()) {
+        return;
+    }
+
+    ggml_tensor *lm_logits;
+    const chrono::steady_clock::time_point start_time = chrono::steady_clock::now();
+    try {
+        // all sequences share the thread setting of the server
+        lm_logits = _pl.model->forward_graph_compute(input_ids, batch, _default_gen_config.num_threads, true);
+    } catch (const exception &e) {
+        for (auto &seq : _running) {
+            fail(seq, e.what());
+        }
+        _running.clear();
+        return;
+    }
+
+    const double step_seconds = seconds_since(start_time);
+    if (prefilling) {
+        _metrics.prefill_tokens += input_ids.size();
+        atomic_add(_metrics.prefill_seconds, step_seconds);
+    } else {
+        _metrics.decode_tokens += input_ids.size();
+        atomic_add(_metrics.decode_seconds, step_seconds);
+    }
+
+    const int vocab_size = lm_logits->ne[0];
+    vector<bool> done(_running.size(), false);
+    for (size_t i = 0; i < batch_indices.size(); i++) {
+        Sequence &seq = _running[batch_indices[i]];
+        seq.n_past += batch[i].qlen;
+        if (batch[i].qlen > 1) {
+            _pl.model->prefix_cache.insert(seq.output_ids, seq.block_table, seq.n_past);
+        }
+        if (seq.n_past < (int)seq.output_ids.size()) {
+            continue; // prompt or generated tokens still to be prefilled
+        }
+
+        float *next_token_logits = (float *)lm_logits->data + i * vocab_size;
+        int next_token_id;
+        try {
+            next_token_id = chatglm::BaseModelForCausalLM::sample_next_token(next_token_logits, vocab_size,
+                                                                             seq.output_ids, seq.gen_config);
+        } catch (const exception &e) {
+            fail(seq, e.what());
+            done[batch_indices[i]] = true;
+            continue;
+        }
+
+        if ((int)seq.output_ids.size() == seq.n_ctx) {
+            seq.first_token_time = chrono::steady_clock::now();
+            _metrics.time_to_first_token.observe(seconds_since(seq.task._enqueue_time));
+        }
+        seq.output_ids.emplace_back(next_token_id);
+        seq.streamer->put({next_token_id});
+
+        const bool is_stopped = seq.stop_matcher && seq.stop_matcher->put(next_token_id);
+        if (is_stopped || is_finished(seq, next_token_id)) {
+            finish(seq);
+            done[batch_indices[i]] = true;
+        }
+    }
+
+    size_t num_kept = 0;
+    for (size_t i = 0; i < _running.size(); i++) {
+        if (done[i]) {
+            continue;
+        }
+        if (num_kept != i) {
+            _running[num_kept] = std::move(_running[i]);
+        }
+        num_kept++;
+    }
+    _running.erase(_running.begin() + num_kept, _running.end());
+}
+
+bool ServerScheduler::speculative_step() {
+    if (!_pl.draft || _running.size() != 1) {
+        return false;
+    }
+    Sequence &seq = _running.front();
+    if (seq.n_past < seq.n_ctx || seq.n_past + 1 != (int)seq.output_ids.size()) {
+        return false; // the prompt is prefilled by a regular step
+    }
+    // as many draft tokens as the length limits leave
+    const int num_draft =
+        min({seq.gen_config.num_draft_tokens, seq.max_length - (int)seq.output_ids.size() - 1,
+             _pl.draft->model->config.max_length + 1 - (int)seq.output_ids.size()});
+    if (num_draft <= 0) {
+        return false;
+    }
+
+    chatglm::TraceScope trace("speculate", seq.task._id);
+    vector<int> next_token_ids;
+    const chrono::steady_clock::time_point start_time = chrono::steady_clock::now();
+    try {
+        next_token_ids = _pl.model->speculate(seq.output_ids, seq.n_ctx, num_draft, seq.gen_config, seq.block_table,
+                                              _pl.draft->model.get(), seq.draft_block_table, seq.draft_n_past);
+    } catch (const exception &e) {
+        fail(seq, e.what());
+        _running.clear();
+        return true;
+    }
+    _metrics.decode_tokens += next_token_ids.size();
+    atomic_add(_metrics.decode_seconds, seconds_since(start_time));
+
+    bool done = false;
+    for (int next_token_id : next_token_ids) {
+        seq.output_ids.emplace_back(next_token_id);
+        seq.streamer->put({next_token_id});
+
+        const bool is_stopped = seq.stop_matcher && seq.stop_matcher->put(next_token_id);
+        if (is_stopped || is_finished(seq, next_token_id)) {
+            done = true;
+            break;
+        }
+    }
+    seq.n_past = seq.output_ids.size() - 1;
+    // drop the blocks taken by rejected draft tokens
+    _pl.model->kv_allocator.truncate(seq.block_table, seq.n_past);
+    if (done) {
+        finish(seq);
+        _running.clear();
+    }
+    return true;
+}
+
+void ServerScheduler::release_draft_kv(Sequence &seq) {
+    if (_pl.draft) {
+        _pl.draft->model->kv_allocator.release(seq.draft_block_table);
+        seq.draft_n_past = 0;
+    }
+}
+
+bool ServerScheduler::reserve_kv(size_t index, int num_tokens) {
+    chatglm::KVBlockAllocator &kv_allocator = _pl.model->kv_allocator;
+    while (!kv_allocator.reserve(_running[index].block_table, num_tokens)) {
+        // cached prefixes nobody is using go first
+        if (_pl.model->prefix_cache.evict(kv_allocator.num_blocks_needed(_running[index].block_table, num_tokens))) {
+            continue;
+        }
+        // preempt the latest admitted request holding kv blocks that is not part of this step yet
+        size_t victim = _running.size();
+        while (victim > index + 1 && _running[victim - 1].block_table.empty()) {
+            victim--;
+        }
+        if (victim == index + 1) {
+            return false;
+        }
+        Sequence &seq = _running[victim - 1];
+        cout << "request task id:" << seq.task._id << " preempted, kv cache is full" << endl;
+        kv_allocator.release(seq.block_table);
+        seq.n_past = 0;
+    }
+    return true;
+}
+
+chatglm::MemoryUsage ServerScheduler::memory_usage() const {
+    lock_guard lk(_memory_usage_m);
+    return _memory_usage;
+}
+
+void ServerScheduler::publish_memory_usage() {
+    // the model is only touched by this thread, so readers get a copy of its sizes
+    chatglm::MemoryUsage usage = _pl.model->memory_usage();
+    if (_pl.draft) {
+        // the draft model takes memory of its own, but kv_tokens_in_use is about the requests
+        const chatglm::MemoryUsage draft = _pl.draft->model->memory_usage();
+        usage.weights += draft.weights;
+        usage.kv_cache += draft.kv_cache;
+        usage.compute_buffer += draft.compute_buffer;
+        usage.scratch_buffer += draft.scratch_buffer;
+        usage.work_buffer += draft.work_buffer;
+    }
+    lock_guard lk(_memory_usage_m);
+    _memory_usage = usage;
+}
+
+bool ServerScheduler::is_finished(const Sequence &seq, int next_token_id) const {
+    const chatglm::ModelConfig &config = _pl.model->config;
+    return (int)seq.output_ids.size() >= seq.max_length || next_token_id == config.eos_token_id ||
+           find(config.extra_eos_token_ids.begin(), config.extra_eos_token_ids.end(), next_token_id) !=
+               config.extra_eos_token_ids.end();
+}
+
+void ServerScheduler::finish(Sequence &seq) {
+    // keep the conversation so far for follow-up requests
+    _pl.model->prefix_cache.insert(seq.output_ids, seq.block_table, seq.n_past);
+    _pl.model->kv_allocator.release(seq.block_table);
+    release_draft_kv(seq);
+    seq.streamer->end();
+
+    vector<int> new_output_ids(seq.output_ids.begin() + seq.n_ctx, seq.output_ids.end());
+    if (new_output_ids.size() > 1) {
+        _metrics.time_per_output_token.observe(seconds_since(seq.first_token_time) / (new_output_ids.size() - 1));
+    }
+    json response_body;
+    try {
+        chatglm::TraceScope trace("decode", seq.task._id);
+        if (seq.task._type == ServerTask::TASK_COMPLETION) {
+            string text = _pl.tokenizer->decode(new_output_ids);
+            chatglm::StopStringMatcher::truncate(text, seq.gen_config.stop_strings);
+            response_body["text"] = text;
+        } else {
+            chatglm::ChatMessage output = _pl.tokenizer->decode_message(new_output_ids);
+            chatglm::StopStringMatcher::truncate(output.content, seq.gen_config.stop_strings);
+            response_body["role"] = output.role;
+            response_body["content"] = output.content;
+        }
+    } catch (const exception &e) {
+        fail(seq, e.what());
+        return;
+    }
+    seq.task._channel->push(response_body);
+    trace_since("request", seq.task._enqueue_time, seq.task._id);
+}
+
+void ServerScheduler::fail(Sequence &seq, const string &message, int status) {
+    if (seq.task._channel->is_cancelled()) {
+        _metrics.requests_cancelled++;
+    } else if (status == 429) {
+        _metrics.requests_rejected++;
+    } else {
+        _metrics.requests_failed++;
+    }
+    _pl.model->kv_allocator.release(seq.block_table);
+    release_draft_kv(seq);
+    cout << "request task id:" << seq.task._id << " failed: " << message << endl;
+
+    json response_body;
+    response_body["error"] = message;
+    response_body["status"] = status;
+    seq.task._channel->push(response_body);
+    trace_since("request", seq.task._enqueue_time, seq.task._id);
+}
+
+void TaskStreamer::put(const vector<int> &output_ids) {
+    if (_is_prompt) {
+        // skip prompt
+        _is_prompt = false;
+        return;
+    }
+
+    _token_cache.insert(_token_cache.end(), output_ids.begin(), output_ids.end());
+    string text = _tokenizer->decode(_token_cache);
+    if (text.size() >= 3 && text.compare(text.size() - 3, 3, "\xef\xbf\xbd") == 0) {
+        // ends with an incomplete utf-8 character, hold on
+        return;
+    }
+    if (text.size() > _print_len) {
+        push_delta(text.substr(_print_len));
+    }
+    _print_len = text.size();
+    if (!text.empty() && text.back() == '\n') {
+        // flush the cache after newline so that decoding stays cheap
+        _token_cache.clear();
+        _print_len = 0;
+    }
+}
+
+void TaskStreamer::end() {
+    string text = _tokenizer->decode(_token_cache);
+    if (text.size() > _print_len) {
+        push_delta(text.substr(_print_len));
+    }
+    if (!_stopped && !_held.empty()) {
+        json chunk;
+        chunk["delta"] = _held;
+        _channel->push(chunk);
+    }
+    _token_cache.clear();
+    _print_len = 0;
+    _held.clear();
+}
+
+void TaskStreamer::push_delta(const string &text) {
+    if (_stopped) {
+        return;
+    }
+    string delta = _held + text;
+    const size_t end = _stop_automaton.feed(text);
+    if (end != string::npos) {
+        // the stop string may start in the held back text
+        delta.resize(_held.size() + end - _stop_automaton.match_size());
+        _held.clear();
+        _stopped = true;
+    } else {
+        const size_t hold = min(delta.size(), (size_t)_stop_automaton.partial_match_size());
+        _held = delta.substr(delta.size() - hold);
+        delta.resize(delta.size() - hold);
+    }
+    if (delta.empty()) {
+        return;
+    }
+    json chunk;
+    chunk["delta"] = delta;
+    _channel->push(chunk);
+}
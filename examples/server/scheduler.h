@@ -0,0 +1,128 @@
+#ifndef _SCHEDULER_H
+#define _SCHEDULER_H
+
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "utils.h"
+#include "metrics.h"
+#include "../../chatglm.h"
+
+// Pushes the text of every sampled token to the task channel as a {"delta"} result, ahead of the final response.
+// Text that may be the start of a stop string is held back until it turns out not to be, and nothing from a stop
+// string on is sent.
+class TaskStreamer : public chatglm::BaseStreamer {
+    chatglm::BaseTokenizer *_tokenizer;
+    shared_ptr<ServerTaskChannel> _channel;
+
+    bool _is_prompt = true;
+    vector<int> _token_cache;
+    size_t _print_len = 0;
+
+    chatglm::AhoCorasick _stop_automaton;
+    string _held;
+    bool _stopped = false;
+
+    public:
+        TaskStreamer(chatglm::BaseTokenizer *tokenizer, shared_ptr<ServerTaskChannel> channel,
+                     const vector<string> &stop_strings) :
+                     _tokenizer(tokenizer), _channel(std::move(channel)), _stop_automaton(stop_strings) {
+        }
+
+        void put(const vector<int> &output_ids) override;
+        void end() override;
+
+    private:
+        void push_delta(const string &text);
+};
+
+// Continuous batching scheduler. Requests join the running batch up to max_batch_size, and every step runs a single
+// graph that prefills new prompts and decodes one token for the others. Requests take kv cache blocks as they grow;
+// when blocks run out the latest admitted request is preempted and prefilled again later.
+// With a draft model, a request decoding alone decodes speculatively, since no other request shares the weight pass.
+// Embedding requests are computed in graphs of their own that skip the lm_head, a step's token budget of inputs at a
+// time in between the steps, so that they do not hold up decoding for long.
+class ServerScheduler {
+    struct Sequence {
+        ServerTask task;
+        chatglm::GenerationConfig gen_config;
+        vector<int> block_table;
+        vector<int> output_ids;
+        unique_ptr<chatglm::StopStringMatcher> stop_matcher; // null without stop strings
+        int n_ctx;  // number of prompt tokens
+        int n_past; // number of tokens already in kv cache, 0 until the prompt is prefilled
+        int max_length;
+        unique_ptr<chatglm::BaseStreamer> streamer;
+        chrono::steady_clock::time_point first_token_time;
+        vector<int> draft_block_table; // kv cache of the draft model while decoding speculatively
+        int draft_n_past = 0;
+    };
+
+    struct EmbeddingJob {
+        Sequence seq;
+        size_t next_input = 0; // inputs before it are embedded
+        vector<vector<float>> embeddings;
+        int num_tokens = 0;
+    };
+
+    chatglm::Pipeline &_pl;
+    chatglm::GenerationConfig _default_gen_config;
+    ServerRequestTaskQueue &_request_task_queue;
+    ServerMetrics &_metrics;
+
+    int _max_batch_size;
+    int _max_step_tokens;
+    chrono::milliseconds _max_queue_time; // 0 for no limit
+    vector<Sequence> _running;
+    deque<EmbeddingJob> _embedding_jobs; // admitted embedding requests, computed in order
+
+    // published after every step for the other threads
+    atomic<int> _num_running{0};
+    mutable mutex _memory_usage_m;
+    chatglm::MemoryUsage _memory_usage;
+
+    public:
+        ServerScheduler(chatglm::Pipeline &pl, const chatglm::GenerationConfig &default_gen_config,
+                        int max_batch_size, chrono::milliseconds max_queue_time,
+                        ServerRequestTaskQueue &request_task_queue, ServerMetrics &metrics);
+
+        // Tokenize a request and queue it, called by the front ends from any thread. The returned channel gets an
+        // error with status 400 for a malformed request, and 429 when the queue is full or the request waited longer
+        // than the queue time budget.
+        shared_ptr<ServerTaskChannel> submit(json data, ServerTask::TaskType type);
+
+        // serve requests until the queue is closed and all of them are done
+        void run();
+
+        int num_running() const { return _num_running; }
+        // memory of the model as of the last step
+        chatglm::MemoryUsage memory_usage() const;
+
+    private:
+        chatglm::GenerationConfig make_gen_config(const json &data) const;
+        vector<int> encode(const ServerTask &task) const;
+        vector<vector<int>> encode_embedding_inputs(const json &data) const;
+
+        bool is_expired(const ServerTask &task) const;
+        void reject_expired();
+        void admit(ServerTask task);
+        // embed the next inputs of the oldest embedding request
+        void embed_step();
+        void drop_cancelled();
+        void step();
+        // decode the only running request speculatively, false if it cannot be
+        bool speculative_step();
+        void release_draft_kv(Sequence &seq);
+        bool reserve_kv(size_t index, int num_tokens);
+
+        void publish_memory_usage();
+
+        bool is_finished(const Sequence &seq, int next_token_id) const;
+        void finish(Sequence &seq);
+        void fail(Sequence &seq, const string &message, int status = 500);
+};
+
+#endif
@@ -1,3 +1,4 @@
+#include <filesystem>
 #include <iostream>
 #include <thread>
 
@@ -10,14 +11,16 @@
 #include <grpcpp/ext/proto_server_reflection_plugin.h>
 #include <grpcpp/grpcpp.h>
 
-#include "httplib.h"
-#include "json.hpp"
+#include "../../third_party/nlohmann/json.hpp"
 #include "utils.h"
+#include "http_server.h"
+#include "scheduler.h"
+#include "model_registry.h"
+#include "tokenizer_pool.h"
 #include "../../chatglm.h"
 #include "service.h"
 
 using namespace std;
-using namespace httplib;
 
 using json = nlohmann::json;
 
@@ -25,6 +28,7 @@ struct ServerConfig {
     string _host;
     int _port;
     string _model_file;
+    string _models;
     int _max_length;
     int _max_context_length;
     int _top_k;
@@ -32,17 +36,33 @@ struct ServerConfig {
     float _temp;
     float _repeat_penalty;
     int _threads;
+    int _workers;
+    int _max_batch_size;
+    int _kv_cache_size;
+    int _prefill_chunk_size;
+    int _max_queue_size;
+    int _max_queue_tokens;
+    int _max_queue_time_ms;
+    int _max_model_memory_mb;
+    int _tokenize_threads;
+    int _http_threads;
+    bool _trace;
+    bool _verbose;
     
     string _grpc_host;
 
-    ServerConfig(string host, string model, 
+    ServerConfig(string host, string model, string models,
                  int max_length, int max_context_length, 
                  int top_k, float top_p, float temp, 
-                 float repeat_penalty, int threads, string grpc_host) {
+                 float repeat_penalty, int threads, int workers, int max_batch_size, int kv_cache_size,
+                 int prefill_chunk_size, int max_queue_size, int max_queue_tokens, int max_queue_time_ms,
+                 int max_model_memory_mb, int tokenize_threads, int http_threads, bool trace, bool verbose,
+                 string grpc_host) {
         pair<string, string> h = absl::StrSplit(host, ':');
         _host = h.first;
         _port = h.second == "" ? 8080 : atoi(h.second.c_str());
         _model_file = model;
+        _models = models;
         _max_length = max_length;
         _max_context_length = max_context_length;
         _top_k = top_k;
@@ -50,6 +70,19 @@ struct ServerConfig {
         _temp = temp;
         _repeat_penalty = repeat_penalty;
         _threads = threads;
+        _workers = workers;
+        _max_batch_size = max_batch_size;
+        // by default every request can reach max_length at the same time
+        _kv_cache_size = kv_cache_size > 0 ? kv_cache_size : max_length * max_batch_size;
+        _prefill_chunk_size = prefill_chunk_size;
+        _max_queue_size = max_queue_size;
+        _max_queue_tokens = max_queue_tokens;
+        _max_queue_time_ms = max_queue_time_ms;
+        _max_model_memory_mb = max_model_memory_mb;
+        _tokenize_threads = tokenize_threads;
+        _http_threads = http_threads;
+        _trace = trace;
+        _verbose = verbose;
 
         _grpc_host = grpc_host;
     }
@@ -58,6 +91,7 @@ struct ServerConfig {
         cout << "config host: " << _host << endl;
         cout << "config port: " << _port << endl;
         cout << "config model: " << _model_file << endl;
+        cout << "config models: " << _models << endl;
         cout << "config max_length: " << _max_length << endl;
         cout << "config max_context_length: " << _max_context_length << endl;
         cout << "config top_k: " << _top_k << endl;
@@ -65,155 +99,102 @@ struct ServerConfig {
         cout << "config temp: " << _temp << endl;
         cout << "config repeat_penalty: " << _repeat_penalty << endl;
         cout << "config threads: " << _threads << endl;
+        cout << "config workers: " << _workers << endl;
+        cout << "config max_batch_size: " << _max_batch_size << endl;
+        cout << "config kv_cache_size: " << _kv_cache_size << endl;
+        cout << "config prefill_chunk_size: " << _prefill_chunk_size << endl;
+        cout << "config max_queue_size: " << _max_queue_size << endl;
+        cout << "config max_queue_tokens: " << _max_queue_tokens << endl;
+        cout << "config max_queue_time_ms: " << _max_queue_time_ms << endl;
+        cout << "config max_model_memory_mb: " << _max_model_memory_mb << endl;
+        cout << "config tokenize_threads: " << _tokenize_threads << endl;
+        cout << "config http_threads: " << _http_threads << endl;
+        cout << "config trace: " << _trace << endl;
+        cout << "config verbose: " << _verbose << endl;
 
         cout << "config grpc host: " << _grpc_host << endl;
     }
 };
 
 ABSL_FLAG(string, host, "127.0.0.1:8080", "ip:port");
-ABSL_FLAG(string, model, "models/chatglm3-6b-q4_0.bin", "model file");
+ABSL_FLAG(string, model, "models/chatglm3-6b-q4_0.bin", "default model file, served under its file name without extension");
+ABSL_FLAG(string, models, "", "more models loaded on demand, as name=path,name=path");
 ABSL_FLAG(int16_t, max_length, 2048, "max total length including prompt and output");
 ABSL_FLAG(int16_t, max_context_length, 512, "max context length");
 ABSL_FLAG(int16_t, top_k, 0, "top-k sampling");
 ABSL_FLAG(float, top_p, 0.7, "top-p sampling");
 ABSL_FLAG(float, temp, 0.95, "temperature");
 ABSL_FLAG(float, repeat_penalty, 1.0, "penalize repeat sequence of tokens");
-ABSL_FLAG(int16_t, threads, 0, "number of threads for inference");
+ABSL_FLAG(int16_t, threads, 0, "number of threads for inference per worker, 0 to split the cores between workers");
+ABSL_FLAG(int16_t, workers, 1, "number of replicas of each model, each pinned to its share of the cores");
+ABSL_FLAG(int16_t, max_batch_size, 4, "max number of requests decoded together");
+ABSL_FLAG(int32_t, kv_cache_size, 0, "number of tokens in kv cache shared by the requests of a worker, 0 for max_length * max_batch_size");
+ABSL_FLAG(int32_t, prefill_chunk_size, 0, "prompt tokens prefilled per step of a request to bound memory, 0 for all at once");
+ABSL_FLAG(int32_t, max_queue_size, 256, "max number of waiting requests before rejecting with 429, 0 for no limit");
+ABSL_FLAG(int32_t, max_queue_tokens, 0, "max total cost (prompt + new tokens) of waiting requests, 0 for no limit");
+ABSL_FLAG(int32_t, max_queue_time_ms, 0, "reject requests waiting longer than this with 429, 0 for no limit");
+ABSL_FLAG(int32_t, max_model_memory_mb, 0, "unload least recently used models beyond this memory, 0 for no limit");
+ABSL_FLAG(int16_t, tokenize_threads, 2, "number of threads serving /tokenize, apart from inference");
+ABSL_FLAG(int16_t, http_threads, 4, "number of threads running http handlers, which never wait for generation");
+ABSL_FLAG(bool, trace, false, "record tracing spans of requests, served as a chrome trace at /debug/trace");
+ABSL_FLAG(bool, verbose, false, "log every http request with its body and response status");
 
 ABSL_FLAG(string, grpc_host, "127.0.0.1:50051", "ip:port");
 
-std::string dump_headers(const Headers &headers) {
-    std::string s;
-    char buf[BUFSIZ];
-
-    for (auto it = headers.begin(); it != headers.end(); ++it) {
-        const auto &x = *it;
-        snprintf(buf, sizeof(buf), "%s: %s\n", x.first.c_str(), x.second.c_str());
-        s += buf;
+// The model named by a request, or the default one. Responds with the error and returns null when it cannot be
+// served.
+shared_ptr<ServerModel> route(ModelRegistry &registry, const json &data, HttpExchange &exchange) {
+    const bool has_model = data.contains("model") && data["model"].is_string();
+    try {
+        return registry.get(has_model ? data["model"].get<string>() : "");
+    } catch (const out_of_range &e) {
+        exchange.respond(404, json{{"error", e.what()}}.dump(), "application/json");
+    } catch (const exception &e) {
+        exchange.respond(503, json{{"error", e.what()}}.dump(), "application/json");
     }
-
-    return s;
+    return nullptr;
 }
 
-std::string log(const Request &req, const Response &res) {
-    std::string s;
-    char buf[BUFSIZ];
-    
-    s += "================================\n";  
-    snprintf(buf, sizeof(buf), "%s %s %s", req.method.c_str(),
-             req.version.c_str(), req.path.c_str());
-    s += buf;
-    
-    std::string query;
-    for (auto it = req.params.begin(); it != req.params.end(); ++it) {
-      const auto &x = *it;
-      snprintf(buf, sizeof(buf), "%c%s=%s",
-               (it == req.params.begin()) ? '?' : '&', x.first.c_str(),
-               x.second.c_str());
-      query += buf;
-    }
-    snprintf(buf, sizeof(buf), "%s\n", query.c_str());
-    s += buf;   
-    s += dump_headers(req.headers);
-    
-    s += "--------------------------------\n";
-    snprintf(buf, sizeof(buf), "%d %s\n", res.status, res.version.c_str());
-    s += buf;
-    s += dump_headers(res.headers);
-    s += "\n";  
-    if (!res.body.empty()) { s += res.body; }   
-    s += "\n";
-    
-    return s;
+// Respond with the final result of a task once it arrives, built by make_body. The model is kept loaded until then.
+void respond_result(shared_ptr<HttpExchange> exchange, shared_ptr<ServerModel> model,
+                    shared_ptr<ServerTaskChannel> channel, function<json(json &result)> make_body) {
+    exchange->relay(channel, [exchange, model, make_body](const json &result) {
+        if (result.contains("delta")) {
+            return true;
+        }
+        if (result.contains("error")) {
+            exchange->respond(result.value("status", 500), result.dump(), "application/json");
+            return false;
+        }
+        json final_result = result;
+        exchange->respond(200, make_body(final_result).dump(), "application/json");
+        return false;
+    });
 }
 
-int start_loop(ServerConfig &conf, chatglm::Pipeline &pl, 
-               ServerRequestTaskQueue &request_task_queue, 
-               ServerResponseTaskQueue &response_task_queue) {    
-    auto perf_streamer = make_shared<chatglm::PerfStreamer>();
-
-    for (;;) {
-        ServerTask task = request_task_queue.pop();
-        task.dump();
-
-        if (task._type == ServerTask::TASK_COMPLETION) {
-            int max_tokens = conf._max_length;
-            if (!task._data["max_tokens"].is_null()) max_tokens = task._data["max_tokens"];
-            int top_k = conf._top_k;
-            if (!task._data["n"].is_null()) top_k = task._data["n"];
-            float temperature = conf._temp;
-            if (!task._data["temperature"].is_null()) temperature = task._data["temperature"];
-            float top_p = conf._top_p;
-            if (!task._data["top_p"].is_null()) top_p = task._data["top_p"];
-
-            chatglm::GenerationConfig gen_config(max_tokens, -1, conf._max_context_length,
-                                                 temperature > 0, top_k, top_p, temperature, 
-                                                 conf._repeat_penalty, conf._threads);
-
-            string prompt = task._data["prompt"];
-            string content = pl.generate(prompt, gen_config, perf_streamer.get());
-
-            json response_body;
-            response_body["text"] = content;
-            response_task_queue.push(ServerTask(task._id, response_body, task._type));
-
-            perf_streamer->reset();
-        } else if (task._type == ServerTask::TASK_CHAT_COMPLETION) {
-            int max_tokens = conf._max_length;
-            if (!task._data["max_tokens"].is_null()) max_tokens = task._data["max_tokens"];
-            int top_k = conf._top_k;
-            if (!task._data["n"].is_null()) top_k = task._data["n"];
-            float temperature = conf._temp;
-            if (!task._data["temperature"].is_null()) temperature = task._data["temperature"];
-            float top_p = conf._top_p;
-            if (!task._data["top_p"].is_null()) top_p = task._data["top_p"];
-
-            chatglm::GenerationConfig gen_config(max_tokens, -1, conf._max_context_length,
-                                                 temperature > 0, top_k, top_p, temperature, 
-                                                 conf._repeat_penalty, conf._threads);
-
-            vector<chatglm::ChatMessage> messages;
-
-            for (int i=0; i<task._data["messages"].size(); i++) {
-                string role = task._data["messages"][i]["role"];
-                string prompt = task._data["messages"][i]["content"];
-                messages.push_back(chatglm::ChatMessage(role, prompt));
-            }
-
-/*
-            std::cout << "max_length: " << gen_config.max_length << std::endl;
-            std::cout << "max_new_tokens: " << gen_config.max_new_tokens << std::endl;
-            std::cout << "max_context_length: " << gen_config.max_context_length << std::endl;
-            std::cout << "do_sample: " << gen_config.do_sample << std::endl;
-            std::cout << "top_k: " << gen_config.top_k << std::endl;
-            std::cout << "top_p: " << gen_config.top_p << std::endl;
-            std::cout << "temperature: " << gen_config.temperature << std::endl;
-            std::cout << "repetition_penalty: " << gen_config.repetition_penalty << std::endl;
-            std::cout << "num_threads: " << gen_config.num_threads << std::endl;
-
-            for (int i=0; i<messages.size(); i++) {
-                std::cout << "role: " << messages[i].role << std::endl;
-                std::cout << "content: " << messages[i].content << std::endl;
-            }
-*/
-            chatglm::ChatMessage output = pl.chat(messages, gen_config, perf_streamer.get());
-
-            json response_body;
-            response_body["role"] = output.role;
-            response_body["content"] = output.content;
-            response_task_queue.push(ServerTask(task._id, response_body, task._type));
-
-            perf_streamer->reset();
+// Send the deltas of a streaming task as server-sent events. make_chunk builds the event payload for a piece of text,
+// or for the end of the stream when finish_reason is not null. The model is kept loaded until the stream ends.
+void stream_response(shared_ptr<HttpExchange> exchange, shared_ptr<ServerModel> model,
+                     shared_ptr<ServerTaskChannel> channel,
+                     function<json(const string &text, const json &finish_reason)> make_chunk) {
+    exchange->start_stream("text/event-stream");
+    exchange->relay(channel, [exchange, model, make_chunk](const json &result) {
+        auto send = [&exchange](const json &event) { exchange->send("data: " + event.dump() + "\n\n"); };
+        if (result.contains("delta")) {
+            send(make_chunk(result["delta"], nullptr));
+            return true;
         }
-    }
-    
-    return 0;
+        send(result.contains("error") ? result : make_chunk("", "stop"));
+        exchange->send("data: [DONE]\n\n");
+        exchange->finish();
+        return false;
+    });
 }
 
-void run_grpc_server(ServerRequestTaskQueue &request_task_queue, 
-                     ServerResponseTaskQueue &response_task_queue, 
+void run_grpc_server(ModelRegistry &registry, 
+                     TokenizerPool &tokenizer_pool, 
                      string host) {
-    BackendServiceImpl service(&request_task_queue, &response_task_queue);
+    BackendServiceImpl service(&registry, &tokenizer_pool);
 
     grpc::EnableDefaultHealthCheckService(true);
     grpc::reflection::InitProtoReflectionServerBuilderPlugin();
@@ -234,66 +215,172 @@ void run_grpc_server(ServerRequestTaskQueue &request_task_queue,
 int main(int argc, char * argv[]) {
     absl::ParseCommandLine(argc, argv);
 
-    ServerConfig conf(absl::GetFlag(FLAGS_host), absl::GetFlag(FLAGS_model),
+    ServerConfig conf(absl::GetFlag(FLAGS_host), absl::GetFlag(FLAGS_model), absl::GetFlag(FLAGS_models),
                       absl::GetFlag(FLAGS_max_length), absl::GetFlag(FLAGS_max_context_length),
                       absl::GetFlag(FLAGS_top_k), absl::GetFlag(FLAGS_top_p),
                       absl::GetFlag(FLAGS_temp), absl::GetFlag(FLAGS_repeat_penalty),
-                      absl::GetFlag(FLAGS_threads), absl::GetFlag(FLAGS_grpc_host));
+                      absl::GetFlag(FLAGS_threads), absl::GetFlag(FLAGS_workers),
+                      absl::GetFlag(FLAGS_max_batch_size),
+                      absl::GetFlag(FLAGS_kv_cache_size), absl::GetFlag(FLAGS_prefill_chunk_size),
+                      absl::GetFlag(FLAGS_max_queue_size),
+                      absl::GetFlag(FLAGS_max_queue_tokens), absl::GetFlag(FLAGS_max_queue_time_ms),
+                      absl::GetFlag(FLAGS_max_model_memory_mb), absl::GetFlag(FLAGS_tokenize_threads),
+                      absl::GetFlag(FLAGS_http_threads), absl::GetFlag(FLAGS_trace),
+                      absl::GetFlag(FLAGS_verbose),
+                      absl::GetFlag(FLAGS_grpc_host));
     conf.dump();
+    chatglm::Tracer::set_enabled(conf._trace);
 
-    chatglm::Pipeline pl(conf._model_file);
+    chatglm::GenerationConfig default_gen_config(conf._max_length, -1, conf._max_context_length,
+                                                 conf._temp > 0, conf._top_k, conf._top_p, conf._temp,
+                                                 conf._repeat_penalty, conf._threads);
+    default_gen_config.prefill_chunk_size = conf._prefill_chunk_size;
+    ServerModelOptions model_options{default_gen_config, conf._kv_cache_size, conf._max_batch_size,
+                                     conf._max_queue_size, conf._max_queue_tokens,
+                                     chrono::milliseconds(conf._max_queue_time_ms), conf._workers};
+    ModelRegistry registry(model_options, (size_t)conf._max_model_memory_mb << 20);
+    registry.add(filesystem::path(conf._model_file).stem().string(), conf._model_file);
+    for (absl::string_view model : absl::StrSplit(conf._models, ',', absl::SkipEmpty())) {
+        pair<string, string> m = absl::StrSplit(model, '=');
+        registry.add(m.first, m.second);
+    }
+    registry.get("");
     cout << "load model ok." << endl;
 
-    httplib::Server svr;
-    ServerRequestTaskQueue request_task_queue;
-    ServerResponseTaskQueue response_task_queue;
+    TokenizerPool tokenizer_pool(conf._tokenize_threads);
 
-    if (!svr.is_valid()) {
-        cout << "server has an error..." << endl;
-        return -1;
-    }
+    HttpServer svr(conf._http_threads, conf._verbose);
 
-    svr.Get("/", [](const Request & /* req */, Response &res) {
-        res.set_content("hello world!", "text/plain");
+    svr.Get("/", [](shared_ptr<HttpExchange> ex) {
+        ex->respond(200, "hello world!", "text/plain");
     });
 
-    svr.Post("/v1/completions", [&](const Request &req, Response &res){
-        cout << req.body << endl;
-        json data = json::parse(req.body);
-
-        int taskId = request_task_queue.push(data, ServerTask::TASK_COMPLETION);
-        json result = response_task_queue.result(taskId);
+    svr.Get("/metrics", [&](shared_ptr<HttpExchange> ex) {
+        ostringstream os;
+        registry.scrape_metrics(os);
+        ex->respond(200, os.str(), "text/plain; version=0.0.4");
+    });
 
-        json response_body;
-        boost::uuids::random_generator gen;
-        response_body["id"] = boost::uuids::to_string(gen());
-        response_body["choices"][0]["text"] = result["text"];
-        res.set_content(response_body.dump(), "application/json");
+    // the latest spans of every thread, to open in chrome://tracing or ui.perfetto.dev
+    svr.Get("/debug/trace", [](shared_ptr<HttpExchange> ex) {
+        ostringstream os;
+        chatglm::Tracer::dump(os);
+        ex->respond(200, os.str(), "application/json");
     });
 
-    svr.Post("/v1/chat/completions", [&](const Request &req, Response &res) {
-        cout << req.body << endl;
-        json data = json::parse(req.body);
+    svr.Post("/v1/completions", [&](shared_ptr<HttpExchange> ex) {
+        json data = json::parse(ex->request.body);
 
-        int taskId = request_task_queue.push(data, ServerTask::TASK_CHAT_COMPLETION);
-        json result = response_task_queue.result(taskId);
+        shared_ptr<ServerModel> model = route(registry, data, *ex);
+        if (!model) {
+            return;
+        }
+        auto channel = model->submit(data, ServerTask::TASK_COMPLETION);
+        if (data.value("stream", false)) {
+            string id = boost::uuids::to_string(boost::uuids::random_generator()());
+            stream_response(ex, model, channel, [id](const string &text, const json &finish_reason) {
+                json chunk;
+                chunk["id"] = id;
+                chunk["object"] = "text_completion";
+                chunk["choices"][0] = { {"index", 0}, {"text", text}, {"finish_reason", finish_reason} };
+                return chunk;
+            });
+            return;
+        }
+        respond_result(ex, model, channel, [](json &result) {
+            json response_body;
+            boost::uuids::random_generator gen;
+            response_body["id"] = boost::uuids::to_string(gen());
+            response_body["choices"][0]["text"] = result["text"];
+            return response_body;
+        });
+    });
 
-        json response_body;
-        boost::uuids::random_generator gen;
-        response_body["id"] = boost::uuids::to_string(gen());
-        response_body["choices"].push_back({"message", result});
-        res.set_content(response_body.dump(), "application/json");
+    svr.Post("/v1/chat/completions", [&](shared_ptr<HttpExchange> ex) {
+        json data = json::parse(ex->request.body);
+
+        shared_ptr<ServerModel> model = route(registry, data, *ex);
+        if (!model) {
+            return;
+        }
+        auto channel = model->submit(data, ServerTask::TASK_CHAT_COMPLETION);
+        if (data.value("stream", false)) {
+            string id = boost::uuids::to_string(boost::uuids::random_generator()());
+            // the first chunk carries the role, the last one an empty delta with the finish reason
+            auto is_first = make_shared<bool>(true);
+            stream_response(ex, model, channel,
+                            [id, is_first](const string &text, const json &finish_reason) {
+                json delta = json::object();
+                if (*is_first) delta["role"] = "assistant";
+                if (!text.empty()) delta["content"] = text;
+                *is_first = false;
+
+                json chunk;
+                chunk["id"] = id;
+                chunk["object"] = "chat.completion.chunk";
+                chunk["created"] = time(nullptr);
+                chunk["choices"][0] = { {"index", 0}, {"delta", delta}, {"finish_reason", finish_reason} };
+                return chunk;
+            });
+            return;
+        }
+        respond_result(ex, model, channel, [](json &result) {
+            json response_body;
+            boost::uuids::random_generator gen;
+            response_body["id"] = boost::uuids::to_string(gen());
+            response_body["choices"].push_back({"message", result});
+            return response_body;
+        });
     });
 
-    svr.set_error_handler([](const Request & /* req */, Response &res) {
-        const char * fmt = "<p>Error Status: <span style='color:red;'>%d</span></p>";
-        char buf[BUFSIZ];
-        snprintf(buf, sizeof(buf), fmt, res.status);
-        res.set_content(buf, "text/html");
+    svr.Post("/v1/embeddings", [&](shared_ptr<HttpExchange> ex) {
+        json data = json::parse(ex->request.body);
+
+        shared_ptr<ServerModel> model = route(registry, data, *ex);
+        if (!model) {
+            return;
+        }
+        auto channel = model->submit(data, ServerTask::TASK_EMBEDDING);
+        respond_result(ex, model, channel, [name = model->name()](json &result) {
+            json response_body;
+            response_body["object"] = "list";
+            response_body["model"] = name;
+            response_body["data"] = json::array();
+            for (size_t i = 0; i < result["embeddings"].size(); i++) {
+                response_body["data"].push_back(
+                    { {"object", "embedding"}, {"index", i}, {"embedding", std::move(result["embeddings"][i])} });
+            }
+            response_body["usage"] = { {"prompt_tokens", result["tokens"]}, {"total_tokens", result["tokens"]} };
+            return response_body;
+        });
     });
 
-    svr.set_logger([](const Request &req, const Response &res) {
-        cout << log(req, res) << endl;
+    svr.Post("/tokenize", [&](shared_ptr<HttpExchange> ex) {
+        json data = json::parse(ex->request.body);
+
+        shared_ptr<ServerModel> model = route(registry, data, *ex);
+        if (!model) {
+            return;
+        }
+        // content is a text or a batch of them, messages a conversation in the chat format of the model
+        json response_body;
+        try {
+            if (data.contains("messages")) {
+                vector<chatglm::ChatMessage> messages;
+                for (const auto &message : data["messages"]) {
+                    messages.emplace_back(message["role"].get<string>(), message["content"].get<string>());
+                }
+                response_body["tokens"] = tokenizer_pool.encode_messages(model, messages);
+            } else if (data.at("content").is_string()) {
+                response_body["tokens"] = tokenizer_pool.encode(model, {data["content"].get<string>()})[0];
+            } else {
+                response_body["tokens"] = tokenizer_pool.encode(model, data["content"].get<vector<string>>());
+            }
+        } catch (const exception &e) {
+            ex->respond(400, json({{"error", e.what()}, {"status", 400}}).dump(), "application/json");
+            return;
+        }
+        ex->respond(200, response_body.dump(), "application/json");
     });
 
     if (!svr.bind_to_port(conf._host, conf._port)) {
@@ -309,12 +396,10 @@ int main(int argc, char * argv[]) {
     });
 
     thread t_grpc([&] {
-        run_grpc_server(request_task_queue, response_task_queue, conf._grpc_host);
+        run_grpc_server(registry, tokenizer_pool, conf._grpc_host);
         return 0;
     });
 
-    start_loop(conf, pl, request_task_queue, response_task_queue);
-
     t_grpc.join();
 
     t.join();
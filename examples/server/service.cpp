@@ -2,10 +2,8 @@
 
 using namespace std;
 
-BackendServiceImpl::BackendServiceImpl(ServerRequestTaskQueue * request_task_queue, 
-                                       ServerResponseTaskQueue * response_task_queue) : 
-                                       _request_task_queue(request_task_queue), 
-                                       _response_task_queue(response_task_queue) {
+BackendServiceImpl::BackendServiceImpl(ModelRegistry * registry, TokenizerPool * tokenizer_pool) : 
+                                       _registry(registry), _tokenizer_pool(tokenizer_pool) {
 }
 
 BackendServiceImpl::~BackendServiceImpl() {
@@ -22,6 +20,21 @@ grpc::Status BackendServiceImpl::Health(ServerContext* context,
 grpc::Status BackendServiceImpl::LoadModel(ServerContext* context, 
                                            const ModelOptions* request, 
                                            Result* result) {
+    // ModelFile is the path of the model named Model, otherwise Model is a registered name or a path
+    string name = request->model();
+    if (!request->modelfile().empty()) {
+        if (name.empty()) name = request->modelfile();
+        _registry->add(name, request->modelfile());
+    }
+    try {
+        _registry->load(name, request->draftmodel());
+    } catch (const exception &e) {
+        cout << "load model " << name << " failed: " << e.what() << endl;
+        result->set_message(e.what());
+        result->set_success(false);
+        return Status::OK;
+    }
+
     result->set_message("Loading succeeded");
     result->set_success(true);
     return Status::OK;
@@ -32,6 +45,137 @@ grpc::Status BackendServiceImpl::Predict(ServerContext* context,
                                          Reply* response) {
     cout << "predict prompt: " << request->prompt() << endl;
 
+    json data = make_request_data(request);
+    shared_ptr<ServerModel> model;
+    shared_ptr<ServerTaskChannel> channel;
+    grpc::Status status = submit(context, data, ServerTask::TASK_CHAT_COMPLETION, model, channel);
+    if (!status.ok()) {
+        return status;
+    }
+    json result = wait_result(context, *channel);
+    if (result.contains("error")) {
+        return error_status(*channel, result);
+    }
+    json response_body;
+
+    cout << "result role:" << result["role"] << " result content: " << result["content"] << endl;
+
+    response->set_message(result["content"]);
+
+    return grpc::Status::OK;
+}
+
+grpc::Status BackendServiceImpl::PredictStream(ServerContext* context, 
+                                               const PredictOptions* request, 
+                                               ServerWriter<Reply>* writer) {
+    cout << "predict stream prompt: " << request->prompt() << endl;
+
+    json data = make_request_data(request);
+    data["stream"] = true;
+    shared_ptr<ServerModel> model;
+    shared_ptr<ServerTaskChannel> channel;
+    grpc::Status status = submit(context, data, ServerTask::TASK_CHAT_COMPLETION, model, channel);
+    if (!status.ok()) {
+        return status;
+    }
+
+    // relay the deltas as the scheduler samples them, until the final response arrives
+    while (true) {
+        json result = wait_result(context, *channel);
+        if (result.contains("error")) {
+            return error_status(*channel, result);
+        }
+        if (!result.contains("delta")) {
+            break;
+        }
+        Reply reply;
+        reply.set_message(result["delta"].get<string>());
+        if (!writer->Write(reply)) {
+            // the stream is broken, stop generating and drain up to the final result
+            channel->cancel();
+        }
+    }
+
+    return grpc::Status::OK;
+}
+
+grpc::Status BackendServiceImpl::Embedding(ServerContext* context, 
+                                           const PredictOptions* request, 
+                                           EmbeddingResult* result) {
+    // the text to embed comes in Embeddings, or in Prompt for clients that only set that
+    json data;
+    data["input"] = request->embeddings().empty() ? request->prompt() : request->embeddings();
+    shared_ptr<ServerModel> model;
+    shared_ptr<ServerTaskChannel> channel;
+    grpc::Status status = submit(context, data, ServerTask::TASK_EMBEDDING, model, channel);
+    if (!status.ok()) {
+        return status;
+    }
+    json response_body = wait_result(context, *channel);
+    if (response_body.contains("error")) {
+        return error_status(*channel, response_body);
+    }
+
+    for (float x : response_body["embeddings"][0]) {
+        result->add_embeddings(x);
+    }
+    return grpc::Status::OK;
+}
+
+grpc::Status BackendServiceImpl::TokenizeString(ServerContext* context, 
+                                                const PredictOptions* request, 
+                                                TokenizationResponse* response) {
+    shared_ptr<ServerModel> model;
+    grpc::Status status = get_model(context, model);
+    if (!status.ok()) {
+        return status;
+    }
+
+    // the raw prompt, without the chat format Predict wraps it in
+    vector<int> tokens;
+    try {
+        tokens = _tokenizer_pool->encode(model, {request->prompt()})[0];
+    } catch (const exception &e) {
+        return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT, e.what());
+    }
+    response->set_length(tokens.size());
+    for (int id : tokens) {
+        response->add_tokens(id);
+    }
+    return grpc::Status::OK;
+}
+
+grpc::Status BackendServiceImpl::Status(ServerContext* context, 
+                                        const HealthMessage* request, 
+                                        StatusResponse* response) {
+    // bytes of every loaded model by part, keyed as model/part, plus the kv cache tokens in use
+    bool busy = false;
+    MemoryUsageData *memory = response->mutable_memory();
+    auto &breakdown = *memory->mutable_breakdown();
+    uint64_t total = 0;
+    for (const auto &model : _registry->loaded_models()) {
+        busy |= model->metrics().running > 0 || model->queue_depth() > 0;
+
+        chatglm::MemoryUsage usage = model->memory_usage();
+        breakdown[model->name() + "/weight_buffer"] = usage.weights;
+        breakdown[model->name() + "/ctx_kv"] = usage.kv_cache;
+        breakdown[model->name() + "/compute_buffer"] = usage.compute_buffer;
+        breakdown[model->name() + "/scratch_buffer"] = usage.scratch_buffer;
+        breakdown[model->name() + "/work_buffer"] = usage.work_buffer;
+        breakdown[model->name() + "/kv_tokens_in_use"] = usage.kv_tokens_in_use;
+        total += usage.total();
+    }
+    memory->set_total(total);
+    response->set_state(busy ? StatusResponse::BUSY : StatusResponse::READY);
+
+    ostringstream os;
+    _registry->scrape_metrics(os);
+    response->set_metrics(os.str());
+
+    return grpc::Status::OK;
+}
+
+json BackendServiceImpl::make_request_data(const PredictOptions* request) const {
     json message = { {"role", "user"}, {"content", request->prompt()} };
     json data;
     data["messages"].push_back(message);
@@ -39,14 +183,73 @@ grpc::Status BackendServiceImpl::Predict(ServerContext* context,
     if (request->topk() > 0) data["n"] = request->topk();
     if (request->temperature() > 0) data["temperature"] = request->temperature();
     if (request->topp() > 0) data["top_p"] = request->topp();
+    if (request->ndraft() > 0) data["num_draft_tokens"] = request->ndraft();
+    for (const auto &stop : request->stopprompts()) {
+        data["stop"].push_back(stop);
+    }
 
-    int taskId = _request_task_queue->push(data, ServerTask::TASK_CHAT_COMPLETION);
-    json result = _response_task_queue->result(taskId);
-    json response_body;
+    return data;
+}
 
-    cout << "result role:" << result["role"] << " result content: " << result["content"] << endl;
+static string metadata(ServerContext* context, const char *key) {
+    auto it = context->client_metadata().find(key);
+    return it == context->client_metadata().end() ? string() : string(it->second.data(), it->second.size());
+}
 
-    response->set_message(result["content"]);
+grpc::Status BackendServiceImpl::get_model(ServerContext* context, shared_ptr<ServerModel> &model) {
+    // clients pick the model and the priority class through metadata, the last loaded model by default
+    try {
+        model = _registry->get(metadata(context, "model"));
+    } catch (const out_of_range &e) {
+        return grpc::Status(grpc::StatusCode::NOT_FOUND, e.what());
+    } catch (const exception &e) {
+        return grpc::Status(grpc::StatusCode::UNAVAILABLE, e.what());
+    }
+    return grpc::Status::OK;
+}
+
+grpc::Status BackendServiceImpl::submit(ServerContext* context, const json &data, ServerTask::TaskType type,
+                                        shared_ptr<ServerModel> &model, shared_ptr<ServerTaskChannel> &channel) {
+    grpc::Status status = get_model(context, model);
+    if (!status.ok()) {
+        return status;
+    }
+
+    json task_data = data;
+    string priority = metadata(context, "priority");
+    if (!priority.empty()) {
+        task_data["priority"] = priority;
+    }
+    channel = model->submit(std::move(task_data), type);
+    // the scheduler gives up on the request once the client deadline passes
+    chrono::system_clock::time_point deadline = context->deadline();
+    if (deadline != chrono::system_clock::time_point::max()) {
+        channel->set_deadline(chrono::steady_clock::now() + (deadline - chrono::system_clock::now()));
+    }
 
     return grpc::Status::OK;
 }
+
+json BackendServiceImpl::wait_result(ServerContext* context, ServerTaskChannel &channel) {
+    while (true) {
+        optional<json> result = channel.pop_for(chrono::milliseconds(100));
+        if (result) {
+            return std::move(*result);
+        }
+        if (context->IsCancelled()) {
+            channel.cancel();
+        }
+    }
+}
+
+grpc::Status BackendServiceImpl::error_status(const ServerTaskChannel &channel, const json &result) {
+    grpc::StatusCode code = grpc::StatusCode::INTERNAL;
+    if (channel.is_cancelled()) {
+        code = grpc::StatusCode::CANCELLED;
+    } else if (result.value("status", 500) == 429) {
+        code = grpc::StatusCode::RESOURCE_EXHAUSTED;
+    } else if (result.value("status", 500) == 400) {
+        code = grpc::StatusCode::INVALID_ARGUMENT;
+    }
+    return grpc::Status(code, result["error"].get<string>());
+}
@@ -4,17 +4,18 @@
 #include "backend.pb.h"
 #include "backend.grpc.pb.h"
 #include "utils.h"
+#include "model_registry.h"
+#include "tokenizer_pool.h"
 
 using namespace backend;
 using namespace grpc;
 
 class BackendServiceImpl: public Backend::Service {
-    ServerRequestTaskQueue * _request_task_queue;
-    ServerResponseTaskQueue * _response_task_queue;
+    ModelRegistry * _registry;
+    TokenizerPool * _tokenizer_pool;
 
 public:
-    BackendServiceImpl(ServerRequestTaskQueue * request_task_queue, 
-                       ServerResponseTaskQueue * response_task_queue);
+    BackendServiceImpl(ModelRegistry * registry, TokenizerPool * tokenizer_pool);
     ~BackendServiceImpl();
 
 public:
@@ -29,6 +30,30 @@ public:
     grpc::Status Predict(ServerContext* context, 
                          const PredictOptions* request, 
                          Reply* response);
+
+    grpc::Status PredictStream(ServerContext* context, 
+                               const PredictOptions* request, 
+                               ServerWriter<Reply>* writer);
+
+    grpc::Status Embedding(ServerContext* context, 
+                           const PredictOptions* request, 
+                           EmbeddingResult* result);
+
+    grpc::Status TokenizeString(ServerContext* context, 
+                                const PredictOptions* request, 
+                                TokenizationResponse* response);
+
+    grpc::Status Status(ServerContext* context, 
+                        const HealthMessage* request, 
+                        StatusResponse* response);
+
+private:
+    json make_request_data(const PredictOptions* request) const;
+    grpc::Status get_model(ServerContext* context, shared_ptr<ServerModel> &model);
+    grpc::Status submit(ServerContext* context, const json &data, ServerTask::TaskType type,
+                        shared_ptr<ServerModel> &model, shared_ptr<ServerTaskChannel> &channel);
+    json wait_result(ServerContext* context, ServerTaskChannel &channel);
+    grpc::Status error_status(const ServerTaskChannel &channel, const json &result);
 };
 
 #endif
@@ -0,0 +1,39 @@
+#include "tokenizer_pool.h"
+
+#include <algorithm>
+#include <limits>
+
+vector<vector<int>> TokenizerPool::encode(shared_ptr<ServerModel> model, const vector<string> &texts) {
+    const chatglm::BaseTokenizer *tokenizer = model->pipeline().tokenizer.get();
+    vector<vector<int>> ids(texts.size());
+    // one job per thread at most, each encodes a contiguous slice
+    const size_t num_jobs = min(texts.size(), (size_t)_pool.size());
+    vector<future<void>> jobs;
+    for (size_t j = 0; j < num_jobs; j++) {
+        const size_t begin = texts.size() * j / num_jobs;
+        const size_t end = texts.size() * (j + 1) / num_jobs;
+        jobs.emplace_back(_pool.run([tokenizer, &texts, &ids, begin, end] {
+            for (size_t i = begin; i < end; i++) {
+                ids[i] = tokenizer->encode(texts[i], numeric_limits<int>::max());
+            }
+        }));
+    }
+    // wait for all of them before rethrowing, they write into ids
+    for (auto &job : jobs) {
+        job.wait();
+    }
+    for (auto &job : jobs) {
+        job.get();
+    }
+    return ids;
+}
+
+vector<int> TokenizerPool::encode_messages(shared_ptr<ServerModel> model,
+                                           const vector<chatglm::ChatMessage> &messages) {
+    const chatglm::BaseTokenizer *tokenizer = model->pipeline().tokenizer.get();
+    vector<int> ids;
+    _pool.run([tokenizer, &messages, &ids] {
+        ids = tokenizer->encode_messages(messages, numeric_limits<int>::max());
+    }).get();
+    return ids;
+}
@@ -0,0 +1,28 @@
+#ifndef _TOKENIZER_POOL_H
+#define _TOKENIZER_POOL_H
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "utils.h"
+#include "model_registry.h"
+#include "../../chatglm.h"
+
+// Threads that tokenize requests for the front ends, so that counting tokens never waits behind the scheduler of a
+// model. Tokenizers are only read, so any number of them may encode at the same time.
+class TokenizerPool {
+    ThreadPool _pool;
+
+    public:
+        TokenizerPool(int num_threads) : _pool(num_threads) {}
+
+        // Token ids of each text without truncation. A batch is split across the threads, and the first exception
+        // of the tokenizer is rethrown.
+        vector<vector<int>> encode(shared_ptr<ServerModel> model, const vector<string> &texts);
+
+        // token ids of a conversation in the chat format of the model
+        vector<int> encode_messages(shared_ptr<ServerModel> model, const vector<chatglm::ChatMessage> &messages);
+};
+
+#endif
@@ -1,29 +1,132 @@
 #ifndef _UTILS_H
 #define _UTILS_H
 
+#include <algorithm>
+#include <atomic>
 #include <iostream>
+#include <condition_variable>
 #include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <optional>
 #include <thread>
+#include <vector>
 
-#include "json.hpp"
+#include "../../third_party/nlohmann/json.hpp"
+#include "../../chatglm.h"
 
 using namespace std;
 using json = nlohmann::json;
 
+// Results of a single request: stream deltas followed by the final response, in order. Only the waiting thread is
+// woken up, or the notify callback called for an event loop that does not wait. The waiting side cancels the request
+// through the channel when its client goes away.
+class ServerTaskChannel {
+    mutex _m;
+    condition_variable _cv;
+    deque<json> _results;
+    function<void()> _notify;
+
+    chatglm::CancellationToken _cancel_token;
+
+    public:
+        void push(json result) {
+            function<void()> notify;
+            {
+                lock_guard lk(_m);
+                _results.push_back(std::move(result));
+                notify = _notify;
+            }
+            _cv.notify_one();
+            if (notify) {
+                notify();
+            }
+        }
+
+        // call notify from the pushing thread after each result, and once right away for results already there
+        void set_notify(function<void()> notify) {
+            bool has_results;
+            {
+                lock_guard lk(_m);
+                _notify = notify;
+                has_results = !_results.empty();
+            }
+            if (notify && has_results) {
+                notify();
+            }
+        }
+
+        optional<json> try_pop() {
+            lock_guard lk(_m);
+            if (_results.empty()) {
+                return nullopt;
+            }
+            json result = std::move(_results.front());
+            _results.pop_front();
+
+            return result;
+        }
+
+        json pop() {
+            unique_lock lk(_m);
+            _cv.wait(lk, [this] { return !_results.empty(); });
+            json result = std::move(_results.front());
+            _results.pop_front();
+
+            return result;
+        }
+
+        // wait at most timeout, so that the caller can check on its client in between
+        optional<json> pop_for(chrono::milliseconds timeout) {
+            unique_lock lk(_m);
+            if (!_cv.wait_for(lk, timeout, [this] { return !_results.empty(); })) {
+                return nullopt;
+            }
+            json result = std::move(_results.front());
+            _results.pop_front();
+
+            return result;
+        }
+
+        void cancel() { _cancel_token.cancel(); }
+        void set_deadline(chrono::steady_clock::time_point deadline) { _cancel_token.set_deadline(deadline); }
+        bool is_cancelled() const { return _cancel_token.is_cancelled(); }
+};
+
 struct ServerTask {
     enum TaskType {
         TASK_COMPLETION = 0,
-        TASK_CHAT_COMPLETION
+        TASK_CHAT_COMPLETION,
+        TASK_EMBEDDING
+    };
+
+    // requests of a higher class are always admitted first
+    enum Priority {
+        PRIORITY_INTERACTIVE = 0,
+        PRIORITY_BATCH,
+        NUM_PRIORITIES
     };
 
     int _id;
     json _data;
     TaskType _type;
+    shared_ptr<ServerTaskChannel> _channel;
+
+    Priority _priority = PRIORITY_INTERACTIVE;
+    chatglm::GenerationConfig _gen_config;
+    vector<int> _input_ids;
+    vector<vector<int>> _embedding_inputs; // one per input of an embedding task
+    chatglm::PoolingType _pooling = chatglm::PoolingType::MEAN;
+    int _cost = 0; // kv cache tokens the request may take: prompt plus new tokens, or all embedding inputs
+    chrono::steady_clock::time_point _enqueue_time;
 
-    ServerTask(int id, json data, TaskType taskType) {
+    ServerTask(int id, json data, TaskType taskType, shared_ptr<ServerTaskChannel> channel) {
         _id = id;
-        _data = data;
+        _data = std::move(data);
         _type = taskType;
+        _channel = std::move(channel);
     }
 
     void dump() {
@@ -31,64 +134,234 @@ struct ServerTask {
     }
 };
 
-class ServerRequestTaskQueue {
+// Fixed threads running jobs in submission order.
+class ThreadPool {
+    vector<thread> _threads;
+
     mutex _m;
     condition_variable _cv;
-    deque<ServerTask> _tasks;
-
-    unsigned int _id = 0;
+    deque<packaged_task<void()>> _jobs;
+    bool _closed = false;
 
     public:
-        int push(json &data, ServerTask::TaskType taskType) {
-            lock_guard lk(_m);
-            int taskId = _id++;
-            _tasks.push_back(ServerTask(taskId, data, taskType));
+        ThreadPool(int num_threads) {
+            for (int i = 0; i < max(num_threads, 1); i++) {
+                _threads.emplace_back([this] { work(); });
+            }
+        }
 
+        // finishes the jobs queued
+        ~ThreadPool() {
+            {
+                lock_guard lk(_m);
+                _closed = true;
+            }
+            _cv.notify_all();
+            for (auto &t : _threads) {
+                t.join();
+            }
+        }
+
+        ThreadPool(const ThreadPool &) = delete;
+        ThreadPool &operator=(const ThreadPool &) = delete;
+
+        int size() const { return _threads.size(); }
+
+        // the future rethrows what the job throws
+        future<void> run(function<void()> job) {
+            packaged_task<void()> task(std::move(job));
+            future<void> result = task.get_future();
+            {
+                lock_guard lk(_m);
+                _jobs.emplace_back(std::move(task));
+            }
             _cv.notify_one();
+            return result;
+        }
 
-            return taskId;
+    private:
+        void work() {
+            while (true) {
+                packaged_task<void()> task;
+                {
+                    unique_lock lk(_m);
+                    _cv.wait(lk, [this] { return _closed || !_jobs.empty(); });
+                    if (_jobs.empty()) {
+                        return;
+                    }
+                    task = std::move(_jobs.front());
+                    _jobs.pop_front();
+                }
+                task();
+            }
         }
+};
 
-        ServerTask pop() {
-            unique_lock lk(_m);
-            _cv.wait(lk);
-            ServerTask task = _tasks.front();
-            _tasks.pop_front();
+// Lock-free multi-producer single-consumer queue (Vyukov's MPSC node queue).
+template <typename T>
+class MPSCQueue {
+    struct Node {
+        atomic<Node *> _next{nullptr};
+        optional<T> _value;
+    };
+
+    atomic<Node *> _head; // last pushed node, shared by producers
+    Node *_tail;          // stub node before the front value, owned by the consumer
 
-            return task;
+    public:
+        MPSCQueue() {
+            _tail = new Node;
+            _head.store(_tail);
+        }
+
+        MPSCQueue(const MPSCQueue &) = delete;
+        MPSCQueue &operator=(const MPSCQueue &) = delete;
+
+        ~MPSCQueue() {
+            while (_tail) {
+                Node *next = _tail->_next.load();
+                delete _tail;
+                _tail = next;
+            }
+        }
+
+        void push(T value) {
+            Node *node = new Node;
+            node->_value.emplace(std::move(value));
+            Node *prev = _head.exchange(node);
+            prev->_next.store(node);
+        }
+
+        // consumer only. A producer between exchange and link shows up as empty.
+        T *front() {
+            Node *next = _tail->_next.load();
+            return next ? &*next->_value : nullptr;
+        }
+
+        // consumer only
+        optional<T> try_pop() {
+            Node *next = _tail->_next.load();
+            if (!next) {
+                return nullopt;
+            }
+            delete _tail;
+            _tail = next;
+            optional<T> value = std::move(next->_value);
+            next->_value.reset();
+
+            return value;
         }
 };
 
-class ServerResponseTaskQueue {
+// Bounded queue of requests with one lock-free queue per priority class. Producers never block each other; the
+// consumer only takes the mutex to sleep when all queues are empty.
+class ServerRequestTaskQueue {
+    MPSCQueue<ServerTask> _queues[ServerTask::NUM_PRIORITIES];
+
+    // limits on the number of queued requests and on their total cost, 0 for unbounded
+    const int _max_size;
+    const int64_t _max_cost;
+    atomic<int> _size{0};
+    atomic<int64_t> _cost{0};
+
+    atomic<bool> _waiting{false};
+    atomic<bool> _closed{false};
     mutex _m;
     condition_variable _cv;
-    deque<ServerTask> _tasks;
+
+    atomic<unsigned int> _id{0};
 
     public:
+        ServerRequestTaskQueue(int max_size = 0, int64_t max_cost = 0) : _max_size(max_size), _max_cost(max_cost) {
+        }
+
+        int next_id() { return _id++; }
+
+        int size() const { return _size; }
+
+        // enqueue a request, or return false without taking it when the queue is full
         bool push(ServerTask task) {
-            {
+            const int cost = task._cost;
+            if (_size++ >= _max_size && _max_size > 0) {
+                _size--;
+                return false;
+            }
+            if (_cost.fetch_add(cost) + cost > _max_cost && _max_cost > 0) {
+                _cost -= cost;
+                _size--;
+                return false;
+            }
+            _queues[task._priority].push(std::move(task));
+
+            // the consumer announces itself before its last check for tasks, so either it sees this task or we see it
+            // waiting
+            if (_waiting.load()) {
                 lock_guard lk(_m);
-                _tasks.push_back(task);
+                _cv.notify_one();
             }
-            _cv.notify_all();
 
             return true;
         }
 
-        json result(int taskId) {
+        // wake up the consumer for good, once it has popped the remaining tasks
+        void close() {
+            _closed = true;
+            lock_guard lk(_m);
+            _cv.notify_one();
+        }
+
+        // consumer only: block until a task arrives, nullopt once the queue is closed and empty
+        optional<ServerTask> pop() {
             while (true) {
+                optional<ServerTask> task = try_pop();
+                if (task) {
+                    return task;
+                }
                 unique_lock lk(_m);
-                _cv.wait(lk);
-
-                for (deque<ServerTask>::iterator it = _tasks.begin();
-                     it != _tasks.end(); it++) {
-                    if ((*it)._id == taskId) {
-                        ServerTask task = *it;
-                        _tasks.erase(it);
-                        return task._data;
+                _waiting.store(true);
+                task = try_pop();
+                if (!task) {
+                    if (_closed) {
+                        return nullopt;
                     }
+                    _cv.wait(lk);
+                }
+                _waiting.store(false);
+                if (task) {
+                    return task;
+                }
+            }
+        }
+
+        // consumer only
+        optional<ServerTask> try_pop() {
+            for (auto &queue : _queues) {
+                optional<ServerTask> task = queue.try_pop();
+                if (task) {
+                    release(*task);
+                    return task;
                 }
             }
+            return nullopt;
+        }
+
+        // consumer only: pop a task that was enqueued before deadline, oldest of its class first
+        optional<ServerTask> pop_expired(chrono::steady_clock::time_point deadline) {
+            for (auto &queue : _queues) {
+                ServerTask *task = queue.front();
+                if (task && task->_enqueue_time < deadline) {
+                    optional<ServerTask> expired = queue.try_pop();
+                    release(*expired);
+                    return expired;
+                }
+            }
+            return nullopt;
+        }
+
+    private:
+        void release(const ServerTask &task) {
+            _cost -= task._cost;
+            _size--;
         }
 };
 
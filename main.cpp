@@ -1,4 +1,6 @@
 #include "chatglm.h"
+#include "third_party/nlohmann/json.hpp"
+#include <algorithm>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
@@ -23,6 +25,8 @@ static inline InferenceMode to_inference_mode(const std::string &s) {
 
 struct Args {
     std::string model_path = "chatglm-ggml.bin";
+    std::string draft_model_path;
+    int num_draft_tokens = 4;
     InferenceMode mode = INFERENCE_MODE_CHAT;
     bool sync = false;
     std::string prompt = "你好";
@@ -36,7 +40,14 @@ struct Args {
     float temp = 0.95;
     float repeat_penalty = 1.0;
     int num_threads = 0;
+    int prefill_chunk_size = 0;
+    int num_beams = 1;
+    int num_return_sequences = 1;
     bool verbose = false;
+    std::string trace_path;
+    std::string batch_file_path;
+    std::string output_path;
+    int max_batch_size = 8;
 };
 
 static void usage(const std::string &prog) {
@@ -45,6 +56,8 @@ static void usage(const std::string &prog) {
 options:
   -h, --help            show this help message and exit
   -m, --model PATH      model path (default: chatglm-ggml.bin)
+  --draft_model PATH    smaller model sharing the vocabulary that drafts tokens for speculative decoding
+  --num_draft_tokens N  number of tokens drafted per step of speculative decoding (default: 4)
   --mode                inference mode chosen from {chat, generate} (default: chat)
   --sync                synchronized generation without streaming
   -p, --prompt PROMPT   prompt to start generation with (default: 你好)
@@ -61,7 +74,17 @@ options:
   --temp N              temperature (default: 0.95)
   --repeat_penalty N    penalize repeat sequence of tokens (default: 1.0, 1.0 = disabled)
   -t, --threads N       number of threads for inference
+  --prefill_chunk_size N
+                        prefill the prompt N tokens at a time to bound memory, 0 for all at once (default: 0)
+  --num_beams N         beam search with N beams in non-interactive mode, 1 to decode a single sequence (default: 1)
+  --num_return_sequences N
+                        number of outputs generated for the prompt in non-interactive generate mode (default: 1)
   -v, --verbose         display verbose output including config/system/performance info
+  --trace PATH          write timing spans of the run to PATH as a chrome://tracing / Perfetto trace
+  --batch-file PATH     run the requests of the jsonl file at PATH in batches instead, one per line as
+                        {"id": ..., "prompt": ...} or {"id": ..., "messages": [...]}
+  -o, --output PATH     jsonl file the results of --batch-file are written to as they finish (default: stdout)
+  --max_batch_size N    max number of requests of --batch-file generated at once (default: 8)
 )";
 }
 
@@ -84,6 +107,10 @@ static Args parse_args(const std::vector<std::string> &argv) {
             exit(EXIT_SUCCESS);
         } else if (arg == "-m" || arg == "--model") {
             args.model_path = argv.at(++i);
+        } else if (arg == "--draft_model") {
+            args.draft_model_path = argv.at(++i);
+        } else if (arg == "--num_draft_tokens") {
+            args.num_draft_tokens = std::stoi(argv.at(++i));
         } else if (arg == "--mode") {
             args.mode = to_inference_mode(argv.at(++i));
         } else if (arg == "--sync") {
@@ -114,8 +141,22 @@ static Args parse_args(const std::vector<std::string> &argv) {
             args.repeat_penalty = std::stof(argv.at(++i));
         } else if (arg == "-t" || arg == "--threads") {
             args.num_threads = std::stoi(argv.at(++i));
+        } else if (arg == "--prefill_chunk_size") {
+            args.prefill_chunk_size = std::stoi(argv.at(++i));
+        } else if (arg == "--num_beams") {
+            args.num_beams = std::stoi(argv.at(++i));
+        } else if (arg == "--num_return_sequences") {
+            args.num_return_sequences = std::stoi(argv.at(++i));
         } else if (arg == "-v" || arg == "--verbose") {
             args.verbose = true;
+        } else if (arg == "--trace") {
+            args.trace_path = argv.at(++i);
+        } else if (arg == "--batch-file" || arg == "--batch_file") {
+            args.batch_file_path = argv.at(++i);
+        } else if (arg == "-o" || arg == "--output") {
+            args.output_path = argv.at(++i);
+        } else if (arg == "--max_batch_size") {
+            args.max_batch_size = std::stoi(argv.at(++i));
         } else {
             std::cerr << "Unknown argument: " << arg << std::endl;
             usage(argv.at(0));
@@ -172,6 +213,9 @@ static void chat(Args &args) {
     ggml_time_init();
     int64_t start_load_us = ggml_time_us();
     chatglm::Pipeline pipeline(args.model_path);
+    if (!args.draft_model_path.empty()) {
+        pipeline.load_draft_model(args.draft_model_path);
+    }
     int64_t end_load_us = ggml_time_us();
 
     std::string model_name = pipeline.model->config.model_type_name();
@@ -185,7 +229,10 @@ static void chat(Args &args) {
     auto streamer = std::make_unique<chatglm::StreamerGroup>(std::move(streamers));
 
     chatglm::GenerationConfig gen_config(args.max_length, args.max_new_tokens, args.max_context_length, args.temp > 0,
-                                         args.top_k, args.top_p, args.temp, args.repeat_penalty, args.num_threads);
+                                         args.top_k, args.top_p, args.temp, args.repeat_penalty, args.num_threads,
+                                         args.num_draft_tokens, args.prefill_chunk_size);
+    gen_config.num_beams = args.num_beams;
+    gen_config.num_return_sequences = args.num_return_sequences;
 
     if (args.verbose) {
         std::cout << "system info: | "
@@ -211,10 +258,18 @@ static void chat(Args &args) {
                   << "top_p = " << args.top_p << " | "
                   << "temperature = " << args.temp << " | "
                   << "repetition_penalty = " << args.repeat_penalty << " | "
-                  << "num_threads = " << args.num_threads << " |\n";
+                  << "num_threads = " << args.num_threads << " | "
+                  << "num_draft_tokens = " << args.num_draft_tokens << " | "
+                  << "prefill_chunk_size = " << args.prefill_chunk_size << " | "
+                  << "num_beams = " << args.num_beams << " | "
+                  << "num_return_sequences = " << args.num_return_sequences << " |\n";
 
         std::cout << "loaded " << pipeline.model->config.model_type_name() << " model from " << args.model_path
                   << " within: " << (end_load_us - start_load_us) / 1000.f << " ms\n";
+        if (pipeline.draft) {
+            std::cout << "loaded " << pipeline.draft->model->config.model_type_name() << " draft model from "
+                      << args.draft_model_path << "\n";
+        }
 
         std::cout << std::endl;
     }
@@ -242,6 +297,8 @@ static void chat(Args &args) {
             << "Welcome to ChatGLM.cpp! Ask whatever you want. Type 'clear' to clear context. Type 'stop' to exit.\n"
             << "\n";
 
+        // keep the kv cache of the conversation between turns
+        chatglm::ChatSession session(pipeline);
         std::vector<chatglm::ChatMessage> messages = system_messages;
         if (!args.system.empty()) {
             std::cout << std::setw(model_name.size()) << std::left << "System"
@@ -278,11 +335,12 @@ static void chat(Args &args) {
             }
             if (prompt == "clear") {
                 messages = system_messages;
+                session.reset();
                 continue;
             }
             messages.emplace_back(std::move(role), std::move(prompt));
             std::cout << model_name << " > ";
-            chatglm::ChatMessage output = pipeline.chat(messages, gen_config, streamer.get());
+            chatglm::ChatMessage output = session.chat(messages, gen_config, streamer.get());
             if (args.sync) {
                 print_message(output);
             }
@@ -301,6 +359,11 @@ static void chat(Args &args) {
             if (args.sync) {
                 print_message(output);
             }
+        } else if (args.num_return_sequences > 1) {
+            std::vector<std::string> outputs = pipeline.generate_sequences(args.prompt, gen_config);
+            for (size_t i = 0; i < outputs.size(); i++) {
+                std::cout << "[" << i << "] " << outputs[i] << "\n";
+            }
         } else {
             std::string output = pipeline.generate(args.prompt, gen_config, streamer.get());
             if (args.sync) {
@@ -313,6 +376,114 @@ static void chat(Args &args) {
     }
 }
 
+// nearest rank percentile of sorted values
+static double percentile(const std::vector<double> &sorted, double p) {
+    if (sorted.empty()) {
+        return 0;
+    }
+    size_t rank = std::ceil(p / 100 * sorted.size());
+    return sorted[std::max(rank, (size_t)1) - 1];
+}
+
+static double per_second(double count, double seconds) { return seconds > 0 ? count / seconds : 0; }
+
+static void batch(const Args &args) {
+    using json = nlohmann::json;
+
+    ggml_time_init();
+    // every running request takes kv cache for its whole output
+    chatglm::Pipeline pipeline(args.model_path, args.max_length * args.max_batch_size);
+    if (!args.draft_model_path.empty()) {
+        std::cerr << "speculative decoding is not supported in batch mode, ignoring the draft model\n";
+    }
+
+    chatglm::GenerationConfig gen_config(args.max_length, args.max_new_tokens, args.max_context_length, args.temp > 0,
+                                         args.top_k, args.top_p, args.temp, args.repeat_penalty, args.num_threads,
+                                         args.num_draft_tokens, args.prefill_chunk_size);
+
+    std::ifstream fin(args.batch_file_path);
+    CHATGLM_CHECK(fin) << "cannot open file " << args.batch_file_path;
+    std::ofstream fout;
+    if (!args.output_path.empty()) {
+        fout.open(args.output_path);
+        CHATGLM_CHECK(fout) << "cannot open file " << args.output_path;
+    }
+    std::ostream &os = args.output_path.empty() ? std::cout : fout;
+
+    struct Request {
+        json id;
+        size_t num_prompt_tokens;
+        int64_t start_us;
+    };
+    std::vector<Request> requests;
+    std::vector<double> latencies_ms;
+    int64_t num_completion_tokens = 0;
+
+    // read a request from the file whenever a slot is free, so that the file is never held in memory
+    auto next_input = [&](std::vector<int> &input_ids) {
+        std::string line;
+        while (std::getline(fin, line)) {
+            if (line.find_first_not_of(" \t\r") == std::string::npos) {
+                continue;
+            }
+            json request = json::parse(line);
+            if (request.contains("messages")) {
+                std::vector<chatglm::ChatMessage> messages;
+                for (const auto &message : request["messages"]) {
+                    messages.emplace_back(message["role"].get<std::string>(), message["content"].get<std::string>());
+                }
+                input_ids = pipeline.tokenizer->encode_messages(messages, args.max_context_length);
+            } else if (args.mode == INFERENCE_MODE_CHAT) {
+                std::vector<chatglm::ChatMessage> messages;
+                if (!args.system.empty()) {
+                    messages.emplace_back(chatglm::ChatMessage::ROLE_SYSTEM, args.system);
+                }
+                messages.emplace_back(chatglm::ChatMessage::ROLE_USER, request["prompt"].get<std::string>());
+                input_ids = pipeline.tokenizer->encode_messages(messages, args.max_context_length);
+            } else {
+                input_ids = pipeline.tokenizer->encode(request["prompt"].get<std::string>(), args.max_context_length);
+            }
+            requests.push_back({request.value("id", json(requests.size())), input_ids.size(), ggml_time_us()});
+            return true;
+        }
+        return false;
+    };
+
+    auto on_output = [&](size_t index, std::vector<int> &output_ids) {
+        const Request &request = requests.at(index);
+        const double latency_ms = (ggml_time_us() - request.start_us) / 1000.;
+        std::vector<int> new_ids(output_ids.begin() + request.num_prompt_tokens, output_ids.end());
+        std::string output = args.mode == INFERENCE_MODE_CHAT ? pipeline.tokenizer->decode_message(new_ids).content
+                                                                : pipeline.tokenizer->decode(new_ids);
+        json result{{"id", request.id},
+                    {"output", output},
+                    {"prompt_tokens", request.num_prompt_tokens},
+                    {"completion_tokens", new_ids.size()},
+                    {"latency_ms", latency_ms}};
+        os << result.dump(-1, ' ', false, json::error_handler_t::replace) << std::endl;
+        latencies_ms.emplace_back(latency_ms);
+        num_completion_tokens += new_ids.size();
+    };
+
+    chatglm::BatchGenerationStats stats;
+    const int64_t start_us = ggml_time_us();
+    pipeline.model->generate_batch(next_input, on_output, gen_config, args.max_batch_size, pipeline.tokenizer.get(),
+                                   &stats);
+    const double elapsed_s = (ggml_time_us() - start_us) / 1e6;
+
+    std::sort(latencies_ms.begin(), latencies_ms.end());
+    std::cerr << std::fixed << std::setprecision(2) << "requests: " << latencies_ms.size() << " in " << elapsed_s
+              << " s (" << per_second(latencies_ms.size(), elapsed_s) << " requests/s)\n"
+              << "prefill: " << stats.prefill_tokens << " tokens, "
+              << per_second(stats.prefill_tokens, stats.prefill_seconds) << " tokens/s\n"
+              << "decode: " << stats.decode_tokens << " tokens, "
+              << per_second(stats.decode_tokens, stats.decode_seconds) << " tokens/s\n"
+              << "generated: " << num_completion_tokens << " tokens, " << per_second(num_completion_tokens, elapsed_s)
+              << " tokens/s\n"
+              << "latency: p50 " << percentile(latencies_ms, 50) << " ms | p90 " << percentile(latencies_ms, 90)
+              << " ms | p99 " << percentile(latencies_ms, 99) << " ms" << std::endl;
+}
+
 int main(int argc, char **argv) {
 #ifdef _WIN32
     SetConsoleOutputCP(CP_UTF8);
@@ -321,7 +492,17 @@ int main(int argc, char **argv) {
 
     try {
         Args args = parse_args(argc, argv);
-        chat(args);
+        chatglm::Tracer::set_enabled(!args.trace_path.empty());
+        if (args.batch_file_path.empty()) {
+            chat(args);
+        } else {
+            batch(args);
+        }
+        if (!args.trace_path.empty()) {
+            std::ofstream fout(args.trace_path);
+            CHATGLM_CHECK(fout) << "cannot open file " << args.trace_path;
+            chatglm::Tracer::dump(fout);
+        }
     } catch (std::exception &e) {
         std::cerr << e.what() << std::endl;
         exit(EXIT_FAILURE);